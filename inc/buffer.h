@@ -0,0 +1,172 @@
+/*
+    socklite -- a C++ socket library for Linux/Windows/iOS
+    Copyright (C) 2014  Push Chen
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    You can connect me by email: littlepush@gmail.com, 
+    or @me on twitter: @littlepush
+*/
+
+#pragma once
+
+#ifndef __SOCK_LITE_BUFFER_H__
+#define __SOCK_LITE_BUFFER_H__
+
+#include "socket.h"
+#include <atomic>
+#include <vector>
+#include <sys/uio.h>
+
+// Size of each pooled chunk
+#define SL_BUFFER_CHUNK_SIZE        16384       // 16K
+// Size of the large chunk, can hold any UDP datagram(like GRO merged packets)
+#define SL_BUFFER_LARGE_CHUNK_SIZE  65536       // 64K
+// Max count of idle chunks kept in the pool, 16M in default
+#define SL_BUFFER_POOL_MAX_IDLE     1024
+// Max count of idle large chunks kept in the pool, 16M in default
+#define SL_BUFFER_POOL_MAX_LARGE_IDLE   256
+
+/*
+    A pooled memory chunk.
+    The content of the chunk is never initialized. The chunk is reference
+    counted, when the last reference is released, the chunk will be 
+    returned to the pool instead of being freed.
+*/
+class sl_buffer_chunk
+{
+    friend class sl_buffer_pool;
+protected:
+    atomic<uint32_t>        refs_;
+    size_t                  capacity_;
+
+    // The data follows the chunk header in the same allocation.
+    sl_buffer_chunk(size_t capacity);
+    static sl_buffer_chunk *create(size_t capacity);
+    static void destroy(sl_buffer_chunk *chunk);
+public:
+    char *data();
+    size_t capacity() const;
+
+    // Reference count
+    void retain();
+    void release();
+};
+
+/*
+    The global chunk pool, thread safe.
+*/
+class sl_buffer_pool
+{
+protected:
+    mutex                       lock_;
+    vector<sl_buffer_chunk *>   idle_;
+    vector<sl_buffer_chunk *>   large_idle_;
+
+    sl_buffer_pool();
+public:
+    ~sl_buffer_pool();
+
+    // Get a chunk from the pool, the reference count of the chunk is 1.
+    // If <min_capacity> is larger than SL_BUFFER_CHUNK_SIZE, will return
+    // a large chunk, whose capacity is SL_BUFFER_LARGE_CHUNK_SIZE.
+    // Chunks larger than that are allocated directly and not pooled.
+    sl_buffer_chunk *alloc(size_t min_capacity = SL_BUFFER_CHUNK_SIZE);
+    // Return the chunk to the pool, invoked by sl_buffer_chunk::release
+    void recycle(sl_buffer_chunk *chunk);
+
+    // Singleton Pool
+    static sl_buffer_pool &pool();
+};
+
+/*
+    A read-only view of a piece of data in a pooled chunk.
+    The view holds a reference of the chunk, the chunk will not be reused
+    until all views on it have been released.
+*/
+class sl_buffer_view
+{
+protected:
+    sl_buffer_chunk         *chunk_;
+    const char              *data_;
+    size_t                  size_;
+public:
+    sl_buffer_view();
+    sl_buffer_view(sl_buffer_chunk *chunk, size_t offset, size_t size);
+    sl_buffer_view(const sl_buffer_view &rhs);
+    sl_buffer_view(sl_buffer_view &&rrhs);
+    ~sl_buffer_view();
+
+    sl_buffer_view & operator = (const sl_buffer_view &rhs);
+    sl_buffer_view & operator = (sl_buffer_view &&rrhs);
+
+    const char *data() const;
+    size_t size() const;
+
+    // Get a part of current view, share the same chunk.
+    sl_buffer_view sub(size_t offset, size_t length) const;
+
+    // Release the chunk before the view is destroyed.
+    void release();
+};
+
+typedef vector<sl_buffer_view>      sl_buffer_views;
+
+// Copy all views into a string
+void sl_buffer_views_to_string(const sl_buffer_views &views, string &buffer);
+
+/*
+    The receive ring of a socket.
+    The ring offers one pooled chunk for a read action, and one more each 
+    time the last read filled all the offered space, up to <max_iov>.
+    Use <prepare> to get the iovec for readv, and <commit> the received
+    size to get the views of the data. <shrink> the ring once the socket 
+    has no more data, so an idle socket holds no chunk.
+*/
+class sl_buffer_ring
+{
+public:
+    enum { max_iov = 4 };
+protected:
+    vector<sl_buffer_chunk *>   chunks_;
+    // Write offset in the first chunk
+    size_t                      offset_;
+    // Count of chunks to offer in the next prepare
+    size_t                      iov_count_;
+    // Space offered in the last prepare
+    size_t                      space_;
+public:
+    sl_buffer_ring();
+    ~sl_buffer_ring();
+
+    // Fill the iovec with the free space of the ring, return the iov count,
+    // the <iov> must have at least <max_iov> items.
+    int prepare(struct iovec *iov, size_t &space);
+    // Commit the received size, append the views of the data.
+    void commit(size_t received, sl_buffer_views &views);
+    // Release the ring's references of all chunks, the data in them is
+    // still kept alive by the views.
+    void shrink();
+};
+
+#endif
+// sock.lite.buffer.h
+
+/*
+ Push Chen.
+ littlepush@gmail.com
+ http://pushchen.com
+ http://twitter.com/littlepush
+ */
@@ -82,14 +82,21 @@
 
 using namespace std;
 
+// Max size of a dns packet over udp without EDNS0
+#define SL_DNS_UDP_PACKET_SIZE          512
+// Default udp payload size in the OPT record, which avoids ip fragmentation
+#define SL_DNS_EDNS_PAYLOAD_SIZE        1232
+
 // DNS Question Type
 typedef enum {
     sl_dns_qtype_host           = 0x01,     // Host(A) record
     sl_dns_qtype_ns             = 0x02,     // Name server (NS) record
     sl_dns_qtype_cname          = 0x05,     // Alias(CName) record
+    sl_dns_qtype_soa            = 0x06,     // Start of authority(SOA) record
     sl_dns_qtype_ptr            = 0x0C,     // Reverse-lookup(PTR) record
     sl_dns_qtype_mx             = 0x0F,     // Mail exchange(MX) record
     sl_dns_qtype_srv            = 0x21,     // Service(SRV) record
+    sl_dns_qtype_opt            = 0x29,     // EDNS0 pseudo(OPT) record
     sl_dns_qtype_ixfr           = 0xFB,     // Incremental zone transfer(IXFR) record
     sl_dns_qtype_axfr           = 0xFC,     // Standard zone transfer(AXFR) record
     sl_dns_qtype_all            = 0xFF      // All records
@@ -132,6 +139,76 @@ typedef enum {
     sl_dns_rcode_badalg             = 21
 } sl_dns_rcode;
 
+// The section of a resource record in the packet
+typedef enum {
+    sl_dns_section_question     = 0,
+    sl_dns_section_answer       = 1,
+    sl_dns_section_authority    = 2,
+    sl_dns_section_additional   = 3
+} sl_dns_section;
+
+// A resource record in the dns packet, all offsets are from the begin of 
+// the packet. The name is not decompressed, use sl_dns_view::get_name.
+// A question has no ttl, and its rdata_offset is the end of the question.
+typedef struct tag_sl_dns_rr {
+    sl_dns_section  section;
+    uint16_t        name_offset;
+    uint16_t        type;
+    uint16_t        rclass;
+    uint32_t        ttl;
+    uint16_t        ttl_offset;
+    uint16_t        rdata_offset;
+    uint16_t        rdata_length;
+} sl_dns_rr;
+
+class sl_dns_packet;
+
+// A non-owning view of a dns packet, the buffer must outlive the view
+class sl_dns_view {
+    enum { packet_header_size = sizeof(uint16_t) * 6 };
+protected:
+    const char *    data_;
+    size_t          length_;
+public:
+    sl_dns_view(const char *data, size_t length);
+    sl_dns_view(const string& packet);
+    sl_dns_view(const sl_dns_packet& packet);
+
+    // The packet has a full header and can be addressed by 16bits offsets
+    bool            is_validate() const;
+
+    uint16_t        get_transaction_id() const;
+    bool            get_is_response_request() const;
+    bool            get_is_truncation() const;
+    sl_dns_rcode    get_resp_code() const;
+    uint16_t        get_count(sl_dns_section section) const;
+
+    const char *    data() const;
+    size_t          size() const;
+
+    // Decompress the name at the offset, return false if the name is invalid.
+    bool            get_name(uint16_t offset, string& name) const;
+
+    // Single pass iterator of all resource records in the packet, in the order
+    // of question, answer, authority and additional. No memory allocation.
+    class iterator {
+        const sl_dns_view *     view_;
+        size_t                  offset_;
+        sl_dns_section          section_;
+        uint16_t                left_;
+        bool                    failed_;
+    public:
+        iterator(const sl_dns_view& view);
+        // Read the next record, return false at the end or on a malformed record
+        bool                    next(sl_dns_rr& rr);
+        // The packet is malformed
+        bool                    failed() const;
+        // Offset of the next record
+        size_t                  offset() const;
+    };
+    iterator        records() const;
+};
+
 #pragma pack(push, 1)
 class sl_dns_packet {
 
@@ -204,6 +281,8 @@ public:
 
     // Dump all A-Records in the dns packet
     const vector<sl_ip> get_A_records() const;
+    // Dump all A-Records, and the min TTL of them and the C-Names before them
+    const vector<sl_ip> get_A_records(uint32_t &ttl) const;
     // Add a records to the end of the dns packet
     void set_A_records(const vector<sl_ip> & a_records);
 
@@ -212,6 +291,15 @@ public:
     // Append C-Name to the end of the dns packet
     void set_C_Names(const vector<string> & c_names);
 
+    // EDNS0, add the OPT record to the additional section or update the one
+    // in the packet, with the udp payload size and the DO flag.
+    void set_edns(uint16_t payload_size = SL_DNS_EDNS_PAYLOAD_SIZE, bool dnssec_ok = false);
+    // Get the udp payload size in the OPT record, return false if no OPT record.
+    bool get_edns(uint16_t& payload_size) const;
+    // The max size of a udp response, the payload size in the OPT record, 
+    // or 512 without EDNS0.
+    uint16_t get_udp_payload_size() const;
+
     // The size of the packet
     size_t size() const;
     // The buffer point of the packet
@@ -223,8 +311,24 @@ public:
 
     // Convert current packet to tcp packet
     const string to_tcp_packet() const;
+
+    // Decrease the TTLs at the offsets by <elapsed> seconds, to 0 at least.
+    // The offsets are the ttl_offset of the records in a sl_dns_view.
+    void decrease_ttls(const vector<uint16_t>& ttl_offsets, uint32_t elapsed);
+    // Set the TTLs at the offsets
+    void set_ttls(const vector<uint16_t>& ttl_offsets, uint32_t ttl);
+
+    // Get the TTL of a negative answer(NXDOMAIN or NODATA), which is the min
+    // of the SOA record's TTL and its MINIMUM field in the authority section,
+    // in RFC 2308. Return false if no SOA record.
+    bool get_negative_ttl(uint32_t& ttl) const;
 };
 
+// Lower case the ASCII letters 'A'-'Z' of a domain name in place, other
+// bytes are kept. It is safe for a name in wire format, whose label length
+// (at most 63) or pointer is never in the range.
+void sl_dns_name_tolower(string::iterator begin, string::iterator end);
+
 #pragma pack(pop)
 
 #endif
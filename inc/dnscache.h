@@ -0,0 +1,190 @@
+/*
+    socklite -- a C++ socket library for Linux/Windows/iOS
+    Copyright (C) 2014  Push Chen
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    You can connect me by email: littlepush@gmail.com, 
+    or @me on twitter: @littlepush
+*/
+
+#pragma once
+
+#ifndef __SOCK_LITE_DNSCACHE_H__
+#define __SOCK_LITE_DNSCACHE_H__
+
+#include "socket.h"
+#include "dns.h"
+#include <list>
+#include <atomic>
+#include <unordered_map>
+
+// Count of the shards, each shard has its own lock
+#define SL_DNS_CACHE_SHARDS             16
+// Default max count of cached answers in all shards
+#define SL_DNS_CACHE_DEFAULT_SIZE       4096
+// Default TTL clamps, in seconds
+#define SL_DNS_CACHE_DEFAULT_MIN_TTL    5
+#define SL_DNS_CACHE_DEFAULT_MAX_TTL    3600
+// Default max TTL of the negative answers, in seconds
+#define SL_DNS_CACHE_DEFAULT_MAX_NEG_TTL    900
+// Default time to keep an expired answer to serve when the nameservers
+// failed, in seconds, and the TTL of the stale answer in RFC 8767
+#define SL_DNS_CACHE_DEFAULT_STALE_TTL  86400
+#define SL_DNS_CACHE_STALE_ANSWER_TTL   30
+
+/*
+    DNS result cache
+    The class is a singleton class, all async dns queries share one cache.
+    An answer is keyed by the query name, the query type and the nameservers
+    (and the socks5 proxy) which it comes from, and will expire after the 
+    TTL of the records, clamped in [min_ttl, max_ttl].
+    The keys are split into shards to reduce the lock contention, each 
+    shard keeps at most max_size/shards answers, and drops the least
+    recently used one when full.
+    The cache also keeps the whole response packets for the forwarder, 
+    which are keyed by the question of the query packet. A cached response 
+    is returned as a copy with the transaction id of the query, and its TTLs
+    are decreased in place at the offsets found when it was saved.
+    The NXDOMAIN and NODATA answers are cached as negative answers with 
+    the TTL of the SOA record, in RFC 2308.
+    An expired positive answer is kept for stale_ttl seconds, and can be
+    served by get_stale when all the nameservers failed, in RFC 8767.
+*/
+class sl_dns_cache
+{
+protected:
+    typedef struct {
+        vector<sl_ip>               records;
+        // The response packet and the offsets of its TTLs
+        sl_dns_packet               packet;
+        vector<uint16_t>            ttl_offsets;
+        steady_clock::time_point    created;
+        steady_clock::time_point    expire;
+        // The time of the last get, for the refresh-ahead of hot names
+        steady_clock::time_point    last_hit;
+        bool                        negative;
+        list<string>::iterator      lru;
+    } cache_item;
+
+    typedef struct {
+        mutex                                   locker;
+        unordered_map<string, cache_item>       cache_map;
+        // Most recently used key at the front
+        list<string>                            lru_list;
+    } cache_shard;
+
+    cache_shard             shards_[SL_DNS_CACHE_SHARDS];
+    atomic<size_t>          shard_size_;
+    atomic<uint32_t>        min_ttl_;
+    atomic<uint32_t>        max_ttl_;
+    atomic<uint32_t>        max_negative_ttl_;
+    atomic<uint32_t>        stale_ttl_;
+    atomic<uint64_t>        hit_count_;
+    atomic<uint64_t>        miss_count_;
+    atomic<uint64_t>        stale_count_;
+
+    // Cannot create a cache object, it should be a Singleton instance
+    sl_dns_cache();
+
+    // Get the shard of the key
+    cache_shard& _shard(const string& key);
+
+    // Find the unexpired item and move it to the front of the lru list, 
+    // or the stale positive one if <stale> is true. The shard must be locked.
+    cache_item* _find(cache_shard& s, const string& key, bool stale = false);
+    // Save the item, drop the least recently used ones if the shard is full.
+    void _save(const string& key, cache_item&& item);
+public:
+
+    // Create the cache key
+    static string make_key(
+        const string& name, 
+        sl_dns_qtype qtype, 
+        const vector<sl_peerinfo>& nameserver_list,
+        const sl_peerinfo& socks5 = sl_peerinfo::nan()
+    );
+
+    // Create the cache key of a query packet, by its question in lower case,
+    // the RD flag and the EDNS0 payload size. Return an empty key if the query
+    // is invalid.
+    static string make_key(
+        const sl_dns_packet& query,
+        const vector<sl_peerinfo>& nameserver_list,
+        const sl_peerinfo& socks5 = sl_peerinfo::nan()
+    );
+
+    // Set the max count of cached answers and the TTL clamps.
+    // 0 max_size disables the cache, 0 stale_ttl disables serve-stale.
+    void setup(
+        size_t max_size = SL_DNS_CACHE_DEFAULT_SIZE, 
+        uint32_t min_ttl = SL_DNS_CACHE_DEFAULT_MIN_TTL,
+        uint32_t max_ttl = SL_DNS_CACHE_DEFAULT_MAX_TTL,
+        uint32_t max_negative_ttl = SL_DNS_CACHE_DEFAULT_MAX_NEG_TTL,
+        uint32_t stale_ttl = SL_DNS_CACHE_DEFAULT_STALE_TTL
+    );
+
+    // Get the unexpired answer of the key, update the hit/miss counters
+    bool get(const string& key, vector<sl_ip>& records);
+
+    // Save the answer with its TTL in seconds, empty answer will be ignored.
+    // Return the clamped TTL, or 0 if the answer is not cached.
+    uint32_t set(const string& key, const vector<sl_ip>& records, uint32_t ttl);
+
+    // Save the negative answer with the TTL of the SOA record
+    void set_negative(const string& key, const vector<sl_ip>& records, uint32_t ttl);
+
+    // Get the expired positive answer in the stale window
+    bool get_stale(const string& key, vector<sl_ip>& records);
+
+    // Get the time of the last hit of the unexpired answer, the time is 
+    // zero if it has never been hit. Will not touch the lru list.
+    bool last_hit(const string& key, steady_clock::time_point& hit_time);
+
+    // Get the unexpired response packet of the key, with the transaction id
+    // of the query and the TTLs decreased by the time it has been cached.
+    bool get(const string& key, const sl_dns_packet& query, sl_dns_packet& resp);
+
+    // Save the response packet, which expires with the min TTL of its 
+    // records. A no-error response with answers, or a negative one with a 
+    // SOA record will be cached.
+    void set(const string& key, const sl_dns_packet& resp);
+
+    // Get the expired positive response packet in the stale window, with the
+    // transaction id of the query and the TTLs set to 30 seconds.
+    bool get_stale(const string& key, const sl_dns_packet& query, sl_dns_packet& resp);
+
+    // Remove all cached answers
+    void clear();
+
+    // The statistic of the cache
+    uint64_t hit_count() const;
+    uint64_t miss_count() const;
+    uint64_t stale_count() const;
+    size_t size();
+
+    // Singleton Cache Item
+    static sl_dns_cache& server();
+};
+
+#endif
+// sock.lite.dnscache.h
+
+/*
+ Push Chen.
+ littlepush@gmail.com
+ http://pushchen.com
+ http://twitter.com/littlepush
+ */
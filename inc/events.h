@@ -28,6 +28,7 @@
 #include "socket.h"
 #include "poller.h"
 #include <unordered_map>
+#include <deque>
 
 // The socket event handler
 //typedef void (*sl_socket_event_handler)(sl_event);
@@ -102,6 +103,13 @@ protected:
     uint32_t                timepiece_;
     // Callback method after each fetching action.
     sl_runloop_callback     rl_callback_;
+    // Delayed tasks, ordered by the fire time.
+    // Any action associates with the timers need to lock this mutex.
+    mutable mutex           timer_mutex_;
+    multimap<steady_clock::time_point, sl_runloop_callback> timer_map_;
+    // Due timers waiting for a worker, each one is posted to the event pool
+    // as an invalid socket's SL_EVENT_TIMEOUT.
+    deque<sl_runloop_callback> timer_fired_;
 
     // Internal Runloop Working Thread.
     // This is the main thread object of Event System.
@@ -114,6 +122,10 @@ protected:
     vector<thread*>         thread_pool_;
     // Working thread monitor manager thread.
     thread *                thread_pool_manager_;
+    // Accepting threads of the listening sockets not monitored by the
+    // poller, each one with a stop flag.
+    mutable mutex           accept_mutex_;
+    map<SOCKET_T, pair<thread*, shared_ptr<atomic<bool>>>> accept_threads_;
 
     // Start the Internal Run Loop Thread use the method: _internal_runloop
     void _internal_start_runloop();
@@ -125,8 +137,16 @@ protected:
     void _internal_add_worker();
     // Remove the last worker from the thread pool
     void _internal_remove_worker();
+    // Invoke the first due timer in current worker
+    void _internal_run_timer();
     // The worker thread method.
     void _internal_worker();
+    // Invoke all timers which have reached the fire time.
+    void _internal_fire_timers();
+    // The accepting thread method of a listening socket
+    void _internal_accept_worker(SOCKET_T so, shared_ptr<atomic<bool>> stop);
+    // Stop the accepting thread of a listening socket
+    void _internal_stop_accepting(SOCKET_T so);
 
     // Replace a hander of a socket's specified Event ID, return the old handler
     sl_socket_event_handler _replace_handler(SOCKET_T so, uint32_t eid, sl_socket_event_handler h);
@@ -154,6 +174,14 @@ public:
 
     // Monitor the socket for specified event.
     void monitor(SOCKET_T so, SL_EVENT_ID eid, sl_socket_event_handler handler, uint32_t timedout = 30);
+    // Cancel the pending monitoring of specified event, and remove the handler.
+    void unmonitor(SOCKET_T so, SL_EVENT_ID eid);
+
+    // Accept the incoming connections of a listening socket in its own
+    // thread instead of the runloop, the accept events will be dispatched
+    // to the workers as usual. The socket must be bound to the poller 
+    // without monitoring, the thread stops when the socket is unbound.
+    bool start_accepting(SOCKET_T so);
 
     // Add an event to the socket's pending event pool.
     void add_event(sl_event && e);
@@ -164,6 +192,9 @@ public:
 
     // Setup the timepiece and callback method.
     void setup( uint32_t timepiece = 10, sl_runloop_callback cb = NULL );
+    // Invoke the callback in a worker thread after <delay> milliseconds,
+    // the precision is the timepiece.
+    void add_timer(uint32_t delay, sl_runloop_callback cb);
 };
 
 #endif
@@ -0,0 +1,151 @@
+/*
+    socklite -- a C++ socket library for Linux/Windows/iOS
+    Copyright (C) 2014  Push Chen
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    You can connect me by email: littlepush@gmail.com, 
+    or @me on twitter: @littlepush
+*/
+
+#pragma once
+
+#ifndef __SOCK_LITE_FRAME_H__
+#define __SOCK_LITE_FRAME_H__
+
+#include "buffer.h"
+#include <functional>
+#include <deque>
+
+// Default max size of a frame's payload
+#define SL_FRAME_DEFAULT_MAX_SIZE   (1024 * 1024)   // 1M
+
+// Invoked for each whole frame, the payload does not contain the length
+// prefix or the delimiter.
+typedef std::function<void(const sl_buffer_view &)>    sl_frame_handler;
+
+/*
+    Frame decoder of a stream.
+    The decoder holds the views of the incoming data until a whole frame 
+    has been received. A frame in one chunk is passed as a view of the 
+    chunk, only a frame split in different chunks will be copied into a 
+    new chunk.
+*/
+class sl_frame_decoder
+{
+protected:
+    sl_buffer_views         pending_;
+    size_t                  pending_size_;
+    size_t                  max_frame_size_;
+    // Whole frames appended by <push> and not popped yet
+    deque<sl_buffer_view>   ready_;
+
+    // Copy <length> bytes from <offset> of the pending data to <buffer>
+    bool _peek(size_t offset, void *buffer, size_t length) const;
+    // Get <length> bytes from <offset> of the pending data as one view
+    sl_buffer_view _gather(size_t offset, size_t length) const;
+    // Drop <length> bytes from the front of the pending data
+    void _consume(size_t length);
+
+    // Find the next frame in the pending data. Set <frame_size> to 0 if
+    // the frame is not complete. Return false if the frame is invalid.
+    virtual bool _next_frame(
+        size_t &frame_size, 
+        size_t &payload_offset, 
+        size_t &payload_size
+    ) = 0;
+public:
+    sl_frame_decoder(size_t max_frame_size);
+    virtual ~sl_frame_decoder();
+
+    // Append the incoming data, and invoke the handler for each whole frame.
+    // Return false if the stream is invalid or a frame is larger than the 
+    // max size, all pending data will be dropped, the socket should be closed.
+    bool feed(const sl_buffer_views &views, sl_frame_handler handler);
+
+    // Append the incoming data, keep the whole frames in the decoder until
+    // they are fetched by <pop>. Return false same as <feed>.
+    bool push(const sl_buffer_views &views);
+    // Fetch the first whole frame kept by <push>, return false if none.
+    bool pop(sl_buffer_view &frame);
+
+    // Size of the data which has not formed a whole frame
+    size_t pending_size() const;
+
+    // Drop all pending data
+    virtual void reset();
+};
+
+/*
+    Frames with a length prefix of 1, 2 or 4 bytes, the length is the 
+    size of the payload.
+*/
+class sl_frame_length_decoder : public sl_frame_decoder
+{
+protected:
+    size_t                  length_size_;
+    bool                    big_endian_;
+
+    virtual bool _next_frame(size_t &frame_size, size_t &payload_offset, size_t &payload_size);
+public:
+    sl_frame_length_decoder(
+        size_t length_size = 2, 
+        bool big_endian = true,
+        size_t max_frame_size = SL_FRAME_DEFAULT_MAX_SIZE
+    );
+};
+
+/*
+    Frames end with a delimiter, like "\n" or "\r\n".
+    The delimiter is searched by memchr, and the scanned data will not be
+    searched again when more data arrives.
+*/
+class sl_frame_delimiter_decoder : public sl_frame_decoder
+{
+protected:
+    string                  delimiter_;
+    size_t                  scanned_;
+
+    virtual bool _next_frame(size_t &frame_size, size_t &payload_offset, size_t &payload_size);
+public:
+    sl_frame_delimiter_decoder(
+        const string &delimiter = "\n",
+        size_t max_frame_size = SL_FRAME_DEFAULT_MAX_SIZE
+    );
+    virtual void reset();
+};
+
+/*
+    Frames with the same size.
+*/
+class sl_frame_fixed_decoder : public sl_frame_decoder
+{
+protected:
+    size_t                  frame_size_;
+
+    virtual bool _next_frame(size_t &frame_size, size_t &payload_offset, size_t &payload_size);
+public:
+    sl_frame_fixed_decoder(size_t frame_size);
+};
+
+#endif
+// sock.lite.frame.h
+
+/*
+ Push Chen.
+ littlepush@gmail.com
+ http://pushchen.com
+ http://twitter.com/littlepush
+ */
@@ -38,9 +38,25 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <unordered_map>
+#include <functional>
+#include <atomic>
 
 #define CO_MAX_SO_EVENTS		1024
+// Default max count of sockets accepted from one listening socket in
+// each fetching, 0 means accept until no more incoming.
+#define CO_DEFAULT_ACCEPT_BUDGET    128
+// Max count of idle sockets reaped in one fetching when the process
+// runs out of file descriptors.
+#define CO_REAPER_EXHAUSTED_BATCH   16
+
+// Use accept4 to get a non-blocking socket in one syscall
+#if SL_TARGET_LINUX
+#define SL_TCP_ACCEPT4_SUPPORTED    1
+#else
+#define SL_TCP_ACCEPT4_SUPPORTED    0
+#endif
 
 // All Socket Event
 enum SL_EVENT_ID {
@@ -69,8 +85,8 @@ const string sl_event_name(uint32_t eid);
         be an INVALIDATE_SOCKET
     @event: the event current socket get.
     @socktype: IPPROTO_TCP or IPPROTO_UDP
-    @address: the address info of a udp socket when it gets some
-        incoming data, otherwise it will be undefined.
+    @address: the poller will not fetch the address of incoming udp
+        data, it will be set by the udp read methods.
 */
 typedef struct tag_sl_event {
     SOCKET_T                so;
@@ -87,6 +103,21 @@ typedef struct tag_sl_event {
 */
 ostream & operator << (ostream &os, const sl_event & e);
 
+/*
+    Admission control statistics of the incoming tcp connections
+
+    @connections: count of accepted connections still open
+    @rejected_denied: source in the deny list or not in the allow list
+    @rejected_global: rejected for the max connections limit
+    @rejected_per_ip: rejected for the per source ip limit
+*/
+typedef struct tag_sl_admission_stats {
+    size_t                  connections;
+    uint64_t                rejected_denied;
+    uint64_t                rejected_global;
+    uint64_t                rejected_per_ip;
+} sl_admission_stats;
+
 // Create a failed or timedout event structure object
 sl_event sl_event_make_failed(SOCKET_T so = INVALIDATE_SOCKET);
 sl_event sl_event_make_timeout(SOCKET_T so = INVALIDATE_SOCKET);
@@ -103,6 +134,8 @@ class sl_poller
 public:
     // Event list type.
 	typedef std::vector<sl_event>	earray;
+    // Error queue handler, invoked in the runloop thread
+    typedef std::function<void(SOCKET_T)>   errqueue_handler;
 protected:
 	int 				m_fd;
 #if SL_TARGET_LINUX
@@ -111,21 +144,147 @@ protected:
 	struct kevent		*m_events;
 #endif
 
-    // TCP Listening Socket Map
-	unordered_map<SOCKET_T, bool>       m_tcp_svr_map;
+    // TCP Listening Socket Map, and the count of accepted sockets
+	unordered_map<SOCKET_T, uint64_t>   m_tcp_svr_map;
+    mutex                               m_tcp_svr_mutex;
+    // Listening sockets which still have pending connections after 
+    // running out of the accept budget, will be accepted in next fetching.
+    set<SOCKET_T>                       m_tcp_svr_pending;
+    uint32_t                            m_accept_budget;
 
     // Timeout Info
     unordered_map<SOCKET_T, time_t>     m_timeout_map;
     mutex                               m_timeout_mutex;
 
+    // Sockets which get notifications from the error queue(like
+    // MSG_ZEROCOPY completions), and the last monitored events of them.
+    typedef struct {
+        errqueue_handler                handler;
+        uint32_t                        events;
+    } errqueue_info;
+    unordered_map<SOCKET_T, errqueue_info>  m_errqueue_map;
+    mutex                               m_errqueue_mutex;
+
+    // Activity LRU of all monitored sockets. The links are kept in the
+    // node of each socket, the head is the least recently active one.
+    // Only a real event refreshes the activity, re-monitoring does not.
+    typedef struct {
+        SOCKET_T                        prev;
+        SOCKET_T                        next;
+        time_t                          last_active;
+        bool                            reapable;
+    } activity_node;
+    unordered_map<SOCKET_T, activity_node>  m_activity_map;
+    SOCKET_T                            m_activity_head;
+    SOCKET_T                            m_activity_tail;
+    mutex                               m_activity_mutex;
+    // Idle reaper settings, a zero threshold means the reaper is off.
+    size_t                              m_reaper_threshold;
+    uint32_t                            m_reaper_min_idle;
+    uint64_t                            m_reaped_count;
+    // The last accepting failed with EMFILE/ENFILE, the listening sockets
+    // with their own accepting threads also update it.
+    atomic<bool>                        m_fd_exhausted;
+
+    // Admission control of incoming connections, 0 limit means unlimited.
+    // All accepted sockets are recorded with their source address until
+    // they are unmonitored.
+    size_t                              m_max_connections;
+    size_t                              m_max_per_ip;
+    vector<sl_iprange>                  m_allow_list;
+    vector<sl_iprange>                  m_deny_list;
+    unordered_map<SOCKET_T, uint32_t>   m_admitted_map;
+    unordered_map<uint32_t, size_t>     m_source_count;
+    sl_admission_stats                  m_admission_stats;
+    mutex                               m_admission_mutex;
+
 protected:
     // Cannot create a poller object, it should be a Singleton instance
 	sl_poller();
+
+    // Check if the error flag of a socket is only a notification in its
+    // error queue, if so, invoke the handler and re-arm the socket.
+    bool _process_errqueue( SOCKET_T so, uint32_t events );
+
+    // Check if the socket is a listening tcp socket
+    bool _is_tcp_server( SOCKET_T so );
+
+    // Accept the incoming sockets of the listening socket, up to the budget.
+    // Return true if there are still pending connections, if <keep_pending>
+    // is true, they will be accepted in next fetching.
+    bool _accept_incoming( SOCKET_T so, earray &events, bool keep_pending = true );
+
+    // Check the limits and the allow/deny lists, record the socket if admitted
+    bool _admit_incoming( SOCKET_T so, const struct sockaddr_in &addr );
+
+    // Move the socket to the tail of the activity LRU, add it if not
+    // tracked. Must lock m_activity_mutex before invoking these methods.
+    void _activity_touch( SOCKET_T so, time_t now );
+    void _activity_unlink( SOCKET_T so );
+
+    // Close the least recently active sockets with a SL_EVENT_FAILED
+    // event when the count of tracked sockets crosses the threshold.
+    void _reap_idle_sockets( earray &events, time_t now );
 public:
 	~sl_poller();
         
-	// Bind the server side socket
-	bool bind_tcp_server( SOCKET_T so );
+	// Bind the server side socket, if <monitor> is false, the socket will
+    // not be added to the poller, and its owner should invoke 
+    // <accept_incoming> when it is readable.
+	bool bind_tcp_server( SOCKET_T so, bool monitor = true );
+
+    // Accept the incoming sockets of a listening socket not monitored by
+    // the poller, up to the budget. Return true if there are still
+    // pending connections.
+    bool accept_incoming( SOCKET_T so, earray &events );
+
+    // Check if the last accepting failed for the lack of file descriptors
+    bool is_fd_exhausted();
+
+    // Get the count of sockets accepted by the server side socket
+    uint64_t accept_count( SOCKET_T so );
+
+    // Set the max count of sockets accepted from one listening socket in
+    // each fetching, the rest will be accepted in next fetching, so other
+    // sockets will not be starved by a burst of incoming connections.
+    // 0 means accept until no more incoming.
+    void set_accept_budget( uint32_t budget );
+
+    // Set up the idle reaper. When the count of monitored sockets is
+    // more than <threshold>, the sockets idle for at least <min_idle>
+    // seconds will get a SL_EVENT_FAILED event, oldest first, until the
+    // count drops to 7/8 of the threshold. 0 threshold disables the reaper.
+    // Sockets monitored with no timeout will never be reaped.
+    void set_idle_reaper( size_t threshold, uint32_t min_idle = 5 );
+
+    // Get the count of sockets closed by the idle reaper
+    uint64_t reaped_count();
+
+    // Set the max count of accepted connections still open, and the max
+    // count from one source ip. Incoming connections over the limits are
+    // closed in the accepting loop before any event is created.
+    // 0 means unlimited.
+    void set_admission_limit( size_t max_connections, size_t max_per_ip = 0 );
+
+    // Add an allowed or denied source ip range. A source in the deny list
+    // is always rejected, if the allow list is not empty, only the source
+    // in it can be accepted. An invalidate range will be ignored.
+    void add_admission_allow( const sl_iprange &range );
+    void add_admission_deny( const sl_iprange &range );
+    // Clear both the allow and deny list
+    void clear_admission_list();
+
+    // Get the admission control statistics
+    sl_admission_stats admission_stats();
+
+    // Stop tracking the activity of the socket until next monitoring, 
+    // the socket will not be reaped in the meantime.
+    void untrack_activity( SOCKET_T so );
+
+    // Bind an error queue handler to the socket, when the poller get an
+    // EPOLLERR without any pending SO_ERROR on the socket, will invoke the
+    // handler instead of reporting SL_EVENT_FAILED.
+    void bind_errqueue( SOCKET_T so, errqueue_handler handler );
 
 	// Try to fetch new events(Only return SL_EVENT_DEFAULT)
 	size_t fetch_events( earray &events,  unsigned int timedout = 1000 );
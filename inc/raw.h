@@ -30,8 +30,20 @@
 #include "events.h"
 #include "socks5.h"
 #include "dns.h"
+#include "dnscache.h"
+#include "buffer.h"
+#include "frame.h"
 #include "string_format.hpp"
 
+// Default max length of the pending connections queue of a tcp listener
+#define SL_TCP_LISTEN_BACKLOG           1024
+
+// Default count of the long-lived udp sockets of the dns resolver
+#define SL_DNS_RESOLVER_UDP_SOCKETS     4
+// Default count of queries and seconds before a resolver socket is retired
+#define SL_DNS_RESOLVER_MAX_QUERIES     256
+#define SL_DNS_RESOLVER_MAX_AGE         60
+
 // Async to get the dns resolve result
 typedef std::function<void(const vector<sl_ip> &)>      async_dns_handler;
 
@@ -39,15 +51,27 @@ typedef std::function<void(const vector<sl_ip> &)>      async_dns_handler;
     Try to get the dns result async
     @Description
     Use async udp/tcp socket to send a dns query request to the domain name server.
-    If has multiple nameserver set in the system, will try all the sever in order
-    till the first have a no-error response.
-    The method will use a UDP socket at first, if the answer is a TC package, then
-    force to send TCP request to the same server again.
-    If the server does not response after timeout(5s), will try to use the next
-    server in the list.
+    The nameservers are ordered by their measured latency and failure rate,
+    the query is sent via udp to the fastest one first, and if it has not
+    answered after twice its smoothed RTT(clamped in 20ms - 1s, 200ms for a
+    server without any sample), the next one is raced at the same time.
+    Each udp query times out after 1s. The first no-error or NXDOMAIN 
+    answer wins, a NXDOMAIN is final and will not be retried on other 
+    servers, any other error counts as a failure of the server.
+    If the answer is a TC package, then force to send TCP request to the
+    same server again.
     If all server failed to answer the query, then will return 255.255.255.255 
     as the IP address of the host to query in the result.
 
+    The answers are cached in sl_dns_cache::server() with their TTL, a cached
+    answer will be passed to the handler at once without any query.
+    A NXDOMAIN answer returns 255.255.255.255 and is cached with the TTL of
+    its SOA record. If all servers failed, a recently expired answer will be
+    returned instead of 255.255.255.255.
+    Lookups of the same host via the same nameservers are merged while
+    the query is in flight, only one query will be sent, and all the
+    handlers will get its answer.
+
     This method will always return an IP address.
 */
 void sl_async_gethostname(const string& host, async_dns_handler fp);
@@ -72,6 +96,113 @@ void sl_async_gethostname(
     async_dns_handler fp
 );
 
+/*
+    Set up the dns resolver
+
+    @Description
+    All udp dns queries of sl_async_gethostname and sl_async_redirect_dns_query
+    are sent via a small pool of udp sockets, each bound to a random 
+    source port. Every query gets a random transaction id, and the
+    response is matched by the socket, the id, the source address and the
+    question, then its id is restored to the one in the query packet.
+    A query waits for its response in a table with a timer, no socket is
+    created for it.
+    <udp_sockets> is the count of sockets in the pool. If <connect_upstream>
+    is true, each nameserver will have its own pool of connect()ed sockets,
+    so only the nameserver can send data to them, and an ICMP error fails 
+    the pending queries at once.
+    A socket is retired after <max_queries> queries or <max_age> seconds,
+    no new query is sent on it, and it is closed once its pending queries
+    are done, the next query opens a new one on another random port. A
+    long-lived socket saves the socket calls but leaves an off-path 
+    attacker only the 16 bits of the id to guess once the port is known,
+    a short-lived one costs more sockets and syscalls. 0 disables the limit.
+    The pool settings apply to the sockets created later.
+    The queries of sl_async_gethostname carry an EDNS0 OPT record with
+    <edns_payload_size>, so a large answer comes back in one udp response 
+    instead of a truncated one followed by a tcp query. 0 disables EDNS0.
+*/
+void sl_dns_resolver_setup(
+    size_t udp_sockets = SL_DNS_RESOLVER_UDP_SOCKETS, 
+    bool connect_upstream = false,
+    uint16_t edns_payload_size = SL_DNS_EDNS_PAYLOAD_SIZE,
+    size_t max_queries = SL_DNS_RESOLVER_MAX_QUERIES,
+    uint32_t max_age = SL_DNS_RESOLVER_MAX_AGE
+);
+
+// Default max count of the in-flight queries on one tcp connection
+#define SL_DNS_TCP_MAX_INFLIGHT         64
+// Default idle timeout of a tcp connection to a nameserver, in seconds
+#define SL_DNS_TCP_IDLE_TIMEOUT         10
+// Default max count of the tcp connections to a nameserver
+#define SL_DNS_TCP_MAX_CONNECTIONS      2
+
+/*
+    Set up the pipelined dns-over-tcp connections
+
+    @Description
+    The tcp queries of sl_async_gethostname and sl_async_redirect_dns_query
+    share persistent connections to each nameserver(and socks5 proxy). Each
+    query is sent at once with a random transaction id and length-prefixed,
+    and the responses are matched by the id and the question in any order,
+    so a query via socks5 does not pay the connect and handshake again.
+    A connection carries at most <max_inflight> queries, the others wait for
+    a free slot, and a new connection is created if all <max_connections> 
+    connections are full. A connection without any query is closed after
+    <idle_timeout> seconds.
+*/
+void sl_dns_tcp_setup(
+    size_t max_inflight = SL_DNS_TCP_MAX_INFLIGHT,
+    uint32_t idle_timeout = SL_DNS_TCP_IDLE_TIMEOUT,
+    size_t max_connections = SL_DNS_TCP_MAX_CONNECTIONS
+);
+
+// Default ratio of the TTL after which a hot name will be refreshed
+#define SL_DNS_PREFETCH_RATIO           0.8
+// Default max count of the names to track for the refresh-ahead
+#define SL_DNS_PREFETCH_MAX_NAMES       1024
+
+/*
+    Set up the refresh-ahead of the hot names
+
+    @Description
+    When an answer of sl_async_gethostname is cached, its name is tracked
+    and a timer is set to fire after <ratio> of its TTL. If the cached answer
+    has been hit by then, the name is re-resolved in background, and the new
+    answer replaces the cached one before it expires, so a hot name is always
+    answered from the cache. A name not requested in a TTL is forgotten, so
+    is a name whose refresh fails or gets a negative answer.
+    At most <max_names> names are tracked, 0 <ratio> disables the refresh.
+*/
+void sl_dns_prefetch_setup(
+    double ratio = SL_DNS_PREFETCH_RATIO, 
+    size_t max_names = SL_DNS_PREFETCH_MAX_NAMES
+);
+
+// Get the count of the refresh queries
+uint64_t sl_dns_prefetch_count();
+
+// Statistic of a nameserver
+typedef struct tag_sl_dns_upstream_stat {
+    double          srtt;           // smoothed rtt, in milliseconds
+    double          fail_rate;      // smoothed failure rate, in [0, 1]
+    uint64_t        samples;        // count of the answered queries
+    uint64_t        queries;        // count of all queries
+} sl_dns_upstream_stat;
+
+/*
+    Get the statistic of a nameserver
+
+    @Description
+    Each udp query updates the smoothed rtt and failure rate of the nameserver,
+    a timedout or rejected query is a failure. The nameservers are tried in 
+    the order of their expected latency, and if the current one does not 
+    answer in twice its smoothed rtt, the query will be raced on the next one,
+    the first accepted response wins.
+    Return an all-zero statistic for an unknown nameserver.
+*/
+sl_dns_upstream_stat sl_dns_upstream_stats(const sl_peerinfo& nameserver);
+
 // Async to redirect the dns query request.
 typedef std::function<void(const sl_dns_packet&)>       async_dns_redirector;
 
@@ -88,6 +219,24 @@ void sl_async_redirect_dns_query(
     async_dns_redirector fp
 );
 
+/*!
+    Redirect a dns query packet to a list of nameservers, and return the first
+    response which is neither SERVFAIL nor REFUSED. The udp query is raced on
+    the nameservers, the tcp one will try them in order of their latency.
+    If all nameservers failed, return the stale response in sl_dns_cache, or
+    the last error response, or a SERVFAIL response if no one has answered.
+    A no-error or NXDOMAIN response is saved in sl_dns_cache as a whole packet,
+    the same question will be answered by the cached packet with the 
+    transaction id of the query and the decreased TTLs, till it expired.
+*/
+void sl_async_redirect_dns_query(
+    const sl_dns_packet & dpkt,
+    const vector<sl_peerinfo> &nameserver_list,
+    const sl_peerinfo &socks5,
+    bool force_tcp,
+    async_dns_redirector fp
+);
+
 /*
     Bind Default Failed Handler for a Socket
 
@@ -140,6 +289,30 @@ void sl_socket_monitor(
     sl_socket_event_handler callback
 );
 
+/*
+    Set up the idle connection reaper
+
+    @Description
+    The poller tracks the last activity time of every monitored socket,
+    only a real read/write/accept event counts as activity, re-monitoring
+    a socket does not. When the count of monitored sockets is more than
+    <threshold>, the least recently active sockets which have been idle
+    for at least <min_idle> seconds will receive a SL_EVENT_FAILED event
+    and be closed in the normal failed handler, until the count drops to
+    7/8 of the threshold.
+    When accepting fails for running out of file descriptors, the reaper
+    will close a few idle sockets even below the threshold, and the
+    pending connections will be accepted in next fetching.
+    Sockets monitored with a 0 timedout(like udp servers) are never reaped.
+    0 threshold disables the reaper, which is the default.
+*/
+void sl_socket_set_idle_reaper(size_t threshold, uint32_t min_idle = 5);
+
+/*
+    Get the count of sockets closed by the idle reaper.
+*/
+uint64_t sl_socket_reaped_count();
+
 /*
     Async connect to the host via a socks5 proxy
 
@@ -164,6 +337,94 @@ void sl_tcp_socket_connect(
     sl_socket_event_handler callback
 );
 
+/*
+    Async connect to the host and send the initial data.
+
+    @Description
+    Same as <sl_tcp_socket_connect>, the <initial_data> will be the first
+    data sent on the connection.
+    In Linux, when connecting directly, the data will be sent in the SYN
+    packet with TCP Fast Open(MSG_FASTOPEN). If the server's cookie has 
+    not been cached, or fast open is disabled in the system, the data will 
+    be sent after connected. Via a socks5 proxy, the data will be sent 
+    after the proxy has built the connection.
+
+    The data has been queued to send when the callback get SL_EVENT_CONNECT.
+*/
+void sl_tcp_socket_connect(
+    const sl_peerinfo& socks5, 
+    const string& host, 
+    uint16_t port,
+    uint32_t timedout,
+    const string& initial_data,
+    sl_socket_event_handler callback
+);
+
+/*
+    Setup the racing connect of <sl_tcp_socket_connect>.
+
+    @Description
+    When the host is resolved to multiple IP addresses, the first address
+    is connected at once, if it has not completed after <stagger> 
+    milliseconds, the next address will be tried in parallel, at most
+    <concurrency> connecting attempts are running at the same time.
+    A failed attempt starts the next one immediately.
+    The first connected socket wins, all other attempts will be closed.
+
+    The default setting is 250ms and 2 attempts.
+*/
+void sl_tcp_socket_set_connect_race(
+    uint32_t stagger,
+    size_t concurrency
+);
+
+/*
+    Setup the outbound tcp connection pool.
+
+    @Description
+    Idle connections longer than <idle_timeout> seconds will be closed
+    by a timer, and each (socks5, host, port) keeps at most
+    <max_idle> idle connections, the oldest one will be closed first.
+    Idle connections are monitored, one closed by the peer will be dropped
+    at once. The default setting is 10 seconds and 8 connections.
+*/
+void sl_tcp_socket_pool_setup(
+    uint32_t idle_timeout, 
+    size_t max_idle
+);
+
+/*
+    Async connect to the host via a socks5 proxy, reuse the idle connection
+    in the pool if possible.
+
+    @Description
+    Same as <sl_tcp_socket_connect>, the connections are keyed by 
+    (socks5, host, port). Before an idle connection is handed out, the pool
+    will check it has not timed out and has nothing to read(the peer has not
+    closed it), then the callback will get a SL_EVENT_CONNECT in the next
+    runloop. Otherwise, a new connection will be created.
+
+    After using the connection, invoke <sl_tcp_socket_pool_release> to put
+    it back, or <sl_socket_close> to drop it. 
+*/
+void sl_tcp_socket_pool_connect(
+    const sl_peerinfo& socks5, 
+    const string& host, 
+    uint16_t port,
+    uint32_t timedout,
+    sl_socket_event_handler callback
+);
+
+/*
+    Put a connection got from <sl_tcp_socket_pool_connect> back to the pool.
+
+    @Description
+    The connection should have no pending monitor and all response data
+    should have been read, otherwise it will be closed.
+    Sockets not created by the pool will be closed directly.
+*/
+void sl_tcp_socket_pool_release(SOCKET_T tso);
+
 /*
     Async send a packet to the peer via current socket.
 
@@ -172,6 +433,8 @@ void sl_tcp_socket_connect(
     then check if current socket is writing or not.
     If is now writing, the method will return directly. Otherwise,
     this method will make the socket to monitor SL_EVENT_WRITE.
+    All queued packets will be flushed together by one sendmsg, the
+    callback will be invoked after the packet has been fully sent.
 
     In Linux, this method will always monitor both EPOLLIN and EPOLLOUT
 */
@@ -182,24 +445,100 @@ void sl_tcp_socket_send(
 );
 
 /*
-    Read incoming data from the socket.
+    Begin a batch window of the tcp socket.
 
     @Description
-    This is a block method to read data from the socket.
+    Packets sent by <sl_tcp_socket_send> in the window will only be queued,
+    until the window is ended by <sl_tcp_socket_end_batch>, then all of 
+    them will be sent by one sendmsg(up to 64 packets a time), so small 
+    packets like a header and a body will be packed into full segments
+    even the socket is TCP_NODELAY. If the queue can not be sent in one 
+    call, MSG_MORE will be set until the last part.
     
-    The socket must be NON_BLOCKING. This method will use a loop
-    to fetch all data on the socket till two conditions:
-    1. the buffer is not full after current recv action
+    The window can be nested, only the outermost end will flush the queue.
+*/
+void sl_tcp_socket_begin_batch(SOCKET_T tso);
+
+/*
+    End the batch window and flush the queued packets.
+*/
+void sl_tcp_socket_end_batch(SOCKET_T tso);
+
+/*
+    Enable zero-copy send for large packets on a tcp socket.
+
+    @Description
+    In Linux(4.14+), any packet not smaller than <threshold> will be sent
+    with MSG_ZEROCOPY. The packet buffer will be hold until the kernel 
+    reports the completion through the socket's error queue, the poller 
+    will fetch the notifications and release the buffer.
+    Smaller packets will still be sent by copy.
+
+    If the kernel reports it has copied the data(like on loopback), 
+    zero-copy will be disabled on the socket automatically.
+
+    Return false if the system does not support SO_ZEROCOPY.
+*/
+bool sl_tcp_socket_set_zerocopy(
+    SOCKET_T tso,
+    bool enable = true,
+    size_t threshold = 10240    // 10K
+);
+
+/*
+    Read incoming data from the socket into pooled chunks.
+
+    @Description
+    This is a block method to read data from the socket.
+
+    The socket must be NON_BLOCKING. Each socket has a read ring of pooled
+    and uninitialized chunks, this method will use readv to fetch all data
+    on the socket into the ring till two conditions:
+    1. the free space of the ring is not full after current readv action
     2. receive a EAGAIN or EWOULDBLOCK signal
 
-    The method will increase the buffer's size after each loop 
-    until reach the max size of string, which should be the size
-    of machine memory in default.
+    The views of the received data will be appended to <views>, the data
+    is never copied or memset. Release the views when done, then the 
+    chunks will return to the pool.
+*/
+bool sl_tcp_socket_readv(
+    SOCKET_T tso,
+    sl_buffer_views& views
+);
+
+/*
+    Read incoming data from the socket.
+
+    @Description
+    This is a block method to read data from the socket.
+    
+    The socket must be NON_BLOCKING. This method will read all data 
+    on the socket by <sl_tcp_socket_readv>, then copy the received
+    bytes into the buffer, the buffer will only be reserved to the size
+    of the received data.
 */
 bool sl_tcp_socket_read(
     SOCKET_T tso, 
     string& buffer, 
-    size_t min_buffer_size = 1024   // 1K
+    size_t = 1024
+);
+
+/*
+    Read incoming data from the socket and decode frames.
+
+    @Description
+    Read all data on the socket by <sl_tcp_socket_readv>, then feed the 
+    views to the <decoder>, the handler will be invoked for each whole 
+    frame. The partial frame will be kept in the decoder until next read,
+    so the decoder should live as long as the socket.
+
+    Return false if failed to read or the stream is invalid(like the 
+    frame is larger than the max size), the socket should be closed.
+*/
+bool sl_tcp_socket_read_frames(
+    SOCKET_T tso,
+    sl_frame_decoder& decoder,
+    sl_frame_handler handler
 );
 
 /*
@@ -215,10 +554,84 @@ bool sl_tcp_socket_read(
 
     The accept callback will return a new incoming socket, which
     has not been monited on any event.
+
+    If <fastopen_qlen> is not 0, TCP_FASTOPEN will be enabled on the 
+    listening socket with the queue length of pending fast open requests.
+    The data in the SYN packet can be read when the socket is accepted.
+
+    <backlog> is the max length of the pending connections queue.
 */
 SOCKET_T sl_tcp_socket_listen(
     const sl_peerinfo& bind_port, 
-    sl_socket_event_handler accept_callback
+    sl_socket_event_handler accept_callback,
+    uint32_t fastopen_qlen = 0,
+    int backlog = SL_TCP_LISTEN_BACKLOG
+);
+
+/*
+    Listen on a tcp port with multiple sockets
+
+    @Description
+    Create <count> listening sockets with SO_REUSEPORT on the same port,
+    the kernel will spread the incoming connections to the sockets, each
+    of them has its own accept queue of <backlog>, and is accepted in its
+    own thread instead of the runloop, so the accepting is not limited by
+    one thread. The accept events are still handled by the worker threads.
+    If <count> is 0, will create one socket for each CPU core.
+
+    All sockets share the same accept callback, the <e.source> of the
+    accept event is the listening socket.
+    <fastopen_qlen> is the same as <sl_tcp_socket_listen>.
+    If any socket failed to listen, all created ones will be closed and
+    return an empty list.
+*/
+vector<SOCKET_T> sl_tcp_socket_listen_reuseport(
+    const sl_peerinfo& bind_port, 
+    size_t count,
+    sl_socket_event_handler accept_callback,
+    uint32_t fastopen_qlen = 0,
+    int backlog = SL_TCP_LISTEN_BACKLOG
+);
+
+/*
+    Get the count of sockets accepted by a listening socket.
+*/
+uint64_t sl_tcp_socket_accept_count(SOCKET_T lso);
+
+/*
+    Admission control of the incoming tcp connections
+
+    @Description
+    The limits are checked in the poller's accepting loop, a rejected
+    connection is closed at once, before any event or handler set is 
+    created for it, only the statistics will be updated.
+    <max_connections> is the max count of accepted connections still open
+    of all listening sockets, <max_per_ip> is the max count from one
+    source ip. 0 means unlimited.
+    A source in the deny list is always rejected. If the allow list is
+    not empty, only the source in it can be accepted.
+*/
+void sl_tcp_socket_set_admission(size_t max_connections, size_t max_per_ip = 0);
+void sl_tcp_socket_admission_allow(const sl_iprange& range);
+void sl_tcp_socket_admission_deny(const sl_iprange& range);
+
+/*
+    Get the admission control statistics.
+*/
+sl_admission_stats sl_tcp_socket_admission_stats();
+
+/*
+    Defer accepting the connection until its first data arrived.
+
+    @Description
+    In Linux, set TCP_DEFER_ACCEPT on the listening socket, the connection
+    will only be accepted after the client has sent some data, or after
+    <timedout> seconds. The accept callback can read the request at once.
+    Return false if not supported.
+*/
+bool sl_tcp_socket_set_defer_accept(
+    SOCKET_T lso,
+    uint32_t timedout
 );
 
 /*
@@ -284,6 +697,37 @@ void sl_udp_socket_send(
     sl_socket_event_handler callback = NULL
 );
 
+/*
+    Enable UDP generic segmentation offload(Linux 4.18+) on the send side.
+
+    @Description
+    When flushing the write queue, continuous datagrams to the same peer
+    whose size equal to <segment_size>(the last one can be smaller) will
+    be sent in one message with UDP_SEGMENT, up to 64 segments.
+    The callback of each datagram will still be invoked.
+    If the device does not support GSO, it will be disabled automatically.
+
+    Set <segment_size> to 0 to disable it.
+*/
+bool sl_udp_socket_set_gso(
+    SOCKET_T uso,
+    uint16_t segment_size
+);
+
+/*
+    Enable UDP generic receive offload(Linux 5.0+).
+
+    @Description
+    The kernel will merge the datagrams of the same flow into one buffer,
+    <sl_udp_socket_listen_batch> will split them back by the segment size.
+    This should be invoked before <sl_udp_socket_listen_batch>, other read
+    methods will get the merged buffer.
+*/
+bool sl_udp_socket_set_gro(
+    SOCKET_T uso,
+    bool enable = true
+);
+
 /*
     Listen on a UDP port and wait for any incoming data.
 
@@ -297,27 +741,79 @@ void sl_udp_socket_listen(
     sl_socket_event_handler accept_callback
 );
 
+// The datagram received by a batch listener
+typedef struct tag_sl_udp_datagram {
+    struct sockaddr_in      address;
+    sl_buffer_view          payload;
+} sl_udp_datagram;
+
+typedef vector<sl_udp_datagram>                                 sl_udp_datagrams;
+typedef std::function<void(SOCKET_T, const sl_udp_datagrams&)>  sl_udp_batch_handler;
+
+/*
+    Listen on a UDP port and receive the incoming datagrams in batch.
+
+    @Description
+    Each time the socket is readable, this method will fetch up to 
+    <batch_size> datagrams in one recvmmsg(Linux) into pooled chunks, 
+    and pass all of them with the peer address to the handler. If the
+    batch is full, will try to fetch again until the socket is drained,
+    then re-monitor the socket.
+
+    Each payload is a view of a pooled chunk(16K), larger datagrams
+    will be dropped. Copy or hold the views if the data is used after
+    the handler returns.
+
+    If UDP_GRO has been enabled by <sl_udp_socket_set_gro> before 
+    listening, the chunks will be 64K, and the merged buffer will be
+    split back into datagrams before passing to the handler.
+*/
+void sl_udp_socket_listen_batch(
+    SOCKET_T uso,
+    sl_udp_batch_handler handler,
+    size_t batch_size = 64
+);
+
+/*
+    Receive one datagram from the UDP socket.
+
+    @Description
+    Receive the datagram into a pooled 64K chunk with a single recvmsg,
+    the payload will be exactly the datagram and <addr> will be the
+    source address. An empty payload means there is no data in the buffer.
+    Holding the payload view keeps the 64K chunk from being reused.
+*/
+bool sl_udp_socket_recv(
+    SOCKET_T uso,
+    struct sockaddr_in& addr,
+    sl_buffer_view& payload
+);
+
 /*
     Block and read data from the UDP socket.
 
     @Description
-    Same as tcp socket read method.
+    Read one datagram by <sl_udp_socket_recv>, <addr> will be set to
+    the source address of the datagram.
 */
 bool sl_udp_socket_read(
     SOCKET_T uso, 
-    struct sockaddr_in addr, 
+    struct sockaddr_in& addr, 
     string& buffer, 
-    size_t min_buffer_size = 512
+    size_t = 512
 );
 
 /*
     Read data from the UDP socket until limit bytes.
 
+    @Description
+    Read one datagram and keep the first <limit_bytes>, if the datagram
+    is shorter than the limit, it will be dropped and return false.
     If limit_bytes is 0, is the same as sl_udp_socket_read
 */
 bool sl_udp_socket_read_limit(
     SOCKET_T uso,
-    struct sockaddr_in addr,
+    struct sockaddr_in& addr,
     string& buffer,
     size_t limit_bytes
 );
@@ -341,7 +341,9 @@ public:
 
     operator bool() const;
     operator const string() const;
-    bool is_ip_in_range(const sl_ip& ip);
+    bool is_ip_in_range(const sl_ip& ip) const;
+    // Check the address in network byte order, without formatting an sl_ip
+    bool is_ip_in_range(uint32_t inaddr) const;
 };
 
 // Output the ip range
@@ -0,0 +1,244 @@
+/*
+    socklite -- a C++ socket library for Linux/Windows/iOS
+    Copyright (C) 2014  Push Chen
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    You can connect me by email: littlepush@gmail.com, 
+    or @me on twitter: @littlepush
+*/
+
+#include "buffer.h"
+#include <new>
+
+// Chunk
+sl_buffer_chunk::sl_buffer_chunk(size_t capacity) : refs_(1), capacity_(capacity) { }
+
+sl_buffer_chunk *sl_buffer_chunk::create(size_t capacity)
+{
+    // Do not initialize the data
+    void *_mem = ::operator new(sizeof(sl_buffer_chunk) + capacity);
+    return new (_mem) sl_buffer_chunk(capacity);
+}
+void sl_buffer_chunk::destroy(sl_buffer_chunk *chunk)
+{
+    chunk->~sl_buffer_chunk();
+    ::operator delete((void *)chunk);
+}
+
+char *sl_buffer_chunk::data() { return (char *)(this + 1); }
+size_t sl_buffer_chunk::capacity() const { return capacity_; }
+
+void sl_buffer_chunk::retain()
+{
+    refs_.fetch_add(1, memory_order_relaxed);
+}
+void sl_buffer_chunk::release()
+{
+    if ( refs_.fetch_sub(1, memory_order_acq_rel) != 1 ) return;
+    sl_buffer_pool::pool().recycle(this);
+}
+
+// Pool
+sl_buffer_pool::sl_buffer_pool() { }
+sl_buffer_pool::~sl_buffer_pool()
+{
+    lock_guard<mutex> _(lock_);
+    for ( auto _chunk : idle_ ) {
+        sl_buffer_chunk::destroy(_chunk);
+    }
+    for ( auto _chunk : large_idle_ ) {
+        sl_buffer_chunk::destroy(_chunk);
+    }
+    idle_.clear();
+    large_idle_.clear();
+}
+
+sl_buffer_chunk *sl_buffer_pool::alloc(size_t min_capacity)
+{
+    // Too large to be pooled
+    if ( min_capacity > SL_BUFFER_LARGE_CHUNK_SIZE ) {
+        return sl_buffer_chunk::create(min_capacity);
+    }
+    bool _large = (min_capacity > SL_BUFFER_CHUNK_SIZE);
+    do {
+        lock_guard<mutex> _(lock_);
+        vector<sl_buffer_chunk *> &_idle = (_large ? large_idle_ : idle_);
+        if ( _idle.size() == 0 ) break;
+        sl_buffer_chunk *_chunk = _idle.back();
+        _idle.pop_back();
+        _chunk->refs_.store(1, memory_order_relaxed);
+        return _chunk;
+    } while ( false );
+    return sl_buffer_chunk::create(_large ? SL_BUFFER_LARGE_CHUNK_SIZE : SL_BUFFER_CHUNK_SIZE);
+}
+
+void sl_buffer_pool::recycle(sl_buffer_chunk *chunk)
+{
+    if ( chunk == NULL ) return;
+    do {
+        if ( chunk->capacity() > SL_BUFFER_LARGE_CHUNK_SIZE ) break;
+        lock_guard<mutex> _(lock_);
+        if ( chunk->capacity() > SL_BUFFER_CHUNK_SIZE ) {
+            if ( large_idle_.size() >= SL_BUFFER_POOL_MAX_LARGE_IDLE ) break;
+            large_idle_.push_back(chunk);
+        } else {
+            if ( idle_.size() >= SL_BUFFER_POOL_MAX_IDLE ) break;
+            idle_.push_back(chunk);
+        }
+        return;
+    } while ( false );
+    sl_buffer_chunk::destroy(chunk);
+}
+
+sl_buffer_pool &sl_buffer_pool::pool()
+{
+    static sl_buffer_pool _g_pool;
+    return _g_pool;
+}
+
+// View
+sl_buffer_view::sl_buffer_view() : chunk_(NULL), data_(NULL), size_(0) { }
+sl_buffer_view::sl_buffer_view(sl_buffer_chunk *chunk, size_t offset, size_t size)
+: chunk_(chunk), data_(chunk->data() + offset), size_(size)
+{
+    chunk_->retain();
+}
+sl_buffer_view::sl_buffer_view(const sl_buffer_view &rhs)
+: chunk_(rhs.chunk_), data_(rhs.data_), size_(rhs.size_)
+{
+    if ( chunk_ != NULL ) chunk_->retain();
+}
+sl_buffer_view::sl_buffer_view(sl_buffer_view &&rrhs)
+: chunk_(rrhs.chunk_), data_(rrhs.data_), size_(rrhs.size_)
+{
+    rrhs.chunk_ = NULL;
+    rrhs.data_ = NULL;
+    rrhs.size_ = 0;
+}
+sl_buffer_view::~sl_buffer_view()
+{
+    this->release();
+}
+
+sl_buffer_view & sl_buffer_view::operator = (const sl_buffer_view &rhs)
+{
+    if ( this == &rhs ) return *this;
+    if ( rhs.chunk_ != NULL ) rhs.chunk_->retain();
+    this->release();
+    chunk_ = rhs.chunk_;
+    data_ = rhs.data_;
+    size_ = rhs.size_;
+    return *this;
+}
+sl_buffer_view & sl_buffer_view::operator = (sl_buffer_view &&rrhs)
+{
+    if ( this == &rrhs ) return *this;
+    this->release();
+    chunk_ = rrhs.chunk_;
+    data_ = rrhs.data_;
+    size_ = rrhs.size_;
+    rrhs.chunk_ = NULL;
+    rrhs.data_ = NULL;
+    rrhs.size_ = 0;
+    return *this;
+}
+
+const char *sl_buffer_view::data() const { return data_; }
+size_t sl_buffer_view::size() const { return size_; }
+
+sl_buffer_view sl_buffer_view::sub(size_t offset, size_t length) const
+{
+    if ( chunk_ == NULL || offset >= size_ ) return sl_buffer_view();
+    if ( offset + length > size_ ) length = size_ - offset;
+    return sl_buffer_view(chunk_, (data_ - chunk_->data()) + offset, length);
+}
+
+void sl_buffer_view::release()
+{
+    if ( chunk_ != NULL ) chunk_->release();
+    chunk_ = NULL;
+    data_ = NULL;
+    size_ = 0;
+}
+
+void sl_buffer_views_to_string(const sl_buffer_views &views, string &buffer)
+{
+    size_t _size = 0;
+    for ( auto &_v : views ) _size += _v.size();
+    buffer.clear();
+    buffer.reserve(_size);
+    for ( auto &_v : views ) buffer.append(_v.data(), _v.size());
+}
+
+// Ring
+sl_buffer_ring::sl_buffer_ring() : offset_(0), iov_count_(1), space_(0) { }
+sl_buffer_ring::~sl_buffer_ring()
+{
+    this->shrink();
+}
+
+int sl_buffer_ring::prepare(struct iovec *iov, size_t &space)
+{
+    while ( chunks_.size() < iov_count_ ) {
+        chunks_.push_back(sl_buffer_pool::pool().alloc());
+    }
+    space = 0;
+    for ( size_t i = 0; i < chunks_.size(); ++i ) {
+        size_t _offset = (i == 0 ? offset_ : 0);
+        iov[i].iov_base = chunks_[i]->data() + _offset;
+        iov[i].iov_len = chunks_[i]->capacity() - _offset;
+        space += iov[i].iov_len;
+    }
+    space_ = space;
+    return (int)chunks_.size();
+}
+
+void sl_buffer_ring::commit(size_t received, sl_buffer_views &views)
+{
+    // All the offered space is filled, offer one more chunk next time
+    if ( received >= space_ && iov_count_ < max_iov ) iov_count_ += 1;
+    while ( received > 0 && chunks_.size() > 0 ) {
+        size_t _len = min(received, chunks_[0]->capacity() - offset_);
+        views.emplace_back(sl_buffer_view(chunks_[0], offset_, _len));
+        offset_ += _len;
+        received -= _len;
+        if ( offset_ < chunks_[0]->capacity() ) break;
+        // The first chunk is full, the ring no longer need it.
+        chunks_[0]->release();
+        chunks_.erase(chunks_.begin());
+        offset_ = 0;
+    }
+}
+
+void sl_buffer_ring::shrink()
+{
+    for ( auto _chunk : chunks_ ) {
+        _chunk->release();
+    }
+    chunks_.clear();
+    offset_ = 0;
+    iov_count_ = 1;
+    space_ = 0;
+}
+
+// sock.lite.buffer.cpp
+
+/*
+ Push Chen.
+ littlepush@gmail.com
+ http://pushchen.com
+ http://twitter.com/littlepush
+ */
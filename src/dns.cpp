@@ -69,21 +69,6 @@
 
 #ifdef SOCK_LITE_INTEGRATION_DNS
 
-// Get the formated domain in the dns packet.
-// The domain "www.google.com", will be "\3www\6google\3com\0".
-int _dns_get_format_domain( const char *data, string &domain ) {
-    domain.clear();
-    for ( ;; ) {
-        uint8_t _l = data[0];
-        if ( _l == 0 ) break;
-        data++;
-        if ( domain.size() > 0 ) domain += ".";
-        domain.append( data, _l );
-        data += _l;
-    }
-    return domain.size() + 2;
-}
-
 // DNS Method
 void _dns_format_domain(const string &dname, string &buf) {
     buf.resize(dname.size() + 2);
@@ -100,37 +85,194 @@ void _dns_format_domain(const string &dname, string &buf) {
     _buf[0] = '\0';
 }
 
-// support the offset in the dns packet
-int _dns_get_format_domain( const char *begin_of_domain, const char *begin_of_pkt, string &domain ) {
-    domain.clear();
-    int _readsize = 0;
+// Read the integers in network order, the buffer may be unaligned
+uint16_t _dns_read_uint16(const char *data) {
+    uint16_t _v;
+    memcpy(&_v, data, sizeof(uint16_t));
+    return ntohs(_v);
+}
+uint32_t _dns_read_uint32(const char *data) {
+    uint32_t _v;
+    memcpy(&_v, data, sizeof(uint32_t));
+    return ntohl(_v);
+}
+
+// Skip the name at the offset, return the offset after it, or 0 if the
+// name runs out of the packet.
+size_t _dns_skip_name(const char *data, size_t length, size_t offset) {
     for ( ;; ) {
-        uint8_t _l = begin_of_domain[_readsize];
-        _readsize += 1;
+        if ( offset >= length ) return 0;
+        uint8_t _l = data[offset];
+        if ( (_l & 0xC0) == 0xC0 ) {
+            // A pointer ends the name
+            return (offset + 2 <= length) ? (offset + 2) : 0;
+        }
+        // 0x40 and 0x80 are not used
+        if ( (_l & 0xC0) != 0 ) return 0;
+        offset += 1;
+        if ( _l == 0 ) return offset;
+        offset += _l;
+    }
+}
+
+void sl_dns_name_tolower(string::iterator begin, string::iterator end) {
+    for ( ; begin != end; ++begin ) {
+        if ( *begin >= 'A' && *begin <= 'Z' ) *begin += ('a' - 'A');
+    }
+}
+
+// The offset after the answer section, the new answers are inserted here,
+// before the authority and additional records.
+size_t _dns_answer_end(const string& packet) {
+    sl_dns_view _view(packet);
+    auto _it = _view.records();
+    size_t _offset = _it.offset();
+    sl_dns_rr _rr;
+    while ( _it.next(_rr) ) {
+        if ( _rr.section > sl_dns_section_answer ) break;
+        _offset = _it.offset();
+    }
+    if ( _it.failed() ) return packet.size();
+    return _offset;
+}
+
+sl_dns_view::sl_dns_view(const char *data, size_t length)
+: data_(data), length_(length) { }
+sl_dns_view::sl_dns_view(const string& packet)
+: data_(packet.c_str()), length_(packet.size()) { }
+sl_dns_view::sl_dns_view(const sl_dns_packet& packet)
+: data_(packet.str().c_str()), length_(packet.size()) { }
+
+bool sl_dns_view::is_validate() const
+{
+    return data_ != NULL && length_ >= packet_header_size && length_ <= 0xFFFF;
+}
+
+uint16_t sl_dns_view::get_transaction_id() const
+{
+    if ( !this->is_validate() ) return 0;
+    return _dns_read_uint16(data_);
+}
+bool sl_dns_view::get_is_response_request() const
+{
+    if ( !this->is_validate() ) return false;
+    return (_dns_read_uint16(data_ + 2) & 0x8000) > 0;
+}
+bool sl_dns_view::get_is_truncation() const
+{
+    if ( !this->is_validate() ) return false;
+    return (_dns_read_uint16(data_ + 2) & 0x0200) > 0;
+}
+sl_dns_rcode sl_dns_view::get_resp_code() const
+{
+    if ( !this->is_validate() ) return sl_dns_rcode_format_error;
+    return (sl_dns_rcode)(_dns_read_uint16(data_ + 2) & 0x000F);
+}
+uint16_t sl_dns_view::get_count(sl_dns_section section) const
+{
+    if ( !this->is_validate() ) return 0;
+    return _dns_read_uint16(data_ + sizeof(uint16_t) * (2 + (int)section));
+}
+
+const char * sl_dns_view::data() const { return data_; }
+size_t sl_dns_view::size() const { return length_; }
+
+bool sl_dns_view::get_name(uint16_t offset, string& name) const
+{
+    name.clear();
+    size_t _offset = offset;
+    // A name has at most 127 labels, so do the pointers
+    for ( int _jumps = 0; _jumps < 128; ) {
+        if ( _offset >= length_ ) return false;
+        uint8_t _l = data_[_offset];
         if ( (_l & 0xC0) == 0xC0 ) {
-            // This is an offset
-            string _reset_domain;
-            uint16_t _offset = 0;
-            if ( (_l & 0x3F) == 0 ) {
-                // Use 2 bits
-                _offset = ntohs(*(uint16_t *)(begin_of_domain + _readsize - 1));
-                _offset &= 0x3FFF;
-                _readsize += 1; // read more
-            } else {
-                _offset = (uint16_t)(_l & 0x3F);
-                _readsize += 1;
-            }
-            _dns_get_format_domain(begin_of_pkt + _offset, _reset_domain);
-            domain += _reset_domain;
-            break;
-        } else {
-            if ( _l == 0 ) break;
-            if ( domain.size() > 0 ) domain += ".";
-            domain.append(begin_of_domain + _readsize, _l);
-            _readsize += _l;
+            if ( _offset + 2 > length_ ) return false;
+            size_t _target = _dns_read_uint16(data_ + _offset) & 0x3FFF;
+            // The pointer can only refer to a prior name
+            if ( _target >= _offset ) return false;
+            _offset = _target;
+            _jumps += 1;
+            continue;
+        }
+        if ( (_l & 0xC0) != 0 ) return false;
+        if ( _l == 0 ) return true;
+        if ( _offset + 1 + _l > length_ ) return false;
+        // The full name is limited in 255 bytes
+        if ( name.size() + _l + 1 > 255 ) return false;
+        if ( name.size() > 0 ) name += ".";
+        name.append(data_ + _offset + 1, _l);
+        _offset += (1 + _l);
+    }
+    return false;
+}
+
+sl_dns_view::iterator::iterator(const sl_dns_view& view)
+: view_(&view), offset_(packet_header_size), 
+  section_(sl_dns_section_question), left_(0), failed_(false)
+{
+    if ( view.is_validate() ) {
+        left_ = view.get_count(sl_dns_section_question);
+    } else {
+        failed_ = true;
+    }
+}
+
+bool sl_dns_view::iterator::next(sl_dns_rr& rr)
+{
+    if ( failed_ ) return false;
+    while ( left_ == 0 ) {
+        if ( section_ == sl_dns_section_additional ) return false;
+        section_ = (sl_dns_section)((int)section_ + 1);
+        left_ = view_->get_count(section_);
+    }
+
+    const char *_data = view_->data();
+    size_t _length = view_->size();
+    size_t _offset = _dns_skip_name(_data, _length, offset_);
+    // Type and Class
+    if ( _offset == 0 || _offset + 4 > _length ) {
+        failed_ = true;
+        return false;
+    }
+    rr.section = section_;
+    rr.name_offset = (uint16_t)offset_;
+    rr.type = _dns_read_uint16(_data + _offset);
+    rr.rclass = _dns_read_uint16(_data + _offset + 2);
+    _offset += 4;
+
+    if ( section_ == sl_dns_section_question ) {
+        rr.ttl = 0;
+        rr.ttl_offset = 0;
+        rr.rdata_offset = (uint16_t)_offset;
+        rr.rdata_length = 0;
+    } else {
+        // TTL and RData Length
+        if ( _offset + 6 > _length ) {
+            failed_ = true;
+            return false;
+        }
+        rr.ttl_offset = (uint16_t)_offset;
+        rr.ttl = _dns_read_uint32(_data + _offset);
+        rr.rdata_length = _dns_read_uint16(_data + _offset + 4);
+        _offset += 6;
+        if ( _offset + rr.rdata_length > _length ) {
+            failed_ = true;
+            return false;
         }
+        rr.rdata_offset = (uint16_t)_offset;
+        _offset += rr.rdata_length;
     }
-    return _readsize;
+    offset_ = _offset;
+    left_ -= 1;
+    return true;
+}
+
+bool sl_dns_view::iterator::failed() const { return failed_; }
+size_t sl_dns_view::iterator::offset() const { return offset_; }
+
+sl_dns_view::iterator sl_dns_view::records() const
+{
+    return iterator(*this);
 }
 
 sl_dns_packet::sl_dns_packet()
@@ -170,13 +312,6 @@ sl_dns_packet::sl_dns_packet(uint16_t trans_id, const string& query_domain)
 bool sl_dns_packet::is_validate_query() const
 {
     if ( this->get_is_query_request() == false ) return false;
-    if ( packet_data_.size() > 512 ) return false;
-    // If the request is a query one, minimal size of the packet should be
-    // the header size plus 2bytes Class and 2bytes CType, and some unpsecified
-    // length of querying domain.
-    if ( packet_data_.size() <= (packet_header_size + 4) ) return false;
-    // THe format of a query request shoule be [header][format_domain\0][type][class]
-    if ( packet_data_[packet_data_.size() - 5] != '\0' ) return false;
     // The QD Count should always be 1
     if ( this->get_qd_count() != 1 ) return false;
     // The RCode should always be zero in a query request
@@ -186,6 +321,16 @@ bool sl_dns_packet::is_validate_query() const
     // The AR code should be 0, 1 or 2
     if ( this->get_ar_count() > 2 ) return false;
 
+    // THe format of a query request shoule be [header][format_domain\0][type][class]
+    // and the additional records like OPT, nothing else.
+    sl_dns_view _view(*this);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    if ( !_it.next(_rr) ) return false;
+    if ( packet_data_[_rr.rdata_offset - 5] != '\0' ) return false;
+    while ( _it.next(_rr) );
+    if ( _it.failed() || _it.offset() != packet_data_.size() ) return false;
+
     return true;
 }
 bool sl_dns_packet::is_validate_response() const
@@ -373,8 +518,11 @@ sl_dns_packet& sl_dns_packet::operator = (const sl_dns_packet&& rrhs)
 const string sl_dns_packet::get_query_domain() const
 {
     string _domain;
-    if ( packet_data_.size() > (packet_header_size + 2 + 2) ) {
-        _dns_get_format_domain(packet_data_.c_str() + packet_header_size, _domain);
+    sl_dns_view _view(*this);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    if ( _it.next(_rr) && _rr.section == sl_dns_section_question ) {
+        _view.get_name(_rr.name_offset, _domain);
     }
     return _domain;
 }
@@ -400,47 +548,35 @@ void sl_dns_packet::set_query_domain(const string& domain, sl_dns_qtype qtype, s
 // A-Records
 const vector<sl_ip> sl_dns_packet::get_A_records() const
 {
-    string _qdomain(this->get_query_domain());
+    uint32_t _ttl = 0;
+    return this->get_A_records(_ttl);
+}
+const vector<sl_ip> sl_dns_packet::get_A_records(uint32_t &ttl) const
+{
+    ttl = 0;
+    bool _has_ttl = false;
     vector<sl_ip> _result_list;
 
-    if ( _qdomain.size() == 0 ) return _result_list;
-
-    // Get the data offset
-    // Header Size + Domain Size(+2) + QType + QClass
-    const char *_pbuf = (
-        packet_data_.c_str() +      // Start point
-        packet_header_size +        // Header Fixed Size
-        (_qdomain.size() + 2) +     // Domain Size + 2(start length, and \0)
-        2 +                         // QType
-        2                           // QClass
-        );
+    sl_dns_view _view(*this);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    while ( _it.next(_rr) ) {
+        if ( _rr.section == sl_dns_section_question ) continue;
+        if ( _rr.section != sl_dns_section_answer ) break;
 
-    uint16_t _an = this->get_an_count();
-    for ( uint16_t i = 0; i < _an; ++i ) {
-        string _domain;
-        int _dsize = _dns_get_format_domain(_pbuf, packet_data_.c_str(), _domain);
-        _pbuf += _dsize;
-
-        // Get the record type
-        uint16_t _type = ntohs(((uint16_t *)_pbuf)[0]);
-        _pbuf += sizeof(uint16_t);
-
-        bool _is_a_records = ((sl_dns_qtype)_type == sl_dns_qtype_host);
-
-        // Skip QClass
-        _pbuf += sizeof(uint16_t);
-        // Skip TTL
-        _pbuf += sizeof(uint32_t);
-
-        // Get RData Length
-        uint16_t _rlen = ntohs(*(uint16_t *)_pbuf);
-        _pbuf += sizeof(uint16_t);
+        bool _is_a_records = ((sl_dns_qtype)_rr.type == sl_dns_qtype_host && _rr.rdata_length == 4);
+        bool _is_c_name = ((sl_dns_qtype)_rr.type == sl_dns_qtype_cname);
 
+        // The whole answer expires with the first record in the chain
+        if ( (_is_a_records || _is_c_name) && (!_has_ttl || _rr.ttl < ttl) ) {
+            ttl = _rr.ttl;
+            _has_ttl = true;
+        }
         if ( _is_a_records ) {
-            uint32_t _a_rec = *(uint32_t *)_pbuf;
+            uint32_t _a_rec;
+            memcpy(&_a_rec, _view.data() + _rr.rdata_offset, sizeof(uint32_t));
             _result_list.emplace_back(sl_ip(_a_rec));
         }
-        _pbuf += _rlen;
     }
     return _result_list;
 }
@@ -456,14 +592,16 @@ void sl_dns_packet::set_A_records(const vector<sl_ip> & a_records)
     // Set the response code, no error
     this->set_resp_code(sl_dns_rcode_noerr);
 
+    // Insert the answers before the authority and additional records
+    size_t _current_size = _dns_answer_end(packet_data_);
+
     // Update answer count
     ((uint16_t *)&(packet_data_[0]))[3] = htons(a_records.size() + this->get_an_count());
 
     // All length: incoming packet(header + query domain) + 2bytes domain-name(offset to query domain) + 
     // 2 bytes type(A) + 2 bytes class(IN) + 4 bytes(TTL) + 2bytes(r-length) + 4bytes(r-data, ipaddr)
     size_t _append_size = (2 + 2 + 2 + 4 + 2 + 4) * a_records.size();
-    size_t _current_size = packet_data_.size();
-    packet_data_.resize(_current_size + _append_size);
+    packet_data_.insert(_current_size, _append_size, '\0');
 
     // Offset
     uint16_t _name_offset = packet_header_size;
@@ -508,48 +646,20 @@ void sl_dns_packet::set_A_records(const vector<sl_ip> & a_records)
 // Dump all C-Name Records in the dns packet
 const vector<string> sl_dns_packet::get_C_Names() const
 {
-    string _qdomain(this->get_query_domain());
     vector<string> _result_list;
 
-    if ( _qdomain.size() == 0 ) return _result_list;
-
-    // Get the data offset
-    // Header Size + Domain Size(+2) + QType + QClass
-    const char *_pbuf = (
-        packet_data_.c_str() +      // Start point
-        packet_header_size +        // Header Fixed Size
-        (_qdomain.size() + 2) +     // Domain Size + 2(start length, and \0)
-        2 +                         // QType
-        2                           // QClass
-        );
-
-    uint16_t _an = this->get_an_count();
-    for ( uint16_t i = 0; i < _an; ++i ) {
-        string _domain;
-        int _dsize = _dns_get_format_domain(_pbuf, packet_data_.c_str(), _domain);
-        _pbuf += _dsize;
-
-        // Get the record type
-        uint16_t _type = ntohs(*(uint16_t *)_pbuf);
-        _pbuf += sizeof(uint16_t);
-
-        bool _is_c_name = ((sl_dns_qtype)_type == sl_dns_qtype_cname);
-
-        // Skip QClass
-        _pbuf += sizeof(uint16_t);
-        // Skip TTL
-        _pbuf += sizeof(uint32_t);
-
-        // Get RData Length
-        uint16_t _rlen = ntohs(*(uint16_t *)_pbuf);
-        _pbuf += sizeof(uint16_t);
-
-        if ( _is_c_name ) {
-            string _cname;
-            _dns_get_format_domain(_pbuf, packet_data_.c_str(), _cname);
+    sl_dns_view _view(*this);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    while ( _it.next(_rr) ) {
+        if ( _rr.section == sl_dns_section_question ) continue;
+        if ( _rr.section != sl_dns_section_answer ) break;
+        if ( (sl_dns_qtype)_rr.type != sl_dns_qtype_cname ) continue;
+
+        string _cname;
+        if ( _view.get_name(_rr.rdata_offset, _cname) ) {
             _result_list.emplace_back(_cname);
         }
-        _pbuf += _rlen;
     }
     return _result_list;
 }
@@ -566,17 +676,20 @@ void sl_dns_packet::set_C_Names(const vector<string> & c_names)
     // Set the response code, no error
     this->set_resp_code(sl_dns_rcode_noerr);
 
+    // Insert the answers before the authority and additional records
+    size_t _current_size = _dns_answer_end(packet_data_);
+
     // Update answer count
     ((uint16_t *)&(packet_data_[0]))[3] = htons(c_names.size() + this->get_an_count());
 
     // All length: incoming packet(header + query domain) + 2bytes domain-name(offset to query domain) + 
     // 2 bytes type(A) + 2 bytes class(IN) + 4 bytes(TTL) + 2bytes(r-length) + n-bytes data
+    // The formated name has 2 more bytes, the first length and the last \0
     size_t _append_size = 0;
     for ( auto &_name : c_names ) {
-        _append_size += (2 + 2 + 2 + 4 + 2 + _name.size());
+        _append_size += (2 + 2 + 2 + 4 + 2 + _name.size() + 2);
     }
-    size_t _current_size = packet_data_.size();
-    packet_data_.resize(_current_size + _append_size);
+    packet_data_.insert(_current_size, _append_size, '\0');
 
     // Offset
     uint16_t _name_offset = packet_header_size;
@@ -620,6 +733,69 @@ void sl_dns_packet::set_C_Names(const vector<string> & c_names)
     }
 }
 
+// EDNS0
+void sl_dns_packet::set_edns(uint16_t payload_size, bool dnssec_ok)
+{
+    // Check if has set the query domain
+    if ( packet_data_.size() <= (packet_header_size + 2 + 2) ) return;
+    if ( payload_size < SL_DNS_UDP_PACKET_SIZE ) payload_size = SL_DNS_UDP_PACKET_SIZE;
+
+    sl_dns_view _view(*this);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    while ( _it.next(_rr) ) {
+        if ( _rr.section != sl_dns_section_additional ) continue;
+        if ( (sl_dns_qtype)_rr.type != sl_dns_qtype_opt ) continue;
+        // Update the payload size in the class, and the DO flag in the ttl
+        uint16_t *_pclass = (uint16_t *)(&packet_data_[0] + _rr.ttl_offset - sizeof(uint16_t));
+        *_pclass = htons(payload_size);
+        uint16_t *_pflags = (uint16_t *)(&packet_data_[0] + _rr.ttl_offset + sizeof(uint16_t));
+        *_pflags = htons(dnssec_ok ? 0x8000 : 0);
+        return;
+    }
+    if ( _it.failed() ) return;
+
+    // Update additional count
+    ((uint16_t *)&(packet_data_[0]))[5] = htons(1 + this->get_ar_count());
+
+    // 1 byte root domain + 2 bytes type(OPT) + 2 bytes payload size +
+    // 1 byte extended rcode + 1 byte version + 2 bytes flags + 2 bytes(r-length)
+    size_t _boffset = packet_data_.size();
+    packet_data_.resize(_boffset + 1 + 2 + 2 + 4 + 2, '\0');
+    _boffset += 1;
+
+    uint16_t *_ptype = (uint16_t *)(&packet_data_[0] + _boffset);
+    *_ptype = htons((uint16_t)sl_dns_qtype_opt);
+    _boffset += sizeof(uint16_t);
+
+    uint16_t *_pclass = (uint16_t *)(&packet_data_[0] + _boffset);
+    *_pclass = htons(payload_size);
+    _boffset += sizeof(uint16_t);
+
+    // Extended RCode and Version are 0
+    uint16_t *_pflags = (uint16_t *)(&packet_data_[0] + _boffset + sizeof(uint16_t));
+    *_pflags = htons(dnssec_ok ? 0x8000 : 0);
+}
+bool sl_dns_packet::get_edns(uint16_t& payload_size) const
+{
+    sl_dns_view _view(*this);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    while ( _it.next(_rr) ) {
+        if ( _rr.section != sl_dns_section_additional ) continue;
+        if ( (sl_dns_qtype)_rr.type != sl_dns_qtype_opt ) continue;
+        payload_size = max((uint16_t)SL_DNS_UDP_PACKET_SIZE, _rr.rclass);
+        return true;
+    }
+    return false;
+}
+uint16_t sl_dns_packet::get_udp_payload_size() const
+{
+    uint16_t _payload_size = SL_DNS_UDP_PACKET_SIZE;
+    this->get_edns(_payload_size);
+    return _payload_size;
+}
+
 // Size
 size_t sl_dns_packet::size() const { return packet_data_.size(); }
 // Buffer Point
@@ -638,6 +814,44 @@ const string sl_dns_packet::to_tcp_packet() const
     return _packet;
 }
 
+void sl_dns_packet::decrease_ttls(const vector<uint16_t>& ttl_offsets, uint32_t elapsed)
+{
+    for ( auto _offset : ttl_offsets ) {
+        if ( (size_t)_offset + sizeof(uint32_t) > packet_data_.size() ) continue;
+        uint32_t _ttl = _dns_read_uint32(packet_data_.c_str() + _offset);
+        _ttl = (_ttl > elapsed) ? (_ttl - elapsed) : 0;
+        _ttl = htonl(_ttl);
+        memcpy(&packet_data_[_offset], &_ttl, sizeof(uint32_t));
+    }
+}
+void sl_dns_packet::set_ttls(const vector<uint16_t>& ttl_offsets, uint32_t ttl)
+{
+    uint32_t _ttl = htonl(ttl);
+    for ( auto _offset : ttl_offsets ) {
+        if ( (size_t)_offset + sizeof(uint32_t) > packet_data_.size() ) continue;
+        memcpy(&packet_data_[_offset], &_ttl, sizeof(uint32_t));
+    }
+}
+
+bool sl_dns_packet::get_negative_ttl(uint32_t& ttl) const
+{
+    sl_dns_view _view(*this);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    while ( _it.next(_rr) ) {
+        if ( _rr.section != sl_dns_section_authority ) continue;
+        if ( (sl_dns_qtype)_rr.type != sl_dns_qtype_soa ) continue;
+        // MNAME, RNAME, SERIAL, REFRESH, RETRY, EXPIRE, MINIMUM
+        // The MINIMUM is the last 4 bytes of the rdata
+        if ( _rr.rdata_length < 2 + 5 * sizeof(uint32_t) ) return false;
+        uint32_t _minimum = _dns_read_uint32(
+            _view.data() + _rr.rdata_offset + _rr.rdata_length - sizeof(uint32_t));
+        ttl = min(_rr.ttl, _minimum);
+        return true;
+    }
+    return false;
+}
+
 #endif
 
 // cleandns.dns.cpp
@@ -0,0 +1,333 @@
+/*
+    socklite -- a C++ socket library for Linux/Windows/iOS
+    Copyright (C) 2014  Push Chen
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    You can connect me by email: littlepush@gmail.com, 
+    or @me on twitter: @littlepush
+*/
+
+#include "dnscache.h"
+
+sl_dns_cache::sl_dns_cache()
+    : shard_size_(SL_DNS_CACHE_DEFAULT_SIZE / SL_DNS_CACHE_SHARDS),
+    min_ttl_(SL_DNS_CACHE_DEFAULT_MIN_TTL),
+    max_ttl_(SL_DNS_CACHE_DEFAULT_MAX_TTL),
+    max_negative_ttl_(SL_DNS_CACHE_DEFAULT_MAX_NEG_TTL),
+    stale_ttl_(SL_DNS_CACHE_DEFAULT_STALE_TTL),
+    hit_count_(0), miss_count_(0), stale_count_(0)
+{ }
+
+sl_dns_cache::cache_shard& sl_dns_cache::_shard(const string& key)
+{
+    return shards_[hash<string>()(key) % SL_DNS_CACHE_SHARDS];
+}
+
+string sl_dns_cache::make_key(
+    const string& name, 
+    sl_dns_qtype qtype, 
+    const vector<sl_peerinfo>& nameserver_list,
+    const sl_peerinfo& socks5
+)
+{
+    // Domain name is case insensitive
+    string _key(name);
+    sl_dns_name_tolower(_key.begin(), _key.end());
+    _key += "|" + to_string((int)qtype);
+    for ( auto& _ns : nameserver_list ) {
+        _key += "|" + _ns.operator const string();
+    }
+    if ( socks5 ) {
+        _key += "|socks5:" + socks5.operator const string();
+    }
+    return _key;
+}
+
+string sl_dns_cache::make_key(
+    const sl_dns_packet& query,
+    const vector<sl_peerinfo>& nameserver_list,
+    const sl_peerinfo& socks5
+)
+{
+    sl_dns_view _view(query);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    if ( !_it.next(_rr) || _rr.section != sl_dns_section_question ) return string();
+    // The name, type and class of the question, the name in lower case
+    string _key("packet|");
+    _key.append(_view.data() + _rr.name_offset, _rr.rdata_offset - _rr.name_offset);
+    sl_dns_name_tolower(_key.begin(), _key.end() - 4);
+    _key += (query.get_is_recursive_desired() ? "|rd" : "|nord");
+    // A response to an EDNS0 query may be too large for the one without
+    uint16_t _payload_size = 0;
+    if ( query.get_edns(_payload_size) ) _key += "|edns" + to_string(_payload_size);
+    for ( auto& _ns : nameserver_list ) {
+        _key += "|" + _ns.operator const string();
+    }
+    if ( socks5 ) {
+        _key += "|socks5:" + socks5.operator const string();
+    }
+    return _key;
+}
+
+void sl_dns_cache::setup(
+    size_t max_size, 
+    uint32_t min_ttl, 
+    uint32_t max_ttl, 
+    uint32_t max_negative_ttl, 
+    uint32_t stale_ttl
+)
+{
+    size_t _shard_size = max_size / SL_DNS_CACHE_SHARDS;
+    if ( max_size > 0 && _shard_size == 0 ) _shard_size = 1;
+    shard_size_ = _shard_size;
+    min_ttl_ = min_ttl;
+    max_ttl_ = max(min_ttl, max_ttl);
+    max_negative_ttl_ = max(min_ttl, max_negative_ttl);
+    stale_ttl_ = stale_ttl;
+    if ( _shard_size == 0 ) this->clear();
+}
+
+sl_dns_cache::cache_item* sl_dns_cache::_find(cache_shard& s, const string& key, bool stale)
+{
+    auto _cit = s.cache_map.find(key);
+    if ( _cit == end(s.cache_map) ) return NULL;
+    auto _now = steady_clock::now();
+    if ( _cit->second.expire <= _now ) {
+        // Keep the expired positive answer in the stale window
+        bool _keep = (!_cit->second.negative && 
+            _cit->second.expire + seconds(stale_ttl_) > _now);
+        if ( !_keep ) {
+            s.lru_list.erase(_cit->second.lru);
+            s.cache_map.erase(_cit);
+            return NULL;
+        }
+        if ( !stale ) return NULL;
+    } else if ( stale && _cit->second.negative ) {
+        return NULL;
+    }
+    // Move to the front of the lru list
+    s.lru_list.splice(begin(s.lru_list), s.lru_list, _cit->second.lru);
+    return &_cit->second;
+}
+
+void sl_dns_cache::_save(const string& key, cache_item&& item)
+{
+    size_t _shard_size = shard_size_;
+    if ( _shard_size == 0 ) return;
+    cache_shard& _s = this->_shard(key);
+    lock_guard<mutex> _(_s.locker);
+    auto _cit = _s.cache_map.find(key);
+    if ( _cit != end(_s.cache_map) ) {
+        item.lru = _cit->second.lru;
+        _cit->second = move(item);
+        _s.lru_list.splice(begin(_s.lru_list), _s.lru_list, _cit->second.lru);
+        return;
+    }
+    // Drop the least recently used answers
+    while ( _s.cache_map.size() >= _shard_size ) {
+        _s.cache_map.erase(_s.lru_list.back());
+        _s.lru_list.pop_back();
+    }
+    _s.lru_list.push_front(key);
+    item.lru = begin(_s.lru_list);
+    _s.cache_map[key] = move(item);
+}
+
+bool sl_dns_cache::get(const string& key, vector<sl_ip>& records)
+{
+    if ( shard_size_ == 0 ) return false;
+    cache_shard& _s = this->_shard(key);
+    do {
+        lock_guard<mutex> _(_s.locker);
+        cache_item* _item = this->_find(_s, key);
+        if ( _item == NULL ) break;
+        records = _item->records;
+        _item->last_hit = steady_clock::now();
+        hit_count_ += 1;
+        return true;
+    } while ( false );
+    miss_count_ += 1;
+    return false;
+}
+
+uint32_t sl_dns_cache::set(const string& key, const vector<sl_ip>& records, uint32_t ttl)
+{
+    if ( shard_size_ == 0 ) return 0;
+    if ( records.size() == 0 ) return 0;
+    ttl = max((uint32_t)min_ttl_, min((uint32_t)max_ttl_, ttl));
+
+    cache_item _item;
+    _item.records = records;
+    _item.created = steady_clock::now();
+    _item.expire = _item.created + seconds(ttl);
+    _item.negative = false;
+    this->_save(key, move(_item));
+    return ttl;
+}
+
+void sl_dns_cache::set_negative(const string& key, const vector<sl_ip>& records, uint32_t ttl)
+{
+    if ( shard_size_ == 0 ) return;
+    ttl = max((uint32_t)min_ttl_, min((uint32_t)max_negative_ttl_, ttl));
+
+    cache_item _item;
+    _item.records = records;
+    _item.created = steady_clock::now();
+    _item.expire = _item.created + seconds(ttl);
+    _item.negative = true;
+    this->_save(key, move(_item));
+}
+
+bool sl_dns_cache::get_stale(const string& key, vector<sl_ip>& records)
+{
+    if ( shard_size_ == 0 || stale_ttl_ == 0 ) return false;
+    cache_shard& _s = this->_shard(key);
+    lock_guard<mutex> _(_s.locker);
+    cache_item* _item = this->_find(_s, key, true);
+    if ( _item == NULL || _item->records.size() == 0 ) return false;
+    records = _item->records;
+    stale_count_ += 1;
+    return true;
+}
+
+bool sl_dns_cache::last_hit(const string& key, steady_clock::time_point& hit_time)
+{
+    if ( shard_size_ == 0 ) return false;
+    cache_shard& _s = this->_shard(key);
+    lock_guard<mutex> _(_s.locker);
+    auto _cit = _s.cache_map.find(key);
+    if ( _cit == end(_s.cache_map) ) return false;
+    if ( _cit->second.expire <= steady_clock::now() ) return false;
+    hit_time = _cit->second.last_hit;
+    return true;
+}
+
+bool sl_dns_cache::get(const string& key, const sl_dns_packet& query, sl_dns_packet& resp)
+{
+    if ( shard_size_ == 0 || key.size() == 0 ) return false;
+    cache_shard& _s = this->_shard(key);
+    do {
+        lock_guard<mutex> _(_s.locker);
+        cache_item* _item = this->_find(_s, key);
+        if ( _item == NULL ) break;
+        resp = _item->packet;
+        uint32_t _elapsed = (uint32_t)duration_cast<seconds>(
+            steady_clock::now() - _item->created).count();
+        resp.decrease_ttls(_item->ttl_offsets, _elapsed);
+        resp.set_transaction_id(query.get_transaction_id());
+        hit_count_ += 1;
+        return true;
+    } while ( false );
+    miss_count_ += 1;
+    return false;
+}
+
+void sl_dns_cache::set(const string& key, const sl_dns_packet& resp)
+{
+    if ( shard_size_ == 0 || key.size() == 0 ) return;
+    if ( resp.get_is_truncation() ) return;
+    bool _negative = false;
+    uint32_t _negative_ttl = 0;
+    if ( resp.get_resp_code() == sl_dns_rcode_name_error || 
+        (resp.get_resp_code() == sl_dns_rcode_noerr && resp.get_an_count() == 0) ) {
+        // NXDOMAIN or NODATA, cache it with the SOA record
+        if ( !resp.get_negative_ttl(_negative_ttl) ) return;
+        _negative = true;
+    } else if ( resp.get_resp_code() != sl_dns_rcode_noerr ) {
+        return;
+    }
+
+    cache_item _item;
+    bool _has_ttl = false;
+    uint32_t _ttl = 0;
+    sl_dns_view _view(resp);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    while ( _it.next(_rr) ) {
+        if ( _rr.section == sl_dns_section_question ) continue;
+        // The TTL field of the OPT record is the extended flags
+        if ( (sl_dns_qtype)_rr.type == sl_dns_qtype_opt ) continue;
+        _item.ttl_offsets.push_back(_rr.ttl_offset);
+        if ( !_has_ttl || _rr.ttl < _ttl ) {
+            _ttl = _rr.ttl;
+            _has_ttl = true;
+        }
+    }
+    if ( _it.failed() || !_has_ttl ) return;
+    if ( _negative ) {
+        _ttl = max((uint32_t)min_ttl_, min((uint32_t)max_negative_ttl_, _negative_ttl));
+    } else {
+        _ttl = max((uint32_t)min_ttl_, min((uint32_t)max_ttl_, _ttl));
+    }
+
+    _item.packet = resp;
+    _item.created = steady_clock::now();
+    _item.expire = _item.created + seconds(_ttl);
+    _item.negative = _negative;
+    this->_save(key, move(_item));
+}
+
+bool sl_dns_cache::get_stale(const string& key, const sl_dns_packet& query, sl_dns_packet& resp)
+{
+    if ( shard_size_ == 0 || stale_ttl_ == 0 || key.size() == 0 ) return false;
+    cache_shard& _s = this->_shard(key);
+    lock_guard<mutex> _(_s.locker);
+    cache_item* _item = this->_find(_s, key, true);
+    if ( _item == NULL || _item->ttl_offsets.size() == 0 ) return false;
+    resp = _item->packet;
+    resp.set_ttls(_item->ttl_offsets, SL_DNS_CACHE_STALE_ANSWER_TTL);
+    resp.set_transaction_id(query.get_transaction_id());
+    stale_count_ += 1;
+    return true;
+}
+
+void sl_dns_cache::clear()
+{
+    for ( auto& _s : shards_ ) {
+        lock_guard<mutex> _(_s.locker);
+        _s.cache_map.clear();
+        _s.lru_list.clear();
+    }
+}
+
+uint64_t sl_dns_cache::hit_count() const { return hit_count_; }
+uint64_t sl_dns_cache::miss_count() const { return miss_count_; }
+uint64_t sl_dns_cache::stale_count() const { return stale_count_; }
+size_t sl_dns_cache::size()
+{
+    size_t _size = 0;
+    for ( auto& _s : shards_ ) {
+        lock_guard<mutex> _(_s.locker);
+        _size += _s.cache_map.size();
+    }
+    return _size;
+}
+
+sl_dns_cache& sl_dns_cache::server()
+{
+    static sl_dns_cache _g_cache;
+    return _g_cache;
+}
+
+// sock.lite.dnscache.cpp
+
+/*
+ Push Chen.
+ littlepush@gmail.com
+ http://pushchen.com
+ http://twitter.com/littlepush
+ */
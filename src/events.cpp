@@ -47,6 +47,14 @@ sl_events::sl_events()
 
 sl_events::~sl_events()
 {
+    // Stop all accepting threads
+    vector<SOCKET_T> _listeners;
+    do {
+        lock_guard<mutex> _(accept_mutex_);
+        for ( auto &_ait : accept_threads_ ) _listeners.push_back(_ait.first);
+    } while ( false );
+    for ( auto _so : _listeners ) this->_internal_stop_accepting(_so);
+
     // Delete the main runloop thread
     if ( runloop_thread_->joinable() ) {
         runloop_thread_->join();
@@ -169,6 +177,8 @@ void sl_events::_internal_runloop()
                 _ermit->second.unsaved = 0;
             });
         }
+        // Invoke the timers
+        this->_internal_fire_timers();
         // Invoke the callback
         if ( _fp != NULL ) {
             _fp();
@@ -178,6 +188,122 @@ void sl_events::_internal_runloop()
     linfo << "internal runloop will terminated" << lend;
 }
 
+void sl_events::_internal_fire_timers()
+{
+    size_t _fire_count = 0;
+    do {
+        lock_guard<mutex> _(timer_mutex_);
+        auto _now = steady_clock::now();
+        auto _tit = begin(timer_map_);
+        for ( ; _tit != end(timer_map_) && _tit->first <= _now; ++_tit ) {
+            timer_fired_.emplace_back(move(_tit->second));
+            ++_fire_count;
+        }
+        timer_map_.erase(begin(timer_map_), _tit);
+    } while ( false );
+
+    // The callbacks run in the workers, so the runloop keeps polling
+    for ( size_t i = 0; i < _fire_count; ++i ) {
+        sl_event _e;
+        _e.so = INVALIDATE_SOCKET;
+        _e.source = INVALIDATE_SOCKET;
+        _e.event = SL_EVENT_TIMEOUT;
+        _e.socktype = 0;
+        events_pool_.notify_one(move(_e));
+    }
+}
+
+void sl_events::_internal_run_timer()
+{
+    sl_runloop_callback _fp;
+    do {
+        lock_guard<mutex> _(timer_mutex_);
+        if ( timer_fired_.size() == 0 ) return;
+        _fp = move(timer_fired_.front());
+        timer_fired_.pop_front();
+    } while ( false );
+    if ( _fp ) _fp();
+}
+
+void sl_events::_internal_accept_worker(SOCKET_T so, shared_ptr<atomic<bool>> stop)
+{
+    thread_agent _ta;
+
+    // A private poller only for the listening socket, so the kernel will
+    // wake up this thread for the connections in its own accept queue.
+#if SL_TARGET_LINUX
+    int _fd = epoll_create1(0);
+    struct epoll_event _ee;
+    _ee.data.fd = so;
+    _ee.events = EPOLLIN | EPOLLET;
+    if ( _fd == -1 || -1 == epoll_ctl(_fd, EPOLL_CTL_ADD, so, &_ee) ) {
+#elif SL_TARGET_MAC
+    int _fd = kqueue();
+    struct kevent _ee;
+    EV_SET(&_ee, so, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if ( _fd == -1 || -1 == kevent(_fd, &_ee, 1, NULL, 0, NULL) ) {
+#endif
+        lerror << "failed to create the accepting poller of socket " << so << ": " << ::strerror(errno) << lend;
+        if ( _fd != -1 ) close(_fd);
+        events_pool_.notify_one(move(sl_event_make_failed(so)));
+        return;
+    }
+
+    bool _has_more = false;
+    while ( this_thread_is_running() && !(*stop) ) {
+        // Keep accepting the pending connections, unless the process runs
+        // out of file descriptors
+        uint32_t _timedout = (_has_more && !sl_poller::server().is_fd_exhausted()) ? 0 : 100;
+#if SL_TARGET_LINUX
+        int _count = epoll_wait(_fd, &_ee, 1, _timedout);
+#elif SL_TARGET_MAC
+        struct timespec _ts = { _timedout / 1000, _timedout % 1000 * 1000 * 1000 };
+        int _count = kevent(_fd, NULL, 0, &_ee, 1, &_ts);
+#endif
+        if ( _count <= 0 && !_has_more ) continue;
+
+        sl_poller::earray _event_list;
+        _has_more = sl_poller::server().accept_incoming(so, _event_list);
+        for ( auto &_e : _event_list ) {
+            events_pool_.notify_one(move(_e));
+        }
+    }
+    close(_fd);
+}
+
+bool sl_events::start_accepting(SOCKET_T so)
+{
+    if ( SOCKET_NOT_VALIDATE(so) ) return false;
+    lock_guard<mutex> _(accept_mutex_);
+    if ( accept_threads_.find(so) != end(accept_threads_) ) return true;
+    shared_ptr<atomic<bool>> _stop = make_shared<atomic<bool>>(false);
+    thread *_t = new thread([this, so, _stop]() {
+        _internal_accept_worker(so, _stop);
+    });
+    accept_threads_[so] = make_pair(_t, _stop);
+    return true;
+}
+
+void sl_events::_internal_stop_accepting(SOCKET_T so)
+{
+    thread *_t = NULL;
+    do {
+        lock_guard<mutex> _(accept_mutex_);
+        auto _ait = accept_threads_.find(so);
+        if ( _ait == end(accept_threads_) ) return;
+        _t = _ait->second.first;
+        *_ait->second.second = true;
+        accept_threads_.erase(_ait);
+    } while ( false );
+    // The thread stops in one wait interval
+    if ( _t->get_id() == this_thread::get_id() ) {
+        _t->detach();
+    } else if ( _t->joinable() ) {
+        _t->join();
+    }
+    delete _t;
+}
+
 void sl_events::_internal_add_worker()
 {
     thread *_worker = new thread([this](){
@@ -213,6 +339,8 @@ void sl_events::_internal_worker()
             ldebug << "processing " << e << lend;
             #endif
             _local_event = e;
+            // A due timer
+            if ( SOCKET_NOT_VALIDATE(e.so) && e.event == SL_EVENT_TIMEOUT ) return;
             SOCKET_T _s = ((_local_event.event == SL_EVENT_ACCEPT) && 
                             (_local_event.socktype == IPPROTO_TCP)) ? 
                             _local_event.source : _local_event.so;
@@ -230,10 +358,22 @@ void sl_events::_internal_worker()
             }
         }) ) continue;
 
+        if ( SOCKET_NOT_VALIDATE(_local_event.so) && _local_event.event == SL_EVENT_TIMEOUT ) {
+            this->_internal_run_timer();
+            continue;
+        }
         if ( _handler ) {
             _handler(_local_event);
         } else {
             lwarning << "no handler for " << _local_event << lend;
+            // The listening socket has been closed, drop the incoming 
+            // socket and release its admission slot.
+            if ( _local_event.event == SL_EVENT_ACCEPT &&
+                 _local_event.socktype == IPPROTO_TCP ) 
+            {
+                sl_poller::server().unmonitor_socket(_local_event.so);
+                SL_NETWORK_CLOSESOCK(_local_event.so);
+            }
         }
     }
 
@@ -288,6 +428,7 @@ void sl_events::bind( SOCKET_T so, sl_handler_set&& hset )
 void sl_events::unbind( SOCKET_T so )
 {
     if ( SOCKET_NOT_VALIDATE(so) ) return;
+    this->_internal_stop_accepting(so);
     lock_guard<mutex> _hl(handler_mutex_);
     lock_guard<mutex> _el(event_mutex_);
     handler_map_.erase(so);
@@ -385,6 +526,25 @@ void sl_events::monitor(SOCKET_T so, SL_EVENT_ID eid, sl_socket_event_handler ha
     }
 }
 
+void sl_events::unmonitor(SOCKET_T so, SL_EVENT_ID eid)
+{
+    if ( SOCKET_NOT_VALIDATE(so) ) return;
+    lock_guard<mutex> _(event_mutex_);
+
+    auto _ermit = event_remonitor_map_.find(so);
+    if ( _ermit == end(event_remonitor_map_) ) return;
+    if ( (_ermit->second.eventid & eid) == 0 ) return;
+    _ermit->second.eventid &= (~eid);
+    this->update_handler(so, eid, NULL);
+
+    // Re-monitor the rest events
+    sl_poller::server().monitor_socket(
+        so, true, 
+        _ermit->second.eventid, 
+        _ermit->second.timeout
+        );
+}
+
 void sl_events::setup(uint32_t timepiece, sl_runloop_callback cb)
 {
     lock_guard<mutex> _(running_lock_);
@@ -392,6 +552,13 @@ void sl_events::setup(uint32_t timepiece, sl_runloop_callback cb)
     rl_callback_ = cb;
 }
 
+void sl_events::add_timer(uint32_t delay, sl_runloop_callback cb)
+{
+    if ( !cb ) return;
+    lock_guard<mutex> _(timer_mutex_);
+    timer_map_.emplace(steady_clock::now() + milliseconds(delay), move(cb));
+}
+
 void sl_events::add_event(sl_event && e)
 {
     //lock_guard<mutex> _(events_lock_);
@@ -0,0 +1,258 @@
+/*
+    socklite -- a C++ socket library for Linux/Windows/iOS
+    Copyright (C) 2014  Push Chen
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    You can connect me by email: littlepush@gmail.com, 
+    or @me on twitter: @littlepush
+*/
+
+#include "frame.h"
+
+// Decoder
+sl_frame_decoder::sl_frame_decoder(size_t max_frame_size)
+: pending_size_(0), max_frame_size_(max_frame_size) { }
+sl_frame_decoder::~sl_frame_decoder() { }
+
+bool sl_frame_decoder::_peek(size_t offset, void *buffer, size_t length) const
+{
+    if ( offset + length > pending_size_ ) return false;
+    char *_out = (char *)buffer;
+    for ( auto &_v : pending_ ) {
+        if ( length == 0 ) break;
+        if ( offset >= _v.size() ) {
+            offset -= _v.size();
+            continue;
+        }
+        size_t _l = min(_v.size() - offset, length);
+        memcpy(_out, _v.data() + offset, _l);
+        _out += _l;
+        length -= _l;
+        offset = 0;
+    }
+    return true;
+}
+
+sl_buffer_view sl_frame_decoder::_gather(size_t offset, size_t length) const
+{
+    if ( length == 0 ) return sl_buffer_view();
+    size_t _offset = offset;
+    for ( auto &_v : pending_ ) {
+        if ( _offset >= _v.size() ) {
+            _offset -= _v.size();
+            continue;
+        }
+        // The whole data is in this chunk
+        if ( _offset + length <= _v.size() ) return _v.sub(_offset, length);
+        break;
+    }
+    // Split in different chunks, copy to a new one
+    sl_buffer_chunk *_chunk = sl_buffer_pool::pool().alloc(length);
+    _peek(offset, _chunk->data(), length);
+    sl_buffer_view _view(_chunk, 0, length);
+    _chunk->release();
+    return _view;
+}
+
+void sl_frame_decoder::_consume(size_t length)
+{
+    if ( length >= pending_size_ ) {
+        pending_.clear();
+        pending_size_ = 0;
+        return;
+    }
+    pending_size_ -= length;
+    size_t _drop = 0;
+    for ( ; _drop < pending_.size() && length >= pending_[_drop].size(); ++_drop ) {
+        length -= pending_[_drop].size();
+    }
+    pending_.erase(pending_.begin(), pending_.begin() + _drop);
+    if ( length > 0 ) {
+        sl_buffer_view &_front = pending_.front();
+        _front = _front.sub(length, _front.size() - length);
+    }
+}
+
+bool sl_frame_decoder::feed(const sl_buffer_views &views, sl_frame_handler handler)
+{
+    for ( auto &_v : views ) {
+        if ( _v.size() == 0 ) continue;
+        pending_.push_back(_v);
+        pending_size_ += _v.size();
+    }
+
+    while ( pending_size_ > 0 ) {
+        size_t _frame_size = 0, _payload_offset = 0, _payload_size = 0;
+        if ( !this->_next_frame(_frame_size, _payload_offset, _payload_size) ) {
+            this->reset();
+            return false;
+        }
+        if ( _frame_size == 0 ) break;
+        sl_buffer_view _payload = this->_gather(_payload_offset, _payload_size);
+        this->_consume(_frame_size);
+        if ( handler ) handler(_payload);
+    }
+    return true;
+}
+
+bool sl_frame_decoder::push(const sl_buffer_views &views)
+{
+    return this->feed(views, [this](const sl_buffer_view &frame) {
+        ready_.push_back(frame);
+    });
+}
+
+bool sl_frame_decoder::pop(sl_buffer_view &frame)
+{
+    if ( ready_.size() == 0 ) return false;
+    frame = move(ready_.front());
+    ready_.pop_front();
+    return true;
+}
+
+size_t sl_frame_decoder::pending_size() const { return pending_size_; }
+
+void sl_frame_decoder::reset()
+{
+    pending_.clear();
+    pending_size_ = 0;
+    ready_.clear();
+}
+
+// Length Prefix
+sl_frame_length_decoder::sl_frame_length_decoder(
+    size_t length_size, 
+    bool big_endian, 
+    size_t max_frame_size
+) : sl_frame_decoder(max_frame_size), length_size_(length_size), big_endian_(big_endian)
+{
+    if ( length_size_ != 1 && length_size_ != 2 && length_size_ != 4 ) {
+        length_size_ = 2;
+    }
+}
+
+bool sl_frame_length_decoder::_next_frame(
+    size_t &frame_size, 
+    size_t &payload_offset, 
+    size_t &payload_size
+)
+{
+    uint8_t _prefix[4];
+    frame_size = 0;
+    if ( !_peek(0, _prefix, length_size_) ) return true;
+    size_t _length = 0;
+    for ( size_t i = 0; i < length_size_; ++i ) {
+        size_t _b = (big_endian_ ? i : (length_size_ - 1 - i));
+        _length = (_length << 8) | _prefix[_b];
+    }
+    if ( _length > max_frame_size_ ) return false;
+    if ( pending_size_ < length_size_ + _length ) return true;
+    payload_offset = length_size_;
+    payload_size = _length;
+    frame_size = length_size_ + _length;
+    return true;
+}
+
+// Delimiter
+sl_frame_delimiter_decoder::sl_frame_delimiter_decoder(
+    const string &delimiter, 
+    size_t max_frame_size
+) : sl_frame_decoder(max_frame_size), delimiter_(delimiter), scanned_(0)
+{
+    if ( delimiter_.size() == 0 ) delimiter_ = "\n";
+}
+
+bool sl_frame_delimiter_decoder::_next_frame(
+    size_t &frame_size, 
+    size_t &payload_offset, 
+    size_t &payload_size
+)
+{
+    frame_size = 0;
+    size_t _dsize = delimiter_.size();
+    size_t _base = 0;
+    for ( auto &_v : pending_ ) {
+        if ( scanned_ >= _base + _v.size() ) {
+            _base += _v.size();
+            continue;
+        }
+        size_t _start = (scanned_ > _base ? scanned_ - _base : 0);
+        const char *_p = _v.data() + _start;
+        const char *_end = _v.data() + _v.size();
+        while ( _p < _end ) {
+            const char *_hit = (const char *)memchr(_p, delimiter_[0], _end - _p);
+            if ( _hit == NULL ) break;
+            size_t _pos = _base + (_hit - _v.data());
+            if ( _pos + _dsize > pending_size_ ) {
+                // Wait for the rest of the delimiter
+                scanned_ = _pos;
+                return (_pos <= max_frame_size_);
+            }
+            bool _match = (_dsize == 1);
+            if ( !_match ) {
+                string _tail(_dsize, '\0');
+                _peek(_pos, &_tail[0], _dsize);
+                _match = (_tail == delimiter_);
+            }
+            if ( _match ) {
+                if ( _pos > max_frame_size_ ) return false;
+                payload_offset = 0;
+                payload_size = _pos;
+                frame_size = _pos + _dsize;
+                scanned_ = 0;
+                return true;
+            }
+            _p = _hit + 1;
+        }
+        _base += _v.size();
+    }
+    scanned_ = pending_size_;
+    return (pending_size_ <= max_frame_size_);
+}
+
+void sl_frame_delimiter_decoder::reset()
+{
+    sl_frame_decoder::reset();
+    scanned_ = 0;
+}
+
+// Fixed Size
+sl_frame_fixed_decoder::sl_frame_fixed_decoder(size_t frame_size)
+: sl_frame_decoder(frame_size), frame_size_(frame_size) { }
+
+bool sl_frame_fixed_decoder::_next_frame(
+    size_t &frame_size, 
+    size_t &payload_offset, 
+    size_t &payload_size
+)
+{
+    frame_size = 0;
+    if ( frame_size_ == 0 ) return false;
+    if ( pending_size_ < frame_size_ ) return true;
+    payload_offset = 0;
+    payload_size = frame_size_;
+    frame_size = frame_size_;
+    return true;
+}
+
+// sock.lite.frame.cpp
+
+/*
+ Push Chen.
+ littlepush@gmail.com
+ http://pushchen.com
+ http://twitter.com/littlepush
+ */
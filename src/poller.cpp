@@ -67,8 +67,12 @@ sl_event sl_event_make_timeout(SOCKET_T so) {
 }
 
 sl_poller::sl_poller()
-	:m_fd(-1), m_events(NULL)
+	:m_fd(-1), m_events(NULL), m_accept_budget(CO_DEFAULT_ACCEPT_BUDGET),
+	m_activity_head(INVALIDATE_SOCKET), m_activity_tail(INVALIDATE_SOCKET),
+	m_reaper_threshold(0), m_reaper_min_idle(5), m_reaped_count(0),
+	m_fd_exhausted(false), m_max_connections(0), m_max_per_ip(0)
 {
+	memset(&m_admission_stats, 0, sizeof(m_admission_stats));
 #if SL_TARGET_LINUX
 	m_fd = epoll_create1(0);
 	if ( m_fd == -1 ) {
@@ -93,12 +97,24 @@ sl_poller::~sl_poller() {
 	m_events = NULL;
 }
 
-bool sl_poller::bind_tcp_server( SOCKET_T so ) {
+bool sl_poller::_is_tcp_server( SOCKET_T so ) {
+	lock_guard<mutex> _(m_tcp_svr_mutex);
+	return m_tcp_svr_map.find(so) != end(m_tcp_svr_map);
+}
+
+bool sl_poller::bind_tcp_server( SOCKET_T so, bool monitor ) {
+	lock_guard<mutex> _(m_tcp_svr_mutex);
+	if ( !monitor ) {
+		m_tcp_svr_map[so] = 0;
+		return true;
+	}
 #if SL_TARGET_LINUX
 	auto _tit = m_tcp_svr_map.find(so);
 	bool _is_new_bind = (_tit == end(m_tcp_svr_map));
+	if ( _is_new_bind ) m_tcp_svr_map[so] = 0;
+#else
+	m_tcp_svr_map[so] = 0;
 #endif
-	m_tcp_svr_map[so] = true;
 	int _retval = 0;
 #if SL_TARGET_LINUX
 	struct epoll_event _e;
@@ -121,9 +137,128 @@ bool sl_poller::bind_tcp_server( SOCKET_T so ) {
 	return (_retval != -1);
 }
 
+uint64_t sl_poller::accept_count( SOCKET_T so ) {
+	lock_guard<mutex> _(m_tcp_svr_mutex);
+	auto _tit = m_tcp_svr_map.find(so);
+	if ( _tit == end(m_tcp_svr_map) ) return 0;
+	return _tit->second;
+}
+
+void sl_poller::set_accept_budget( uint32_t budget ) {
+	m_accept_budget = budget;
+}
+
+bool sl_poller::accept_incoming( SOCKET_T so, earray &events ) {
+	return this->_accept_incoming(so, events, false);
+}
+
+bool sl_poller::is_fd_exhausted() {
+	return m_fd_exhausted;
+}
+
+bool sl_poller::_accept_incoming( SOCKET_T so, earray &events, bool keep_pending ) {
+	sl_event _e;
+	memset(&_e, 0, sizeof(_e));
+	_e.source = so;
+	_e.socktype = IPPROTO_TCP;
+
+	uint32_t _budget = m_accept_budget;
+	uint32_t _handled = 0;
+	uint64_t _accepted = 0;
+	size_t _first_event = events.size();
+	bool _has_more = false;
+	while ( true ) {
+		// Rejected connections also consume the budget
+		if ( _budget > 0 && _handled >= _budget ) {
+			_has_more = true;
+			break;
+		}
+		struct sockaddr_in _addr;
+		socklen_t _addrlen = sizeof(_addr);
+		memset(&_addr, 0, sizeof(_addr));
+#if SL_TCP_ACCEPT4_SUPPORTED
+		SOCKET_T _inso = accept4( so, (struct sockaddr *)&_addr, &_addrlen, 
+			SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else
+		SOCKET_T _inso = accept( so, (struct sockaddr *)&_addr, &_addrlen );
+#endif
+		if ( _inso == -1 ) {
+			// No more incoming
+			if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+				m_fd_exhausted = false;
+				break;
+			}
+			// The peer has reset the connection in the queue
+			if ( errno == EINTR || errno == ECONNABORTED ) continue;
+			// Out of file descriptors, keep the connections in the queue
+			// and retry after the idle reaper has released some sockets.
+			if ( errno == EMFILE || errno == ENFILE ) {
+				if ( !m_fd_exhausted ) {
+					lwarning << "failed to accept on socket " << so << ": " << ::strerror(errno) << lend;
+				}
+				m_fd_exhausted = true;
+				_has_more = true;
+				break;
+			}
+			// On error
+			_e.event = SL_EVENT_FAILED;
+			_e.so = so;
+			events.push_back(_e);
+			break;
+		} else {
+			++_handled;
+			m_fd_exhausted = false;
+			if ( !this->_admit_incoming(_inso, _addr) ) {
+				::close(_inso);
+				continue;
+			}
+#if !SL_TCP_ACCEPT4_SUPPORTED
+			// Set non-blocking
+			unsigned long _u = 1;
+			SL_NETWORK_IOCTL_CALL(_inso, FIONBIO, &_u);
+#endif
+			_e.event = SL_EVENT_ACCEPT;
+			_e.so = _inso;
+			events.push_back(_e);
+			++_accepted;
+		}
+	}
+
+	if ( _accepted > 0 ) {
+		time_t _now_time = time(NULL);
+		lock_guard<mutex> _(m_activity_mutex);
+		for ( size_t i = _first_event; i < events.size(); ++i ) {
+			if ( events[i].event != SL_EVENT_ACCEPT ) continue;
+			this->_activity_touch(events[i].so, _now_time);
+		}
+	}
+
+	lock_guard<mutex> _(m_tcp_svr_mutex);
+	auto _tit = m_tcp_svr_map.find(so);
+	if ( _tit == end(m_tcp_svr_map) ) {
+		m_tcp_svr_pending.erase(so);
+		return false;
+	}
+	_tit->second += _accepted;
+	if ( _has_more && keep_pending ) {
+		m_tcp_svr_pending.insert(so);
+	} else {
+		m_tcp_svr_pending.erase(so);
+	}
+	return _has_more;
+}
+
 size_t sl_poller::fetch_events( sl_poller::earray &events, unsigned int timedout ) {
 	if ( m_fd == -1 ) return 0;
 	int _count = 0;
+	vector<SOCKET_T> _pending_svr;
+	do {
+		lock_guard<mutex> _(m_tcp_svr_mutex);
+		_pending_svr.assign(begin(m_tcp_svr_pending), end(m_tcp_svr_pending));
+	} while ( false );
+	// Do not wait if some listening sockets still have pending connections,
+	// unless they are pending for the lack of file descriptors.
+	if ( _pending_svr.size() > 0 && !m_fd_exhausted ) timedout = 0;
 #if SL_TARGET_LINUX
 	do {
 		_count = epoll_wait( m_fd, m_events, CO_MAX_SO_EVENTS, timedout );
@@ -135,6 +270,13 @@ size_t sl_poller::fetch_events( sl_poller::earray &events, unsigned int timedout
 
 	time_t _now_time = time(NULL);
 
+	for ( auto _so : _pending_svr ) {
+		if ( !this->_is_tcp_server(_so) ) continue;
+		this->_accept_incoming(_so, events);
+	}
+
+	vector<SOCKET_T> _active_list;
+
 	for ( int i = 0; i < _count; ++i ) {
 #if SL_TARGET_LINUX
 		struct epoll_event *_pe = m_events + i;
@@ -144,6 +286,15 @@ size_t sl_poller::fetch_events( sl_poller::earray &events, unsigned int timedout
 		sl_event _e;
 		_e.source = INVALIDATE_SOCKET;
 		_e.socktype = IPPROTO_TCP;
+		memset(&_e.address, 0, sizeof(_e.address));
+#if SL_TARGET_LINUX
+		// Error queue notification, not a real error
+		if ( (_pe->events & EPOLLERR) && !(_pe->events & EPOLLHUP) &&
+			this->_process_errqueue(_pe->data.fd, _pe->events) ) {
+			if ( (_pe->events & (EPOLLIN | EPOLLOUT)) == 0 ) continue;
+			_pe->events &= ~EPOLLERR;
+		}
+#endif
 		// Disconnected
 #if SL_TARGET_LINUX
 		if ( _pe->events & EPOLLERR || _pe->events & EPOLLHUP ) {
@@ -162,36 +313,14 @@ size_t sl_poller::fetch_events( sl_poller::earray &events, unsigned int timedout
 			continue;
 		}
 #if SL_TARGET_LINUX
-		else if ( m_tcp_svr_map.find(_pe->data.fd) != m_tcp_svr_map.end() ) {
+		else if ( this->_is_tcp_server(_pe->data.fd) ) {
 			_e.source = _pe->data.fd;
 #elif SL_TARGET_MAC
-		else if ( m_tcp_svr_map.find(_pe->ident) != m_tcp_svr_map.end()  ) {
+		else if ( this->_is_tcp_server(_pe->ident) ) {
 			_e.source = _pe->ident;
 #endif
 			// Incoming
-			while ( true ) {
-				struct sockaddr _inaddr;
-				socklen_t _inlen;
-				SOCKET_T _inso = accept( _e.source, &_inaddr, &_inlen );
-				if ( _inso == -1 ) {
-					// No more incoming
-					if ( errno == EAGAIN || errno == EWOULDBLOCK ) break;
-					// On error
-					_e.event = SL_EVENT_FAILED;
-					_e.so = _e.source;
-					events.push_back(_e);
-					break;
-				} else {
-					// Set non-blocking
-					unsigned long _u = 1;
-					SL_NETWORK_IOCTL_CALL(_inso, FIONBIO, &_u);
-					_e.event = SL_EVENT_ACCEPT;
-					_e.so = _inso;
-					events.push_back(_e);
-					// Add to poll monitor
-					// this->monitor_socket(_inso);
-				}
-			}
+			this->_accept_incoming(_e.source, events);
 		}
 		else {
 			// R/W
@@ -220,12 +349,6 @@ size_t sl_poller::fetch_events( sl_poller::earray &events, unsigned int timedout
 				if ( _pe->events & EPOLLIN ) {
 					_e.event = SL_EVENT_DATA;
 					// ldebug << "did get r/w event for socket: " << _e.so << ", event: " << sl_event_name(_e.event) << lend;
-					if ( _e.socktype == IPPROTO_UDP ) {
-						// Try to fetch the address info
-						socklen_t _l = sizeof(_e.address);
-						::recvfrom( _e.so, NULL, 0, MSG_PEEK,
-			            	(struct sockaddr *)&_e.address, &_l);
-					}
 					events.push_back(_e);
 				}
 				if ( _pe->events & EPOLLOUT ) {
@@ -236,12 +359,6 @@ size_t sl_poller::fetch_events( sl_poller::earray &events, unsigned int timedout
 #elif SL_TARGET_MAC
 				if ( _pe->filter == EVFILT_READ ) {
 					_e.event = SL_EVENT_DATA;
-					if ( _e.socktype == IPPROTO_UDP ) {
-						// Try to fetch the address info
-						socklen_t _l = sizeof(_e.address);
-						::recvfrom( _e.so, NULL, 0, MSG_PEEK,
-			            	(struct sockaddr *)&_e.address, &_l);
-					}
 				}
 				else {
 					_e.event = SL_EVENT_WRITE;
@@ -249,6 +366,7 @@ size_t sl_poller::fetch_events( sl_poller::earray &events, unsigned int timedout
 				events.push_back(_e);
 				// ldebug << "did get r/w event for socket: " << _e.so << ", event: " << sl_event_name(_e.event) << lend;
 #endif
+				_active_list.push_back(_e.so);
 			} else {
 				_e.event = SL_EVENT_FAILED;
 				events.push_back(_e);
@@ -260,6 +378,13 @@ size_t sl_poller::fetch_events( sl_poller::earray &events, unsigned int timedout
 		}
 	}
 
+	do {
+		lock_guard<mutex> _(m_activity_mutex);
+		for ( auto _so : _active_list ) this->_activity_touch(_so, _now_time);
+	} while ( false );
+
+	this->_reap_idle_sockets(events, _now_time);
+
 	vector<SOCKET_T> _timeout_list;
 	lock_guard<mutex> _(m_timeout_mutex);
 	for ( auto _tit = begin(m_timeout_map); _tit != end(m_timeout_map); ++_tit ) {
@@ -309,6 +434,11 @@ bool sl_poller::monitor_socket(
 	if ( oneshot ) {
 		_ee.events |= EPOLLONESHOT;
 	}
+	do {
+		lock_guard<mutex> _(m_errqueue_mutex);
+		auto _eqit = m_errqueue_map.find(so);
+		if ( _eqit != end(m_errqueue_map) ) _eqit->second.events = _ee.events;
+	} while ( false );
 	if ( -1 == epoll_ctl( m_fd, _op, so, &_ee ) ) {
 		if ( errno == EEXIST ) {
 			if ( -1 == epoll_ctl( m_fd, EPOLL_CTL_MOD, so, &_ee ) ) {
@@ -347,6 +477,16 @@ bool sl_poller::monitor_socket(
 	}
 #endif
 
+	do {
+		lock_guard<mutex> _(m_activity_mutex);
+		auto _ait = m_activity_map.find(so);
+		if ( _ait == end(m_activity_map) ) {
+			this->_activity_touch(so, time(NULL));
+			_ait = m_activity_map.find(so);
+		}
+		_ait->second.reapable = (timedout != 0);
+	} while ( false );
+
 	lock_guard<mutex> _(m_timeout_mutex);
 	if ( timedout == 0 ) {
 		#if DEBUG
@@ -366,10 +506,246 @@ bool sl_poller::monitor_socket(
 }
 
 void sl_poller::unmonitor_socket(SOCKET_T so) {
+	do {
+		lock_guard<mutex> _(m_tcp_svr_mutex);
+		m_tcp_svr_map.erase(so);
+		m_tcp_svr_pending.erase(so);
+	} while ( false );
+	do {
+		lock_guard<mutex> _(m_errqueue_mutex);
+		m_errqueue_map.erase(so);
+	} while ( false );
+	do {
+		lock_guard<mutex> _(m_activity_mutex);
+		this->_activity_unlink(so);
+	} while ( false );
+	do {
+		lock_guard<mutex> _(m_admission_mutex);
+		auto _ait = m_admitted_map.find(so);
+		if ( _ait == end(m_admitted_map) ) break;
+		auto _sit = m_source_count.find(_ait->second);
+		if ( _sit != end(m_source_count) && --_sit->second == 0 ) {
+			m_source_count.erase(_sit);
+		}
+		m_admitted_map.erase(_ait);
+	} while ( false );
 	lock_guard<mutex> _(m_timeout_mutex);
 	m_timeout_map.erase(so);
 }
 
+bool sl_poller::_admit_incoming( SOCKET_T so, const struct sockaddr_in &addr ) {
+	uint32_t _source = (addr.sin_family == AF_INET) ? addr.sin_addr.s_addr : 0;
+	lock_guard<mutex> _(m_admission_mutex);
+	for ( auto &_range : m_deny_list ) {
+		if ( !_range.is_ip_in_range(_source) ) continue;
+		m_admission_stats.rejected_denied += 1;
+		return false;
+	}
+	if ( m_allow_list.size() > 0 ) {
+		bool _allowed = false;
+		for ( auto &_range : m_allow_list ) {
+			if ( (_allowed = _range.is_ip_in_range(_source)) ) break;
+		}
+		if ( !_allowed ) {
+			m_admission_stats.rejected_denied += 1;
+			return false;
+		}
+	}
+	if ( m_max_connections > 0 && m_admitted_map.size() >= m_max_connections ) {
+		m_admission_stats.rejected_global += 1;
+		return false;
+	}
+	size_t &_count = m_source_count[_source];
+	if ( m_max_per_ip > 0 && _count >= m_max_per_ip ) {
+		m_admission_stats.rejected_per_ip += 1;
+		return false;
+	}
+	_count += 1;
+	m_admitted_map[so] = _source;
+	return true;
+}
+
+void sl_poller::set_admission_limit( size_t max_connections, size_t max_per_ip ) {
+	lock_guard<mutex> _(m_admission_mutex);
+	m_max_connections = max_connections;
+	m_max_per_ip = max_per_ip;
+}
+
+void sl_poller::add_admission_allow( const sl_iprange &range ) {
+	if ( !range ) return;
+	lock_guard<mutex> _(m_admission_mutex);
+	m_allow_list.push_back(range);
+}
+
+void sl_poller::add_admission_deny( const sl_iprange &range ) {
+	if ( !range ) return;
+	lock_guard<mutex> _(m_admission_mutex);
+	m_deny_list.push_back(range);
+}
+
+void sl_poller::clear_admission_list() {
+	lock_guard<mutex> _(m_admission_mutex);
+	m_allow_list.clear();
+	m_deny_list.clear();
+}
+
+sl_admission_stats sl_poller::admission_stats() {
+	lock_guard<mutex> _(m_admission_mutex);
+	sl_admission_stats _stats = m_admission_stats;
+	_stats.connections = m_admitted_map.size();
+	return _stats;
+}
+
+void sl_poller::_activity_touch( SOCKET_T so, time_t now ) {
+	bool _reapable = true;
+	auto _ait = m_activity_map.find(so);
+	if ( _ait != end(m_activity_map) ) {
+		_ait->second.last_active = now;
+		// Already the most recently active one
+		if ( m_activity_tail == so ) return;
+		_reapable = _ait->second.reapable;
+		this->_activity_unlink(so);
+	}
+	m_activity_map.emplace(
+		so, activity_node{ m_activity_tail, INVALIDATE_SOCKET, now, _reapable }
+	);
+	if ( SOCKET_NOT_VALIDATE(m_activity_tail) ) {
+		m_activity_head = so;
+	} else {
+		m_activity_map[m_activity_tail].next = so;
+	}
+	m_activity_tail = so;
+}
+
+void sl_poller::_activity_unlink( SOCKET_T so ) {
+	auto _ait = m_activity_map.find(so);
+	if ( _ait == end(m_activity_map) ) return;
+	SOCKET_T _prev = _ait->second.prev, _next = _ait->second.next;
+	if ( SOCKET_NOT_VALIDATE(_prev) ) {
+		m_activity_head = _next;
+	} else {
+		m_activity_map[_prev].next = _next;
+	}
+	if ( SOCKET_NOT_VALIDATE(_next) ) {
+		m_activity_tail = _prev;
+	} else {
+		m_activity_map[_next].prev = _prev;
+	}
+	m_activity_map.erase(_ait);
+}
+
+void sl_poller::_reap_idle_sockets( earray &events, time_t now ) {
+	vector<SOCKET_T> _reap_list;
+	do {
+		lock_guard<mutex> _(m_activity_mutex);
+		if ( m_reaper_threshold == 0 ) return;
+		size_t _count = m_activity_map.size();
+		size_t _low_water = m_reaper_threshold - m_reaper_threshold / 8;
+		size_t _max_reap = 0;
+		if ( _count > m_reaper_threshold ) {
+			_max_reap = _count - _low_water;
+		} else if ( m_fd_exhausted ) {
+			_max_reap = CO_REAPER_EXHAUSTED_BATCH;
+		}
+		if ( _max_reap == 0 ) return;
+
+		// Sockets which should never be reaped are moved to the tail,
+		// check each socket at most once.
+		SOCKET_T _so = m_activity_head;
+		for ( size_t i = 0; i < _count && _reap_list.size() < _max_reap; ++i ) {
+			if ( SOCKET_NOT_VALIDATE(_so) ) break;
+			activity_node &_node = m_activity_map[_so];
+			SOCKET_T _next = _node.next;
+			if ( !_node.reapable ) {
+				this->_activity_touch(_so, _node.last_active);
+			} else {
+				// All the rest sockets are active recently
+				if ( _node.last_active + (time_t)m_reaper_min_idle > now ) break;
+				_reap_list.push_back(_so);
+				this->_activity_unlink(_so);
+			}
+			_so = _next;
+		}
+		m_reaped_count += _reap_list.size();
+	} while ( false );
+	if ( _reap_list.size() == 0 ) return;
+
+	#if DEBUG
+	ldebug << "idle reaper will close " << _reap_list.size() << " sockets" << lend;
+	#endif
+	lock_guard<mutex> _(m_timeout_mutex);
+	for ( auto _so : _reap_list ) {
+		sl_event _e = sl_event_make_failed(_so);
+		_e.source = INVALIDATE_SOCKET;
+		int _type = SOCK_STREAM, _len = sizeof(int);
+		getsockopt( _so, SOL_SOCKET, SO_TYPE, (char *)&_type, (socklen_t *)&_len);
+		_e.socktype = (_type == SOCK_STREAM) ? IPPROTO_TCP : IPPROTO_UDP;
+		events.push_back(_e);
+		m_timeout_map.erase(_so);
+	}
+}
+
+void sl_poller::set_idle_reaper( size_t threshold, uint32_t min_idle ) {
+	lock_guard<mutex> _(m_activity_mutex);
+	m_reaper_threshold = threshold;
+	m_reaper_min_idle = min_idle;
+}
+
+uint64_t sl_poller::reaped_count() {
+	lock_guard<mutex> _(m_activity_mutex);
+	return m_reaped_count;
+}
+
+void sl_poller::untrack_activity( SOCKET_T so ) {
+	lock_guard<mutex> _(m_activity_mutex);
+	this->_activity_unlink(so);
+}
+
+void sl_poller::bind_errqueue( SOCKET_T so, errqueue_handler handler ) {
+	lock_guard<mutex> _(m_errqueue_mutex);
+	if ( !handler ) {
+		m_errqueue_map.erase(so);
+		return;
+	}
+	auto _eqit = m_errqueue_map.find(so);
+	if ( _eqit == end(m_errqueue_map) ) {
+		m_errqueue_map[so] = { handler, 0 };
+	} else {
+		_eqit->second.handler = handler;
+	}
+}
+
+bool sl_poller::_process_errqueue( SOCKET_T so, uint32_t events ) {
+	errqueue_handler _h;
+	uint32_t _events = 0;
+	do {
+		lock_guard<mutex> _(m_errqueue_mutex);
+		auto _eqit = m_errqueue_map.find(so);
+		if ( _eqit == end(m_errqueue_map) ) return false;
+		_h = _eqit->second.handler;
+		_events = _eqit->second.events;
+	} while ( false );
+
+	// A pending SO_ERROR means the socket is really broken
+	int _error = 0, _len = sizeof(int);
+	getsockopt( so, SOL_SOCKET, SO_ERROR, (char *)&_error, (socklen_t *)&_len);
+	if ( _error != 0 ) return false;
+
+	if ( _h ) _h(so);
+
+#if SL_TARGET_LINUX
+	// The oneshot flag has disabled the socket, re-arm it with the
+	// last monitored events if there is nothing else to report.
+	if ( (events & (EPOLLIN | EPOLLOUT)) == 0 && (_events & EPOLLONESHOT) ) {
+		struct epoll_event _ee;
+		_ee.data.fd = so;
+		_ee.events = _events;
+		epoll_ctl( m_fd, EPOLL_CTL_MOD, so, &_ee );
+	}
+#endif
+	return true;
+}
+
 sl_poller &sl_poller::server() {
 	static sl_poller _g_poller;
 	return _g_poller;
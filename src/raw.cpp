@@ -31,8 +31,31 @@
 #include <arpa/nameser.h>
 #include <resolv.h>
 
+#if SL_TARGET_LINUX && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define SL_TCP_ZEROCOPY_SUPPORTED   1
+#else
+#define SL_TCP_ZEROCOPY_SUPPORTED   0
+#endif
+
+#if SL_TARGET_LINUX
+#include <netinet/udp.h>
+#endif
+#if SL_TARGET_LINUX && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define SL_UDP_GSO_SUPPORTED        1
+#else
+#define SL_UDP_GSO_SUPPORTED        0
+#endif
+
+#if SL_TARGET_LINUX && defined(MSG_FASTOPEN)
+#define SL_TCP_FASTOPEN_SUPPORTED   1
+#else
+#define SL_TCP_FASTOPEN_SUPPORTED   0
+#endif
 
 #include <queue>
+#include <deque>
+#include <random>
 
 // The socket's write package structure
 typedef struct sl_write_packet {
@@ -43,9 +66,32 @@ typedef struct sl_write_packet {
 } sl_write_packet;
 typedef shared_ptr<sl_write_packet>                 sl_shared_write_packet_t;
 
+// The zero-copy send status of a tcp socket.
+// Each send with MSG_ZEROCOPY get an increasing id from the kernel, the 
+// packet must be hold until the kernel reports the id has been completed.
+typedef struct sl_zerocopy_info {
+    bool                                            enabled;
+    size_t                                          threshold;
+    uint32_t                                        first_id;
+    size_t                                          pending_size;
+    deque< pair<bool, sl_shared_write_packet_t> >   pending;
+} sl_zerocopy_info;
+
+// The writing status of a tcp socket, guarded by the write locker.
+typedef struct sl_write_status {
+    // Nested count of the batch window, packets will not be sent in a batch
+    size_t                                          batch_depth;
+    // The socket is monitoring SL_EVENT_WRITE to flush the queue
+    bool                                            writing;
+} sl_write_status;
+
 typedef struct sl_write_info {
     shared_ptr< mutex >                             locker;
-    shared_ptr< queue<sl_shared_write_packet_t> >   packet_queue;
+    shared_ptr< deque<sl_shared_write_packet_t> >   packet_queue;
+    shared_ptr< sl_zerocopy_info >                  zerocopy;
+    // UDP GSO segment size, 0 means disabled
+    size_t                                          gso_size;
+    shared_ptr< sl_write_status >                   status;
 } sl_write_info;
 
 typedef map< SOCKET_T, sl_write_info >              sl_write_map_t;
@@ -53,6 +99,49 @@ typedef map< SOCKET_T, sl_write_info >              sl_write_map_t;
 mutex               _g_so_write_mutex;
 sl_write_map_t      _g_so_write_map;
 
+// The socket's read ring, created at the first read action
+typedef struct sl_read_info {
+    shared_ptr< mutex >                             locker;
+    shared_ptr< sl_buffer_ring >                    ring;
+} sl_read_info;
+
+typedef map< SOCKET_T, sl_read_info >               sl_read_map_t;
+
+mutex               _g_so_read_mutex;
+sl_read_map_t       _g_so_read_map;
+
+// An idle connection in the tcp pool
+typedef struct sl_tcp_pool_item {
+    SOCKET_T                                        so;
+    steady_clock::time_point                        idle_since;
+} sl_tcp_pool_item;
+
+// Idle connections of each (socks5, host, port), the last one is the newest
+typedef map< string, deque<sl_tcp_pool_item> >      sl_tcp_pool_map_t;
+
+mutex                       _g_tcp_pool_mutex;
+sl_tcp_pool_map_t           _g_tcp_pool_idle;
+// The connections which have been handed out by the pool
+map< SOCKET_T, string >     _g_tcp_pool_busy;
+uint32_t                    _g_tcp_pool_idle_timeout = 10;
+size_t                      _g_tcp_pool_max_idle = 8;
+// If the timer to close the timedout idle connections has been scheduled,
+// the timer with an old round will stop.
+bool                        _g_tcp_pool_reaping = false;
+uint64_t                    _g_tcp_pool_reap_round = 0;
+
+// Max count of datagrams sent in one sendmmsg
+#define SL_UDP_SEND_BATCH               64
+// Max count of packets sent in one tcp sendmsg
+#define SL_TCP_SEND_BATCH               64
+// Max segments and total payload size of one GSO message
+#define SL_UDP_GSO_MAX_SEGMENTS         64
+#define SL_UDP_GSO_MAX_SIZE             65507
+
+// Max bytes of packets waiting for zero-copy completion on one socket,
+// beyond this, the packets will be sent by copy.
+#define SL_TCP_ZEROCOPY_MAX_PENDING     (16 * 1024 * 1024)
+
 /*!
     Close the socket and release the handler set 
 
@@ -73,6 +162,18 @@ void sl_socket_close(SOCKET_T so)
         _g_so_write_map.erase(so);
     } while(false);
 
+    // Release the read ring
+    do {
+        lock_guard<mutex> _(_g_so_read_mutex);
+        _g_so_read_map.erase(so);
+    } while(false);
+
+    // Not a pooled connection any more
+    do {
+        lock_guard<mutex> _(_g_tcp_pool_mutex);
+        _g_tcp_pool_busy.erase(so);
+    } while(false);
+
     close(so);
 }
 
@@ -98,6 +199,22 @@ void sl_socket_monitor(
     sl_events::server().monitor(tso, SL_EVENT_READ, callback, timedout);
 }
 
+/*
+    Set up the idle connection reaper
+*/
+void sl_socket_set_idle_reaper(size_t threshold, uint32_t min_idle)
+{
+    sl_poller::server().set_idle_reaper(threshold, min_idle);
+}
+
+/*
+    Get the count of sockets closed by the idle reaper.
+*/
+uint64_t sl_socket_reaped_count()
+{
+    return sl_poller::server().reaped_count();
+}
+
 /*
     Bind Default Failed Handler for a Socket
 
@@ -145,31 +262,9 @@ void sl_socket_bind_event_timeout(SOCKET_T so, sl_socket_event_handler handler)
 }
 
 // TCP Methods
-/*!
-    Initialize a TCP socket.
-
-    @Description
-    This method will create a new tcp socket file descriptor, the fd will
-    be set as TCP_NODELAY, SO_REUSEADDR and NON_BLOCKING.
-    And will automatically bind empty handler set in the event system.
-*/
-SOCKET_T _raw_internal_tcp_socket_init(
-    sl_socket_event_handler failed = NULL, 
-    sl_socket_event_handler timedout = NULL,
-    SOCKET_T tso = INVALIDATE_SOCKET
-)
+// Set the tcp socket as TCP_NODELAY, SO_REUSEADDR and NON_BLOCKING
+bool _raw_internal_tcp_socket_setup(SOCKET_T _so)
 {
-    SOCKET_T _so = tso;
-    if ( SOCKET_NOT_VALIDATE(_so) ) {
-        _so = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    }
-    if ( SOCKET_NOT_VALIDATE(_so) ) {
-        lerror 
-            << "failed to init a tcp socket: " 
-            << ::strerror( errno ) 
-        << lend;
-        return _so;
-    }
     // Set With TCP_NODELAY
     int flag = 1;
     if( setsockopt( _so, IPPROTO_TCP, 
@@ -180,8 +275,7 @@ SOCKET_T _raw_internal_tcp_socket_init(
             << _so << ") to be TCP_NODELAY: " 
             << ::strerror( errno ) 
         << lend;
-        SL_NETWORK_CLOSESOCK( _so );
-        return INVALIDATE_SOCKET;
+        return false;
     }
 
     int _reused = 1;
@@ -193,8 +287,7 @@ SOCKET_T _raw_internal_tcp_socket_init(
             << _so << ") to be SO_REUSEADDR: " 
             << ::strerror( errno ) 
         << lend;
-        SL_NETWORK_CLOSESOCK( _so );
-        return INVALIDATE_SOCKET;
+        return false;
     }
 
     unsigned long _u = 1;
@@ -205,7 +298,47 @@ SOCKET_T _raw_internal_tcp_socket_init(
             << _so << ") to be Non Blocking: " 
             << ::strerror( errno ) 
         << lend;
-        SL_NETWORK_CLOSESOCK( _so );
+        return false;
+    }
+    return true;
+}
+
+/*!
+    Initialize a TCP socket.
+
+    @Description
+    This method will create a new tcp socket file descriptor, the fd will
+    be set as TCP_NODELAY, SO_REUSEADDR and NON_BLOCKING.
+    And will automatically bind empty handler set in the event system.
+*/
+SOCKET_T _raw_internal_tcp_socket_init(
+    sl_socket_event_handler failed = NULL, 
+    sl_socket_event_handler timedout = NULL,
+    SOCKET_T tso = INVALIDATE_SOCKET
+)
+{
+    SOCKET_T _so = tso;
+    if ( SOCKET_NOT_VALIDATE(_so) ) {
+        _so = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    }
+    if ( SOCKET_NOT_VALIDATE(_so) ) {
+        lerror 
+            << "failed to init a tcp socket: " 
+            << ::strerror( errno ) 
+        << lend;
+        return _so;
+    }
+#if SL_TCP_ACCEPT4_SUPPORTED
+    // The accepted socket has been set non-blocking by accept4, and 
+    // inherits TCP_NODELAY from the listening socket.
+    bool _need_setup = (_so != tso);
+#else
+    bool _need_setup = true;
+#endif
+    if ( _need_setup && !_raw_internal_tcp_socket_setup(_so) ) {
+        // An accepted socket should be closed by the caller with 
+        // <sl_socket_close>, which releases its admission slot.
+        if ( _so != tso ) SL_NETWORK_CLOSESOCK( _so );
         return INVALIDATE_SOCKET;
     }
 
@@ -224,8 +357,13 @@ SOCKET_T _raw_internal_tcp_socket_init(
     // Add A Write Buffer
     sl_write_info _wi = { 
         make_shared<mutex>(), 
-        make_shared< queue<sl_shared_write_packet_t> >() 
+        make_shared< deque<sl_shared_write_packet_t> >(),
+        nullptr,
+        0,
+        make_shared<sl_write_status>()
     };
+    _wi.status->batch_depth = 0;
+    _wi.status->writing = false;
     do {
         lock_guard<mutex> _(_g_so_write_mutex);
         _g_so_write_map[_so] = _wi;
@@ -233,59 +371,92 @@ SOCKET_T _raw_internal_tcp_socket_init(
     return _so;
 }
 
-// Internal async connect to the peer
-void _raw_internal_tcp_socket_connect(
-    const sl_peerinfo& peer,
-    uint32_t timedout,
+// Send the data which has not been sent in the SYN packet after connected
+sl_socket_event_handler _raw_internal_tcp_socket_connect_handler(
+    const string& left_data,
     sl_socket_event_handler callback
 )
 {
-    auto _cb = [=](sl_event e) {
-        // By default, close the timed out socket when connecting failed.
-        if ( e.event == SL_EVENT_TIMEOUT ) {
-            sl_socket_close(e.so);
+    if ( left_data.size() == 0 ) return callback;
+    return [=](sl_event e) {
+        if ( e.event == SL_EVENT_CONNECT ) {
+            sl_tcp_socket_send(e.so, left_data);
         }
         if ( callback ) callback(e);
     };
-    SOCKET_T _tso = _raw_internal_tcp_socket_init(_cb, _cb);
-    if ( SOCKET_NOT_VALIDATE(_tso) ) {
-        sl_event _e;
-        _e.so = _tso;
-        _e.event = SL_EVENT_FAILED;
-        callback(_e);
-        return;
-    }
+}
 
+// Internal async connect to the peer on an initialized socket.
+// If <initial_data> is not empty, try to send it in the SYN packet with
+// TCP Fast Open, the data will be sent after connected if not supported.
+void _raw_internal_tcp_socket_start_connect(
+    SOCKET_T tso,
+    const sl_peerinfo& peer,
+    uint32_t timedout,
+    sl_socket_event_handler callback,
+    const string& initial_data = string()
+)
+{
     struct sockaddr_in _sock_addr;
     memset(&_sock_addr, 0, sizeof(_sock_addr));
     _sock_addr.sin_addr.s_addr = peer.ipaddress;
     _sock_addr.sin_family = AF_INET;
     _sock_addr.sin_port = htons(peer.port_number);
 
+#if SL_TCP_FASTOPEN_SUPPORTED
+    if ( initial_data.size() > 0 ) {
+        ssize_t _sent = ::sendto(
+            tso, initial_data.data(), initial_data.size(),
+            MSG_FASTOPEN | MSG_NOSIGNAL,
+            (struct sockaddr *)&_sock_addr, sizeof(_sock_addr));
+        // EINPROGRESS means no cookie yet, only the SYN has been sent
+        if ( _sent >= 0 || errno == EINPROGRESS ) {
+            size_t _offset = (_sent > 0 ? (size_t)_sent : 0);
+            sl_events::server().monitor(
+                tso, SL_EVENT_CONNECT, 
+                _raw_internal_tcp_socket_connect_handler(
+                    initial_data.substr(_offset), callback),
+                timedout);
+            return;
+        }
+        if ( errno != EOPNOTSUPP ) {
+            lerror 
+                << "failed to connect to " 
+                << peer << " on tcp socket: "
+                << tso << " with fast open, " << ::strerror( errno ) 
+            << lend;
+            sl_events::server().add_tcpevent(tso, SL_EVENT_FAILED);
+            return;
+        }
+        // Fast open is disabled in the system, use normal connect
+    }
+#endif
+    callback = _raw_internal_tcp_socket_connect_handler(initial_data, callback);
+
     if ( ::connect( 
-        _tso, 
+        tso, 
         (struct sockaddr *)&_sock_addr, 
         sizeof(_sock_addr)) == -1 ) 
     {
         int _error = 0, _len = sizeof(_error);
         getsockopt( 
-            _tso, SOL_SOCKET, 
+            tso, SOL_SOCKET, 
             SO_ERROR, (char *)&_error, 
             (socklen_t *)&_len);
         if ( _error != 0 ) {
             lerror 
                 << "failed to connect to " 
                 << peer << " on tcp socket: "
-                << _tso << ", " << ::strerror( _error ) 
+                << tso << ", " << ::strerror( _error ) 
             << lend;
-            sl_events::server().add_tcpevent(_tso, SL_EVENT_FAILED);
+            sl_events::server().add_tcpevent(tso, SL_EVENT_FAILED);
         } else {
             // Monitor the socket, the poller will invoke on_connect 
             // when the socket is connected or failed.
             //ldebug << "monitor tcp socket " << tso << 
             //  " for connecting" << lend;
             sl_events::server().monitor(
-                _tso, SL_EVENT_CONNECT, 
+                tso, SL_EVENT_CONNECT, 
                 callback, timedout);
         }
     } else {
@@ -294,41 +465,196 @@ void _raw_internal_tcp_socket_connect(
             << "connect to " << peer 
             << " is too fast, the connect method return success directly" 
         << lend;
-        sl_events::server().add_tcpevent(_tso, SL_EVENT_CONNECT);
+        sl_events::server().add_tcpevent(tso, SL_EVENT_CONNECT);
     }
 }
 
-// Internal Connecton Method, Try to connect to peer with an IP list.
-void _raw_internal_tcp_socket_try_connect(
-    const vector<sl_peerinfo>& peer_list, 
-    uint32_t index,
+// Internal async connect to the peer
+void _raw_internal_tcp_socket_connect(
+    const sl_peerinfo& peer,
     uint32_t timedout,
-    sl_socket_event_handler callback
+    sl_socket_event_handler callback,
+    const string& initial_data = string()
 )
 {
-    if ( peer_list.size() <= index ) {
-        if ( !callback ) return;
-
+    auto _cb = [=](sl_event e) {
+        // By default, close the timed out socket when connecting failed.
+        if ( e.event == SL_EVENT_TIMEOUT ) {
+            sl_socket_close(e.so);
+        }
+        if ( callback ) callback(e);
+    };
+    SOCKET_T _tso = _raw_internal_tcp_socket_init(_cb, _cb);
+    if ( SOCKET_NOT_VALIDATE(_tso) ) {
         sl_event _e;
+        _e.so = _tso;
         _e.event = SL_EVENT_FAILED;
-        if ( callback ) callback(_e);
-
+        callback(_e);
         return;
     }
-    _raw_internal_tcp_socket_connect(
-        peer_list[index],
-        timedout,
-        [=](sl_event e) {
-            if ( e.event == SL_EVENT_CONNECT ) {
-                if ( callback ) callback(e);
-                return;
+    _raw_internal_tcp_socket_start_connect(_tso, peer, timedout, callback, initial_data);
+}
+
+// Racing connect status of a resolved IP list.
+typedef struct sl_tcp_race_info {
+    mutex                                           locker;
+    vector<sl_peerinfo>                             peer_list;
+    size_t                                          next_index;
+    // The sockets still connecting
+    vector<SOCKET_T>                                pending;
+    bool                                            done;
+    uint32_t                                        timedout;
+    // Only the first attempt carries the initial data in its SYN, so the
+    // losers will not receive the request.
+    string                                          initial_data;
+    SOCKET_T                                        first_so;
+    sl_socket_event_handler                         callback;
+} sl_tcp_race_info;
+
+// The race settings may be changed while other threads are launching
+atomic<uint32_t>            _g_tcp_race_stagger(250);
+atomic<size_t>              _g_tcp_race_concurrency(2);
+
+/*
+    Setup the racing connect
+*/
+void sl_tcp_socket_set_connect_race(uint32_t stagger, size_t concurrency)
+{
+    _g_tcp_race_stagger = stagger;
+    _g_tcp_race_concurrency = (concurrency == 0 ? 1 : concurrency);
+}
+
+void _raw_internal_tcp_socket_race_launch(shared_ptr<sl_tcp_race_info> info);
+
+// Invoked when an attempt of the race is connected, failed or timed out.
+void _raw_internal_tcp_socket_race_result(shared_ptr<sl_tcp_race_info> info, sl_event e)
+{
+    vector<SOCKET_T> _losers;
+    bool _all_failed = false;
+    bool _send_data = false;
+    do {
+        lock_guard<mutex> _(info->locker);
+        auto _pit = find(begin(info->pending), end(info->pending), e.so);
+        // The socket has been closed as a loser
+        if ( _pit == end(info->pending) ) return;
+        info->pending.erase(_pit);
+        if ( e.event == SL_EVENT_CONNECT ) {
+            info->done = true;
+            _losers.swap(info->pending);
+            _send_data = (e.so != info->first_so && info->initial_data.size() > 0);
+        } else if ( info->pending.size() == 0 && 
+            info->next_index >= info->peer_list.size() ) 
+        {
+            info->done = true;
+            _all_failed = true;
+        }
+    } while ( false );
+
+    if ( e.event == SL_EVENT_CONNECT ) {
+        for ( auto _so : _losers ) sl_socket_close(_so);
+        if ( _send_data ) sl_tcp_socket_send(e.so, info->initial_data);
+        // The winner belongs to the caller now, same as a direct connect
+        sl_socket_event_handler _callback = info->callback;
+        sl_events::server().update_handler(e.so, SL_EVENT_FAILED | SL_EVENT_TIMEOUT, [_callback](sl_event e) {
+            sl_socket_close(e.so);
+            if ( _callback ) _callback(e);
+        });
+        if ( info->callback ) info->callback(e);
+    } else if ( _all_failed ) {
+        if ( info->callback ) info->callback(sl_event_make_failed());
+    } else {
+        // Do not wait for the stagger, start the next one
+        _raw_internal_tcp_socket_race_launch(info);
+    }
+}
+
+// Start the next attempt of the race if possible
+void _raw_internal_tcp_socket_race_launch(shared_ptr<sl_tcp_race_info> info)
+{
+    size_t _index = 0;
+    auto _cb = [=](sl_event e) {
+        // Close the failed or timed out attempt, the default failed 
+        // handler of the socket has been replaced by this one.
+        if ( e.event == SL_EVENT_FAILED || e.event == SL_EVENT_TIMEOUT ) {
+            do {
+                // The fd may be reused by the next attempt
+                lock_guard<mutex> _(info->locker);
+                if ( info->first_so == e.so ) info->first_so = INVALIDATE_SOCKET;
+            } while ( false );
+            sl_socket_close(e.so);
+        }
+        _raw_internal_tcp_socket_race_result(info, e);
+    };
+    SOCKET_T _tso = INVALIDATE_SOCKET;
+    do {
+        lock_guard<mutex> _(info->locker);
+        if ( info->done ) return;
+        if ( info->next_index >= info->peer_list.size() ) return;
+        if ( info->pending.size() >= _g_tcp_race_concurrency.load() ) return;
+        _index = info->next_index++;
+        _tso = _raw_internal_tcp_socket_init(_cb, _cb);
+        if ( SOCKET_VALIDATE(_tso) ) {
+            sl_events::server().update_handler(_tso, SL_EVENT_FAILED, _cb);
+            info->pending.push_back(_tso);
+            if ( _index == 0 ) info->first_so = _tso;
+        }
+    } while ( false );
+
+    if ( SOCKET_NOT_VALIDATE(_tso) ) {
+        bool _all_failed = false;
+        do {
+            lock_guard<mutex> _(info->locker);
+            if ( info->pending.size() == 0 && 
+                info->next_index >= info->peer_list.size() ) 
+            {
+                info->done = true;
+                _all_failed = true;
             }
-            // Try to invoke the next ip in the list.
-            _raw_internal_tcp_socket_try_connect(
-                peer_list, index + 1, 
-                timedout, callback);
+        } while ( false );
+        if ( _all_failed ) {
+            if ( info->callback ) info->callback(sl_event_make_failed());
+        } else {
+            _raw_internal_tcp_socket_race_launch(info);
         }
-    );
+        return;
+    }
+
+    // Start the next one if current attempt has not completed after the stagger
+    if ( _index + 1 < info->peer_list.size() ) {
+        sl_events::server().add_timer(_g_tcp_race_stagger.load(), [=]() {
+            do {
+                lock_guard<mutex> _(info->locker);
+                if ( info->next_index != _index + 1 ) return;
+            } while ( false );
+            _raw_internal_tcp_socket_race_launch(info);
+        });
+    }
+    _raw_internal_tcp_socket_start_connect(
+        _tso, info->peer_list[_index], info->timedout, _cb, 
+        (_index == 0 ? info->initial_data : string()));
+}
+
+// Internal Connecton Method, Race to connect to the peers in an IP list.
+void _raw_internal_tcp_socket_race_connect(
+    const vector<sl_peerinfo>& peer_list, 
+    uint32_t timedout,
+    sl_socket_event_handler callback,
+    const string& initial_data = string()
+)
+{
+    shared_ptr<sl_tcp_race_info> _info = make_shared<sl_tcp_race_info>();
+    _info->peer_list = peer_list;
+    _info->next_index = 0;
+    _info->done = false;
+    _info->timedout = timedout;
+    _info->initial_data = initial_data;
+    _info->first_so = INVALIDATE_SOCKET;
+    _info->callback = callback;
+    if ( peer_list.size() == 0 ) {
+        if ( callback ) callback(sl_event_make_failed());
+        return;
+    }
+    _raw_internal_tcp_socket_race_launch(_info);
 }
 
 /*
@@ -354,6 +680,21 @@ void sl_tcp_socket_connect(
     uint32_t timedout,
     sl_socket_event_handler callback
 )
+{
+    sl_tcp_socket_connect(socks5, host, port, timedout, string(), callback);
+}
+
+/*
+    Async connect to the host and send the initial data
+*/
+void sl_tcp_socket_connect(
+    const sl_peerinfo& socks5, 
+    const string& host, 
+    uint16_t port,
+    uint32_t timedout,
+    const string& initial_data,
+    sl_socket_event_handler callback
+)
 {
     shared_ptr<sl_peerinfo> _psocks5 = make_shared<sl_peerinfo>(socks5);
     if ( socks5 ) {
@@ -463,6 +804,9 @@ void sl_tcp_socket_connect(
                     }
                     //ldebug << "now we build the connection to the peer server via current proxy" << lend;
                     e.event = SL_EVENT_CONNECT;
+                    if ( initial_data.size() > 0 ) {
+                        sl_tcp_socket_send(e.so, initial_data);
+                    }
                     if ( callback ) callback(e);
                 });
             });
@@ -486,90 +830,489 @@ void sl_tcp_socket_connect(
                     for ( auto & _ip : iplist ) {
                         _peerlist.push_back(sl_peerinfo((const string &)_ip, port));
                     }
-                    _raw_internal_tcp_socket_try_connect(_peerlist, 0, timedout, callback);
+                    _raw_internal_tcp_socket_race_connect(_peerlist, timedout, callback, initial_data);
                 }
             });
         } else {
-            _raw_internal_tcp_socket_connect(sl_peerinfo(host, port), timedout, callback);
+            _raw_internal_tcp_socket_connect(sl_peerinfo(host, port), timedout, callback, initial_data);
         }
     }
 }
 
-// Internal write method of a tcp socket
-void _raw_internal_tcp_socket_write(sl_event e) 
+string _raw_internal_tcp_pool_key(
+    const sl_peerinfo& socks5, 
+    const string& host, 
+    uint16_t port
+)
 {
-    sl_write_info _wi;
-    do {
-        lock_guard<mutex> _(_g_so_write_mutex);
-        auto _wiit = _g_so_write_map.find(e.so);
-        if ( _wiit == _g_so_write_map.end() ) return;
-        _wi = _wiit->second;
-    } while( false );
+    string _key = socks5 ? string(socks5.c_str()) : string("");
+    _key += "|" + host + ":" + to_string(port);
+    return _key;
+}
 
-    sl_shared_write_packet_t _sswpkt;
-    do {
-        lock_guard<mutex> _(*_wi.locker);
-        assert(_wi.packet_queue->size() > 0);
-        _sswpkt = _wi.packet_queue->front();
-    } while( false );
+// Check if an idle connection is still usable, the socket should have
+// nothing to read, otherwise the peer has closed it or sent unexpected data.
+bool _raw_internal_tcp_pool_check(SOCKET_T tso)
+{
+    char _word;
+    int _ret = ::recv(tso, &_word, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (_ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
 
-    //ldebug << "will send data(l:" << _sswpkt->packet.size() << ") to socket " << e.so << ", write mem: " << _wmem << lend;
-    while ( _sswpkt->sent_size < _sswpkt->packet.size() ) {
-        int _retval = ::send(e.so, 
-            _sswpkt->packet.c_str() + _sswpkt->sent_size, 
-            (_sswpkt->packet.size() - _sswpkt->sent_size), 
-            0 | SL_NETWORK_NOSIGNAL);
-        //ldebug << "send return value: " << _retval << lend;
-        if ( _retval < 0 ) {
-            if ( ENOBUFS == errno || EAGAIN == errno || EWOULDBLOCK == errno ) {
-                // No buf
+// Remove the socket from the idle connections and close it, do nothing 
+// if the socket has been handed out.
+void _raw_internal_tcp_pool_drop(SOCKET_T tso)
+{
+    bool _found = false;
+    do {
+        lock_guard<mutex> _(_g_tcp_pool_mutex);
+        for ( auto _pit = begin(_g_tcp_pool_idle); _pit != end(_g_tcp_pool_idle); ++_pit ) {
+            auto &_idle = _pit->second;
+            for ( auto _iit = begin(_idle); _iit != end(_idle); ++_iit ) {
+                if ( _iit->so != tso ) continue;
+                _idle.erase(_iit);
+                _found = true;
                 break;
-            } else {
-                lerror
-                    << "failed to send data on tcp socket: " << e.so 
-                    << ", err(" << errno << "): " << ::strerror(errno) << lend;
-                // e.event = SL_EVENT_FAILED;
-                // sl_socket_close(e.so);
-                // if ( _sswpkt->callback ) _sswpkt->callback(e);
-                sl_events::server().add_tcpevent(e.so, SL_EVENT_FAILED);
-                return;
             }
-        } else if ( _retval == 0 ) {
-            // No buf? sent 0
+            if ( !_found ) continue;
+            if ( _idle.size() == 0 ) _g_tcp_pool_idle.erase(_pit);
             break;
-        } else {
-            _sswpkt->sent_size += _retval;
         }
-    }
-    // ldebug << "sent data size " << _sswpkt->sent_size << " to socket " << e.so << lend;
+    } while ( false );
+    if ( _found ) sl_socket_close(tso);
+}
 
-    // Check if has pending data
+// Close the timedout idle connections, and schedule the next round when 
+// the oldest connection will time out. The lock must not be held.
+void _raw_internal_tcp_pool_reap(uint64_t round)
+{
+    vector<SOCKET_T> _close_list;
+    milliseconds _delay(0);
+    bool _again = false;
     do {
-        lock_guard<mutex> _(*_wi.locker);
-        if ( _sswpkt->sent_size == _sswpkt->packet.size() ) {
-            _wi.packet_queue->pop();
+        lock_guard<mutex> _(_g_tcp_pool_mutex);
+        if ( round != _g_tcp_pool_reap_round ) return;
+        auto _now = steady_clock::now();
+        milliseconds _idle_timeout(_g_tcp_pool_idle_timeout * 1000);
+        for ( auto _pit = begin(_g_tcp_pool_idle); _pit != end(_g_tcp_pool_idle); ) {
+            auto &_idle = _pit->second;
+            while ( _idle.size() > 0 && _now - _idle.front().idle_since >= _idle_timeout ) {
+                _close_list.push_back(_idle.front().so);
+                _idle.pop_front();
+            }
+            if ( _idle.size() == 0 ) {
+                _pit = _g_tcp_pool_idle.erase(_pit);
+                continue;
+            }
+            auto _left = duration_cast<milliseconds>(_idle.front().idle_since + _idle_timeout - _now);
+            if ( !_again || _left < _delay ) _delay = _left;
+            _again = true;
+            ++_pit;
         }
-        if ( _wi.packet_queue->size() == 0 ) break;
-
-        // Remonitor
-        sl_events::server().monitor(e.so, SL_EVENT_WRITE, _raw_internal_tcp_socket_write);
+        // Stop the timer when the pool is empty, release will restart it.
+        _g_tcp_pool_reaping = _again;
     } while ( false );
 
-    if ( _sswpkt->callback ) _sswpkt->callback(e);
+    for ( auto _so : _close_list ) sl_socket_close(_so);
+    if ( _again ) {
+        // Do not spin on a tiny timeout
+        uint32_t _ms = max((uint32_t)_delay.count(), (uint32_t)100);
+        sl_events::server().add_timer(_ms, [round]() { _raw_internal_tcp_pool_reap(round); });
+    }
 }
 
 /*
-    Async send a packet to the peer via current socket.
-
-    @Description
-    This method will append the packet to the write queue of the socket,
-    then check if current socket is writing or not.
-    If is now writing, the method will return directly. Otherwise,
-    this method will make the socket to monitor SL_EVENT_WRITE.
-
-    In Linux, this method will always monitor both EPOLLIN and EPOLLOUT
+    Setup the tcp connection pool
 */
-void sl_tcp_socket_send(
+void sl_tcp_socket_pool_setup(uint32_t idle_timeout, size_t max_idle)
+{
+    uint64_t _round = 0;
+    do {
+        lock_guard<mutex> _(_g_tcp_pool_mutex);
+        _g_tcp_pool_idle_timeout = idle_timeout;
+        _g_tcp_pool_max_idle = max_idle;
+        if ( !_g_tcp_pool_reaping ) return;
+        // Restart the timer with the new timeout
+        _round = ++_g_tcp_pool_reap_round;
+    } while ( false );
+    sl_events::server().add_timer(0, [_round]() { _raw_internal_tcp_pool_reap(_round); });
+}
+
+/*
+    Get a connection from the pool, or create a new one
+*/
+void sl_tcp_socket_pool_connect(
+    const sl_peerinfo& socks5, 
+    const string& host, 
+    uint16_t port,
+    uint32_t timedout,
+    sl_socket_event_handler callback
+)
+{
+    string _key = _raw_internal_tcp_pool_key(socks5, host, port);
+    SOCKET_T _tso = INVALIDATE_SOCKET;
+    vector<SOCKET_T> _dead_list;
+    while ( true ) {
+        SOCKET_T _so = INVALIDATE_SOCKET;
+        do {
+            lock_guard<mutex> _(_g_tcp_pool_mutex);
+            auto _pit = _g_tcp_pool_idle.find(_key);
+            if ( _pit == end(_g_tcp_pool_idle) ) break;
+            auto _now = steady_clock::now();
+            while ( _pit->second.size() > 0 ) {
+                sl_tcp_pool_item _item = _pit->second.back();
+                _pit->second.pop_back();
+                if ( _now - _item.idle_since > seconds(_g_tcp_pool_idle_timeout) ) {
+                    _dead_list.push_back(_item.so);
+                    continue;
+                }
+                _so = _item.so;
+                break;
+            }
+            if ( _pit->second.size() == 0 ) _g_tcp_pool_idle.erase(_pit);
+        } while ( false );
+        if ( SOCKET_NOT_VALIDATE(_so) ) break;
+
+        // Stop watching the idle connection, then check it out of the lock
+        sl_events::server().unmonitor(_so, SL_EVENT_READ);
+        if ( !_raw_internal_tcp_pool_check(_so) ) {
+            _dead_list.push_back(_so);
+            continue;
+        }
+        lock_guard<mutex> _(_g_tcp_pool_mutex);
+        _g_tcp_pool_busy[_so] = _key;
+        _tso = _so;
+        break;
+    }
+
+    for ( auto _so : _dead_list ) sl_socket_close(_so);
+
+    if ( SOCKET_NOT_VALIDATE(_tso) ) {
+        sl_tcp_socket_connect(socks5, host, port, timedout, [=](sl_event e) {
+            if ( e.event == SL_EVENT_CONNECT ) {
+                lock_guard<mutex> _(_g_tcp_pool_mutex);
+                _g_tcp_pool_busy[e.so] = _key;
+            }
+            if ( callback ) callback(e);
+        });
+        return;
+    }
+
+    // Reset the handler set left by the last user
+    auto _cb = [=](sl_event e) {
+        sl_socket_close(e.so);
+        if ( callback ) callback(e);
+    };
+    sl_events::server().update_handler(_tso, SL_EVENT_ACCEPT | SL_EVENT_DATA, NULL);
+    sl_events::server().update_handler(_tso, SL_EVENT_FAILED | SL_EVENT_TIMEOUT, _cb);
+    // The socket is connected, it will be writable in next runloop.
+    sl_events::server().monitor(_tso, SL_EVENT_CONNECT, callback, timedout);
+}
+
+/*
+    Put the connection back to the pool
+*/
+void sl_tcp_socket_pool_release(SOCKET_T tso)
+{
+    if ( SOCKET_NOT_VALIDATE(tso) ) return;
+    bool _usable = _raw_internal_tcp_pool_check(tso);
+    vector<SOCKET_T> _close_list;
+    uint64_t _round = 0;
+    uint32_t _idle_timeout = 0;
+    do {
+        lock_guard<mutex> _(_g_tcp_pool_mutex);
+        auto _bit = _g_tcp_pool_busy.find(tso);
+        if ( _bit == end(_g_tcp_pool_busy) || !_usable ) {
+            if ( _bit != end(_g_tcp_pool_busy) ) _g_tcp_pool_busy.erase(_bit);
+            _close_list.push_back(tso);
+            break;
+        }
+        string _key = _bit->second;
+        auto &_idle = _g_tcp_pool_idle[_key];
+        _g_tcp_pool_busy.erase(_bit);
+        _idle.push_back({tso, steady_clock::now()});
+        // The pool has its own idle limit, keep it from the idle reaper
+        sl_poller::server().untrack_activity(tso);
+        while ( _idle.size() > _g_tcp_pool_max_idle ) {
+            _close_list.push_back(_idle.front().so);
+            _idle.pop_front();
+        }
+        if ( _idle.size() == 0 ) {
+            _g_tcp_pool_idle.erase(_key);
+            break;
+        }
+        // Watch the idle connection, drop it once the peer closes it or
+        // sends anything. Monitor in the lock, so it will not be handed 
+        // out before the watching.
+        sl_events::server().update_handler(tso, SL_EVENT_FAILED | SL_EVENT_TIMEOUT, [](sl_event e) {
+            _raw_internal_tcp_pool_drop(e.so);
+        });
+        sl_socket_monitor(tso, 0, [](sl_event e) {
+            _raw_internal_tcp_pool_drop(e.so);
+        });
+        if ( _g_tcp_pool_reaping ) break;
+        _g_tcp_pool_reaping = true;
+        _round = ++_g_tcp_pool_reap_round;
+        _idle_timeout = _g_tcp_pool_idle_timeout;
+    } while ( false );
+
+    for ( auto _so : _close_list ) sl_socket_close(_so);
+    if ( _round != 0 ) {
+        sl_events::server().add_timer(_idle_timeout * 1000, [_round]() { 
+            _raw_internal_tcp_pool_reap(_round); 
+        });
+    }
+}
+
+// Release the packets which the kernel has finished zero-copy sending.
+// This method is invoked by the poller when the socket's error queue
+// is readable, and before each write action.
+void _raw_internal_tcp_zerocopy_reap(SOCKET_T tso)
+{
+#if SL_TCP_ZEROCOPY_SUPPORTED
+    sl_write_info _wi;
+    do {
+        lock_guard<mutex> _(_g_so_write_mutex);
+        auto _wiit = _g_so_write_map.find(tso);
+        if ( _wiit == _g_so_write_map.end() ) return;
+        _wi = _wiit->second;
+    } while( false );
+    if ( !_wi.zerocopy ) return;
+
+    // The released packet should be destoried out of the lock
+    vector<sl_shared_write_packet_t> _released;
+    lock_guard<mutex> _(*_wi.locker);
+    sl_zerocopy_info &_zci = *_wi.zerocopy;
+    while ( true ) {
+        char _control[128];
+        struct msghdr _msg;
+        memset(&_msg, 0, sizeof(_msg));
+        _msg.msg_control = _control;
+        _msg.msg_controllen = sizeof(_control);
+        if ( -1 == ::recvmsg(tso, &_msg, MSG_ERRQUEUE) ) {
+            if ( errno == EINTR ) continue;
+            break;  // EAGAIN, the error queue is empty
+        }
+        for ( struct cmsghdr *_cm = CMSG_FIRSTHDR(&_msg); _cm != NULL; _cm = CMSG_NXTHDR(&_msg, _cm) ) {
+            if ( _cm->cmsg_level != SOL_IP || _cm->cmsg_type != IP_RECVERR ) continue;
+            struct sock_extended_err *_serr = (struct sock_extended_err *)CMSG_DATA(_cm);
+            if ( _serr->ee_errno != 0 || _serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) continue;
+            // The kernel had to copy the data(like on loopback), 
+            // zero-copy send makes no sense on this socket.
+            if ( _serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) {
+                if ( _zci.enabled ) {
+                    linfo << "zero-copy send on tcp socket " << tso << " was copied by the kernel, disable it" << lend;
+                }
+                _zci.enabled = false;
+            }
+            // [ee_info, ee_data] is the completed id range
+            for ( uint32_t _id = _serr->ee_info; ; ++_id ) {
+                uint32_t _index = _id - _zci.first_id;
+                if ( _index < _zci.pending.size() ) _zci.pending[_index].first = true;
+                if ( _id == _serr->ee_data ) break;
+            }
+        }
+    }
+    while ( _zci.pending.size() > 0 && _zci.pending.front().first ) {
+        _zci.pending_size -= _zci.pending.front().second->packet.size();
+        _released.emplace_back(move(_zci.pending.front().second));
+        _zci.pending.pop_front();
+        _zci.first_id += 1;
+    }
+#endif
+}
+
+/*
+    Enable zero-copy send on a tcp socket.
+
+    @Description
+    Packets not smaller than <threshold> will be sent with MSG_ZEROCOPY,
+    and will be hold until the kernel reports the completion in the 
+    socket's error queue. Smaller packets are still sent by copy.
+*/
+bool sl_tcp_socket_set_zerocopy(SOCKET_T tso, bool enable, size_t threshold)
+{
+    if ( SOCKET_NOT_VALIDATE(tso) ) return false;
+#if SL_TCP_ZEROCOPY_SUPPORTED
+    lock_guard<mutex> _(_g_so_write_mutex);
+    auto _wiit = _g_so_write_map.find(tso);
+    if ( _wiit == _g_so_write_map.end() ) return false;
+    if ( !enable ) {
+        // Keep the pending packets until the kernel release them.
+        if ( _wiit->second.zerocopy ) {
+            lock_guard<mutex> _l(*_wiit->second.locker);
+            _wiit->second.zerocopy->enabled = false;
+        }
+        return true;
+    }
+
+    int _zc = 1;
+    if ( -1 == setsockopt(tso, SOL_SOCKET, SO_ZEROCOPY, (const char *)&_zc, sizeof(_zc)) ) {
+        lerror 
+            << "failed to set the tcp socket(" 
+            << tso << ") to be SO_ZEROCOPY: " 
+            << ::strerror( errno ) 
+        << lend;
+        return false;
+    }
+    if ( !_wiit->second.zerocopy ) {
+        shared_ptr<sl_zerocopy_info> _zci = make_shared<sl_zerocopy_info>();
+        _zci->first_id = 0;
+        _zci->pending_size = 0;
+        _wiit->second.zerocopy = _zci;
+    }
+    lock_guard<mutex> _l(*_wiit->second.locker);
+    _wiit->second.zerocopy->enabled = true;
+    _wiit->second.zerocopy->threshold = threshold;
+    sl_poller::server().bind_errqueue(tso, _raw_internal_tcp_zerocopy_reap);
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+// Internal write method of a tcp socket
+void _raw_internal_tcp_socket_write(sl_event e) 
+{
+    sl_write_info _wi;
+    do {
+        lock_guard<mutex> _(_g_so_write_mutex);
+        auto _wiit = _g_so_write_map.find(e.so);
+        if ( _wiit == _g_so_write_map.end() ) return;
+        _wi = _wiit->second;
+    } while( false );
+
+    if ( _wi.zerocopy ) _raw_internal_tcp_zerocopy_reap(e.so);
+
+    // Packets to be sent in one sendmsg
+    vector<sl_shared_write_packet_t> _batch;
+    bool _zerocopy = false;
+    bool _has_more = false;
+    do {
+        lock_guard<mutex> _(*_wi.locker);
+        if ( _wi.packet_queue->size() == 0 ) {
+            _wi.status->writing = false;
+            return;
+        }
+        sl_shared_write_packet_t _front = _wi.packet_queue->front();
+        // Too many pending packets, use copy send.
+        _zerocopy = ( _wi.zerocopy &&
+            _wi.zerocopy->enabled && 
+            _front->packet.size() >= _wi.zerocopy->threshold &&
+            _wi.zerocopy->pending_size < SL_TCP_ZEROCOPY_MAX_PENDING
+        );
+        // The zero-copy packet is sent alone, each send get a notification id
+        size_t _count = (_zerocopy ? 1 : 
+            min(_wi.packet_queue->size(), (size_t)SL_TCP_SEND_BATCH));
+        for ( size_t i = 0; i < _count; ++i ) {
+            _batch.push_back((*_wi.packet_queue)[i]);
+        }
+        _has_more = (_wi.packet_queue->size() > _count);
+    } while( false );
+
+    // Index of the first packet which has not been sent
+    size_t _index = 0;
+    // The socket is broken, stop writing and let the failed handler
+    // process it
+    bool _failed = false;
+    while ( _index < _batch.size() ) {
+        struct iovec _iov[SL_TCP_SEND_BATCH];
+        size_t _iovcnt = 0;
+        for ( size_t i = _index; i < _batch.size(); ++i ) {
+            _iov[_iovcnt].iov_base = (void *)(_batch[i]->packet.c_str() + _batch[i]->sent_size);
+            _iov[_iovcnt].iov_len = _batch[i]->packet.size() - _batch[i]->sent_size;
+            ++_iovcnt;
+        }
+        struct msghdr _msg;
+        memset(&_msg, 0, sizeof(_msg));
+        _msg.msg_iov = _iov;
+        _msg.msg_iovlen = _iovcnt;
+
+        int _flags = 0 | SL_NETWORK_NOSIGNAL;
+#if SL_TCP_ZEROCOPY_SUPPORTED
+        if ( _zerocopy ) _flags |= MSG_ZEROCOPY;
+#endif
+#ifdef MSG_MORE
+        // More packets are waiting in the queue, let the kernel fill the segment
+        if ( _has_more ) _flags |= MSG_MORE;
+#endif
+        ssize_t _retval = ::sendmsg(e.so, &_msg, _flags);
+        //ldebug << "send return value: " << _retval << lend;
+        if ( _retval < 0 ) {
+            if ( errno == EINTR ) continue;
+            if ( _zerocopy && ENOBUFS == errno ) {
+                // Out of optmem for the notifications, fall back to copy
+                _zerocopy = false;
+                continue;
+            }
+            if ( ENOBUFS == errno || EAGAIN == errno || EWOULDBLOCK == errno ) {
+                // No buf
+                break;
+            } else {
+                lerror
+                    << "failed to send data on tcp socket: " << e.so 
+                    << ", err(" << errno << "): " << ::strerror(errno) << lend;
+                _failed = true;
+                break;
+            }
+        } else if ( _retval == 0 ) {
+            // No buf? sent 0
+            break;
+        } else {
+            if ( _zerocopy ) {
+                // Hold the packet until the kernel finishes this send.
+                lock_guard<mutex> _(*_wi.locker);
+                _wi.zerocopy->pending.emplace_back(make_pair(false, _batch[0]));
+                _wi.zerocopy->pending_size += _batch[0]->packet.size();
+            }
+            size_t _sent = (size_t)_retval;
+            while ( _sent > 0 && _index < _batch.size() ) {
+                size_t _left = _batch[_index]->packet.size() - _batch[_index]->sent_size;
+                size_t _l = min(_left, _sent);
+                _batch[_index]->sent_size += _l;
+                _sent -= _l;
+                if ( _l == _left ) ++_index;
+            }
+        }
+    }
+    // ldebug << "sent " << _index << " packets to socket " << e.so << lend;
+
+    // Check if has pending data
+    do {
+        lock_guard<mutex> _(*_wi.locker);
+        for ( size_t i = 0; i < _index; ++i ) {
+            _wi.packet_queue->pop_front();
+        }
+        // Clear the writing flag on failed, so next send can try again
+        // if the failed handler keeps the socket.
+        if ( _failed || _wi.packet_queue->size() == 0 ) {
+            _wi.status->writing = false;
+            break;
+        }
+
+        // Remonitor
+        sl_events::server().monitor(e.so, SL_EVENT_WRITE, _raw_internal_tcp_socket_write);
+    } while ( false );
+
+    // Invoke the callback of the packets which have been fully sent
+    for ( size_t i = 0; i < _index; ++i ) {
+        if ( _batch[i]->callback ) _batch[i]->callback(e);
+    }
+    if ( _failed ) sl_events::server().add_tcpevent(e.so, SL_EVENT_FAILED);
+}
+
+/*
+    Async send a packet to the peer via current socket.
+
+    @Description
+    This method will append the packet to the write queue of the socket,
+    then check if current socket is writing or not.
+    If is now writing, the method will return directly. Otherwise,
+    this method will make the socket to monitor SL_EVENT_WRITE.
+
+    In Linux, this method will always monitor both EPOLLIN and EPOLLOUT
+*/
+void sl_tcp_socket_send(
     SOCKET_T tso, 
     const string &pkt, 
     sl_socket_event_handler callback
@@ -597,144 +1340,399 @@ void sl_tcp_socket_send(
     do {
         // Lock the write queue
         lock_guard<mutex> _(*_wi.locker);
-        _wi.packet_queue->emplace(_wpkt);
+        _wi.packet_queue->emplace_back(_wpkt);
 
-        // Just push the packet to the end of the queue
-        if ( _wi.packet_queue->size() > 1 ) return;
+        // Just push the packet to the end of the queue, in a batch window
+        // or the queue is being flushed.
+        if ( _wi.status->batch_depth > 0 || _wi.status->writing ) return;
 
         // Do monitor
+        _wi.status->writing = true;
         sl_events::server().monitor(tso, SL_EVENT_WRITE, _raw_internal_tcp_socket_write);
     } while ( false );
 }
 
 /*
-    Read incoming data from the socket.
+    Begin a batch window of the tcp socket
+*/
+void sl_tcp_socket_begin_batch(SOCKET_T tso)
+{
+    if ( SOCKET_NOT_VALIDATE(tso) ) return;
+    sl_write_info _wi;
+    do {
+        lock_guard<mutex> _(_g_so_write_mutex);
+        auto _wiit = _g_so_write_map.find(tso);
+        if ( _wiit == _g_so_write_map.end() ) return;
+        _wi = _wiit->second;
+    } while( false );
+    if ( !_wi.status ) return;
+
+    lock_guard<mutex> _(*_wi.locker);
+    _wi.status->batch_depth += 1;
+}
+
+/*
+    End the batch window and flush the queued packets
+*/
+void sl_tcp_socket_end_batch(SOCKET_T tso)
+{
+    if ( SOCKET_NOT_VALIDATE(tso) ) return;
+    sl_write_info _wi;
+    do {
+        lock_guard<mutex> _(_g_so_write_mutex);
+        auto _wiit = _g_so_write_map.find(tso);
+        if ( _wiit == _g_so_write_map.end() ) return;
+        _wi = _wiit->second;
+    } while( false );
+    if ( !_wi.status ) return;
+
+    lock_guard<mutex> _(*_wi.locker);
+    if ( _wi.status->batch_depth == 0 ) return;
+    _wi.status->batch_depth -= 1;
+    if ( _wi.status->batch_depth > 0 ) return;
+    if ( _wi.status->writing || _wi.packet_queue->size() == 0 ) return;
+    _wi.status->writing = true;
+    sl_events::server().monitor(tso, SL_EVENT_WRITE, _raw_internal_tcp_socket_write);
+}
+
+/*
+    Read incoming data from the socket into pooled chunks.
 
     @Description
     This is a block method to read data from the socket.
-    
-    The socket must be NON_BLOCKING. This method will use a loop
-    to fetch all data on the socket till two conditions:
-    1. the buffer is not full after current recv action
+
+    The socket must be NON_BLOCKING. The method will use readv to fetch
+    all data on the socket into the socket's read ring till two conditions:
+    1. the free space of the ring is not full after current readv action
     2. receive a EAGAIN or EWOULDBLOCK signal
+    The ring offers more chunks to the next readv only when the last one
+    filled all of them, and drops all its chunks before returning, so the
+    socket holds no memory between reads.
 
-    The method will increase the buffer's size after each loop 
-    until reach the max size of string, which should be the size
-    of machine memory in default.
+    The data will be appended to <views>, the chunks will not be reused
+    until all views on them have been released.
 */
-bool sl_tcp_socket_read(
-    SOCKET_T tso, 
-    string& buffer, 
-    size_t min_buffer_size
+bool sl_tcp_socket_readv(
+    SOCKET_T tso,
+    sl_buffer_views& views
 )
 {
     if ( SOCKET_NOT_VALIDATE(tso) ) return false;
-    
-    // Socket must be nonblocking
-    buffer.clear();
-    buffer.resize(min_buffer_size);
-    size_t _received = 0;
-    size_t _leftspace = min_buffer_size;
 
+    sl_read_info _ri;
+    do {
+        lock_guard<mutex> _(_g_so_read_mutex);
+        auto _riit = _g_so_read_map.find(tso);
+        if ( _riit == _g_so_read_map.end() ) {
+            _ri.locker = make_shared<mutex>();
+            _ri.ring = make_shared<sl_buffer_ring>();
+            _g_so_read_map[tso] = _ri;
+        } else {
+            _ri = _riit->second;
+        }
+    } while( false );
+
+    lock_guard<mutex> _(*_ri.locker);
+    size_t _origin_count = views.size();
+    bool _ret = true;
     do {
-        int _retCode = ::recv(tso, &buffer[0] + _received, _leftspace, 0 );
+        struct iovec _iov[sl_buffer_ring::max_iov];
+        size_t _space = 0;
+        int _iovcnt = _ri.ring->prepare(_iov, _space);
+        ssize_t _retCode = ::readv(tso, _iov, _iovcnt);
         if ( _retCode < 0 ) {
             if ( errno == EINTR ) continue;    // signal 7, retry
             if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
                 // No more data on a non-blocking socket
-                buffer.resize(_received);
-                return true;
+                break;
             }
             // Other error
-            buffer.resize(0);
+            views.resize(_origin_count);
             lerror << "failed to receive data on tcp socket: " << tso << ", " << ::strerror( errno ) << lend;
-            return false;
+            _ret = false;
+            break;
         } else if ( _retCode == 0 ) {
             // Peer Close
-            buffer.resize(0);
+            views.resize(_origin_count);
             lerror << "the peer has close the socket, recv 0" << lend;
-            return false;
+            _ret = false;
+            break;
         } else {
-            _received += _retCode;
-            _leftspace -= _retCode;
-            if ( _leftspace > 0 ) {
-                // Unfull
-                buffer.resize(_received);
-                return true;
-            } else {
-                // The buffer is full, try to double the buffer and try again
-                if ( min_buffer_size * 2 <= buffer.max_size() ) {
-                    min_buffer_size *= 2;
-                } else if ( min_buffer_size < buffer.max_size() ) {
-                    min_buffer_size = buffer.max_size();
-                } else {
-                    return true;    // direct return, wait for next read.
-                }
-                // Resize the buffer and try to read again
-                _leftspace = min_buffer_size - _received;
-                buffer.resize(min_buffer_size);
-            }
+            _ri.ring->commit((size_t)_retCode, views);
+            // Unfull
+            if ( (size_t)_retCode < _space ) break;
         }
     } while ( true );
-    return true;
+    // The socket has been drained, do not hold any chunk till the next read
+    _ri.ring->shrink();
+    return _ret;
 }
+
 /*
-    Listen on a tcp port
+    Read incoming data from the socket.
 
     @Description
-    Listen on a specified tcp port on sepcified interface.
-    The bind_port is the listen port info of the method.
-    If you want to listen on port 4040 on all interface, set 
-    <bind_port> as "0.0.0.0:4040" or sl_peerinfo(INADDR_ANY, 4040).
-    If you want to listen only the internal network, like 192.168.1.0/24
-    set the <bind_port> like "192.168.1.1:4040"
-
-    The accept callback will return a new incoming socket, which
-    has not been monited on any event.
+    This is a block method to read data from the socket.
+    
+    The socket must be NON_BLOCKING. This method will read all data
+    on the socket by <sl_tcp_socket_readv> and copy them into the buffer,
+    only the received bytes will be copied.
 */
-SOCKET_T sl_tcp_socket_listen(
-    const sl_peerinfo& bind_port, 
-    sl_socket_event_handler accept_callback
+bool sl_tcp_socket_read(
+    SOCKET_T tso, 
+    string& buffer, 
+    size_t
 )
 {
-    SOCKET_T tso = _raw_internal_tcp_socket_init();
-    if ( SOCKET_NOT_VALIDATE(tso) ) return INVALIDATE_SOCKET;
+    buffer.clear();
+    sl_buffer_views _views;
+    if ( !sl_tcp_socket_readv(tso, _views) ) return false;
+    sl_buffer_views_to_string(_views, buffer);
+    return true;
+}
 
-    // Bind the socket
-    struct sockaddr_in _sock_addr;
-    memset((char *)&_sock_addr, 0, sizeof(_sock_addr));
-    _sock_addr.sin_family = AF_INET;
-    _sock_addr.sin_port = htons(bind_port.port_number);
-    _sock_addr.sin_addr.s_addr = bind_port.ipaddress;
+/*
+    Read incoming data and decode frames.
+*/
+bool sl_tcp_socket_read_frames(
+    SOCKET_T tso,
+    sl_frame_decoder& decoder,
+    sl_frame_handler handler
+)
+{
+    sl_buffer_views _views;
+    if ( !sl_tcp_socket_readv(tso, _views) ) return false;
+    return decoder.feed(_views, handler);
+}
 
-    sl_events::server().update_handler(tso, SL_EVENT_ACCEPT, [=](sl_event e) {
-        SOCKET_T _so = _raw_internal_tcp_socket_init(NULL, NULL, e.so);
-        if ( SOCKET_NOT_VALIDATE(_so) ) {
-            lerror << "failed to initialize the incoming socket " << e.so << lend;
-            sl_socket_close(e.so);
-            return;
+// Wait for the first whole frame on the socket, the socket will be monitored
+// again if the frame is not complete. On failed, the frame will be empty and
+// <ok> is false, the socket should be closed.
+// The other frames of the same read are kept in the decoder, the next wait
+// with the same decoder will get them without reading the socket.
+void _raw_internal_tcp_socket_wait_frame(
+    SOCKET_T tso,
+    shared_ptr<sl_frame_decoder> decoder,
+    uint32_t timedout,
+    function<void(sl_event, bool, const sl_buffer_view &)> callback
+)
+{
+    sl_buffer_view _frame;
+    if ( decoder->pop(_frame) ) {
+        sl_event _e;
+        memset(&_e, 0, sizeof(_e));
+        _e.so = tso;
+        _e.source = INVALIDATE_SOCKET;
+        _e.event = SL_EVENT_DATA;
+        _e.socktype = IPPROTO_TCP;
+        callback(_e, true, _frame);
+        return;
+    }
+    sl_socket_monitor(tso, timedout, [=](sl_event e) {
+        sl_buffer_views _views;
+        if ( !sl_tcp_socket_readv(e.so, _views) || !decoder->push(_views) ) {
+            callback(e, false, sl_buffer_view());
+            return;
+        }
+        sl_buffer_view _frame;
+        if ( decoder->pop(_frame) ) {
+            callback(e, true, _frame);
+            return;
+        }
+        _raw_internal_tcp_socket_wait_frame(e.so, decoder, timedout, callback);
+    });
+}
+
+// Internal listen method, create a listening socket on the port
+SOCKET_T _raw_internal_tcp_socket_listen(
+    const sl_peerinfo& bind_port, 
+    sl_socket_event_handler accept_callback,
+    uint32_t fastopen_qlen,
+    int backlog,
+    bool reuseport
+)
+{
+    SOCKET_T tso = _raw_internal_tcp_socket_init();
+    if ( SOCKET_NOT_VALIDATE(tso) ) return INVALIDATE_SOCKET;
+
+    // Bind the socket
+    struct sockaddr_in _sock_addr;
+    memset((char *)&_sock_addr, 0, sizeof(_sock_addr));
+    _sock_addr.sin_family = AF_INET;
+    _sock_addr.sin_port = htons(bind_port.port_number);
+    _sock_addr.sin_addr.s_addr = bind_port.ipaddress;
+
+    sl_events::server().update_handler(tso, SL_EVENT_ACCEPT, [=](sl_event e) {
+        SOCKET_T _so = _raw_internal_tcp_socket_init(NULL, NULL, e.so);
+        if ( SOCKET_NOT_VALIDATE(_so) ) {
+            lerror << "failed to initialize the incoming socket " << e.so << lend;
+            // Unmonitor the socket to release the admission slot, then close it
+            sl_socket_close(e.so);
+            return;
         }
         accept_callback(e);
     });
 
+#ifdef SO_REUSEPORT
+    int _reuseport = 1;
+    if ( reuseport && setsockopt(tso, SOL_SOCKET, SO_REUSEPORT, 
+        (const char *)&_reuseport, sizeof(_reuseport)) == -1 ) 
+    {
+        lerror << "failed to set SO_REUSEPORT on " << bind_port << ": " << ::strerror( errno ) << lend;
+        sl_socket_close(tso);
+        return INVALIDATE_SOCKET;
+    }
+#else
+    if ( reuseport ) {
+        lerror << "SO_REUSEPORT is not supported, failed to listen on " << bind_port << lend;
+        sl_socket_close(tso);
+        return INVALIDATE_SOCKET;
+    }
+#endif
+
     if ( ::bind(tso, (struct sockaddr *)&_sock_addr, sizeof(_sock_addr)) == -1 ) {
         lerror << "failed to listen tcp on " << bind_port << ": " << ::strerror( errno ) << lend;
         sl_socket_close(tso);
         return INVALIDATE_SOCKET;
     }
-    if ( -1 == ::listen(tso, 1024) ) {
+#ifdef TCP_FASTOPEN
+    if ( fastopen_qlen > 0 ) {
+#if SL_TARGET_MAC
+        // Mac only accept 1 to enable fast open
+        int _qlen = 1;
+#else
+        int _qlen = (int)fastopen_qlen;
+#endif
+        if ( setsockopt(tso, IPPROTO_TCP, TCP_FASTOPEN, 
+            (const char *)&_qlen, sizeof(_qlen)) == -1 ) 
+        {
+            lwarning << "failed to enable fast open on " << bind_port << ": " << ::strerror( errno ) << lend;
+        }
+    }
+#endif
+    if ( -1 == ::listen(tso, backlog) ) {
         lerror << "failed to listen tcp on " << bind_port << ": " << ::strerror( errno ) << lend;
         sl_socket_close(tso);
         return INVALIDATE_SOCKET;
     }
     linfo << "start to listening tcp on " << bind_port << lend;
-    if ( !sl_poller::server().bind_tcp_server(tso) ) {
+    // Each SO_REUSEPORT socket is accepted in its own thread, so the 
+    // kernel spreads the incoming connections across the threads.
+    if ( !sl_poller::server().bind_tcp_server(tso, !reuseport) ) {
+        sl_socket_close(tso);
+        return INVALIDATE_SOCKET;
+    }
+    if ( reuseport && !sl_events::server().start_accepting(tso) ) {
         sl_socket_close(tso);
         return INVALIDATE_SOCKET;
     }
     return tso;
 }
 
+/*
+    Listen on a tcp port
+
+    @Description
+    Listen on a specified tcp port on sepcified interface.
+    The bind_port is the listen port info of the method.
+    If you want to listen on port 4040 on all interface, set 
+    <bind_port> as "0.0.0.0:4040" or sl_peerinfo(INADDR_ANY, 4040).
+    If you want to listen only the internal network, like 192.168.1.0/24
+    set the <bind_port> like "192.168.1.1:4040"
+
+    The accept callback will return a new incoming socket, which
+    has not been monited on any event.
+*/
+SOCKET_T sl_tcp_socket_listen(
+    const sl_peerinfo& bind_port, 
+    sl_socket_event_handler accept_callback,
+    uint32_t fastopen_qlen,
+    int backlog
+)
+{
+    return _raw_internal_tcp_socket_listen(
+        bind_port, accept_callback, fastopen_qlen, backlog, false);
+}
+
+/*
+    Listen on a tcp port with multiple SO_REUSEPORT sockets
+*/
+vector<SOCKET_T> sl_tcp_socket_listen_reuseport(
+    const sl_peerinfo& bind_port, 
+    size_t count,
+    sl_socket_event_handler accept_callback,
+    uint32_t fastopen_qlen,
+    int backlog
+)
+{
+    vector<SOCKET_T> _listeners;
+    if ( count == 0 ) count = thread::hardware_concurrency();
+    if ( count == 0 ) count = 1;
+    for ( size_t i = 0; i < count; ++i ) {
+        SOCKET_T _lso = _raw_internal_tcp_socket_listen(
+            bind_port, accept_callback, fastopen_qlen, backlog, true);
+        if ( SOCKET_NOT_VALIDATE(_lso) ) {
+            for ( auto _so : _listeners ) sl_socket_close(_so);
+            return vector<SOCKET_T>();
+        }
+        _listeners.push_back(_lso);
+    }
+    return _listeners;
+}
+
+/*
+    Get the count of accepted sockets
+*/
+uint64_t sl_tcp_socket_accept_count(SOCKET_T lso)
+{
+    return sl_poller::server().accept_count(lso);
+}
+
+/*
+    Admission control of the incoming tcp connections
+*/
+void sl_tcp_socket_set_admission(size_t max_connections, size_t max_per_ip)
+{
+    sl_poller::server().set_admission_limit(max_connections, max_per_ip);
+}
+void sl_tcp_socket_admission_allow(const sl_iprange& range)
+{
+    sl_poller::server().add_admission_allow(range);
+}
+void sl_tcp_socket_admission_deny(const sl_iprange& range)
+{
+    sl_poller::server().add_admission_deny(range);
+}
+
+/*
+    Get the admission control statistics.
+*/
+sl_admission_stats sl_tcp_socket_admission_stats()
+{
+    return sl_poller::server().admission_stats();
+}
+
+/*
+    Only accept the connection after the first data arrived
+*/
+bool sl_tcp_socket_set_defer_accept(SOCKET_T lso, uint32_t timedout)
+{
+    if ( SOCKET_NOT_VALIDATE(lso) ) return false;
+#if SL_TARGET_LINUX && defined(TCP_DEFER_ACCEPT)
+    int _seconds = (int)timedout;
+    if ( setsockopt(lso, IPPROTO_TCP, TCP_DEFER_ACCEPT, 
+        (const char *)&_seconds, sizeof(_seconds)) == -1 ) 
+    {
+        lerror << "failed to set TCP_DEFER_ACCEPT on socket " << lso << ": " << ::strerror( errno ) << lend;
+        return false;
+    }
+    return true;
+#else
+    (void)timedout;
+    return false;
+#endif
+}
+
 /*
     Get original peer info of a socket.
 
@@ -867,7 +1865,7 @@ SOCKET_T sl_udp_socket_init(
     sl_events::server().bind(_so, move(_hset));
 
     // Add A Write Buffer
-    sl_write_info _wi = { make_shared<mutex>(), make_shared< queue<sl_shared_write_packet_t> >() };
+    sl_write_info _wi = { make_shared<mutex>(), make_shared< deque<sl_shared_write_packet_t> >() };
     do {
         lock_guard<mutex> _(_g_so_write_mutex);
         _g_so_write_map[_so] = _wi;
@@ -876,6 +1874,9 @@ SOCKET_T sl_udp_socket_init(
     return _so;
 }
 // Internal write method of a udp socket
+// Flush the write queue with sendmmsg, each call sends up to 
+// SL_UDP_SEND_BATCH datagrams. If GSO is enabled on the socket, 
+// continuous datagrams to the same peer will be sent in one message.
 void _raw_internal_udp_socket_write(sl_event e) 
 {
     sl_write_info _wi;
@@ -886,61 +1887,230 @@ void _raw_internal_udp_socket_write(sl_event e)
         _wi = _wiit->second;
     } while( false );
 
-    sl_shared_write_packet_t _sswpkt;
-    do {
-        lock_guard<mutex> _(*_wi.locker);
-        assert(_wi.packet_queue->size() > 0);
-        _sswpkt = _wi.packet_queue->front();
-    } while( false );
+    // All packets have been sent, invoke the callbacks in order after the flush
+    vector<sl_shared_write_packet_t> _sent_list;
+    // The datagram failed with a hard error, it has been dropped
+    bool _failed = false;
+    sl_shared_write_packet_t _batch[SL_UDP_SEND_BATCH];
+    struct sockaddr_in _addrs[SL_UDP_SEND_BATCH];
+#if SL_TARGET_LINUX
+    struct iovec _iovs[SL_UDP_SEND_BATCH];
+    struct mmsghdr _msgs[SL_UDP_SEND_BATCH];
+    // Packet count of each message
+    size_t _msg_packets[SL_UDP_SEND_BATCH];
+#if SL_UDP_GSO_SUPPORTED
+    char _controls[SL_UDP_SEND_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+#endif
+    size_t _gso_size = _wi.gso_size;
+#endif
 
-    struct sockaddr_in _sock_addr = {};
-    _sock_addr.sin_family = AF_INET;
-    _sock_addr.sin_port = htons(_sswpkt->peerinfo.port_number);
-    _sock_addr.sin_addr.s_addr = (uint32_t)_sswpkt->peerinfo.ipaddress;
-
-    bool _force_remove_top_packet = false;
-    while ( _sswpkt->sent_size < _sswpkt->packet.size() ) {
-        int _retval = ::sendto(e.so, 
-            _sswpkt->packet.c_str() + _sswpkt->sent_size, 
-            (_sswpkt->packet.size() - _sswpkt->sent_size), 
-            0 | SL_NETWORK_NOSIGNAL, 
-            (struct sockaddr *)&_sock_addr, sizeof(_sock_addr));
-        //ldebug << "send return value: " << _retval << lend;
+    while ( true ) {
+        size_t _count = 0;
+        do {
+            lock_guard<mutex> _(*_wi.locker);
+            // Fetch the front packets, they will be popped after sent
+            size_t _qsize = _wi.packet_queue->size();
+            for ( ; _count < _qsize && _count < SL_UDP_SEND_BATCH; ++_count ) {
+                _batch[_count] = (*_wi.packet_queue)[_count];
+            }
+        } while ( false );
+        if ( _count == 0 ) break;
+
+        for ( size_t i = 0; i < _count; ++i ) {
+            memset(&_addrs[i], 0, sizeof(struct sockaddr_in));
+            _addrs[i].sin_family = AF_INET;
+            _addrs[i].sin_port = htons(_batch[i]->peerinfo.port_number);
+            _addrs[i].sin_addr.s_addr = (uint32_t)_batch[i]->peerinfo.ipaddress;
+        }
+
+        // Count of packets sent
+        int _retval = 0;
+        // Count of packets in the failed message
+        int _failed_count = 1;
+#if SL_TARGET_LINUX
+        size_t _msg_count = 0;
+        memset(_msgs, 0, sizeof(struct mmsghdr) * _count);
+        for ( size_t i = 0; i < _count; ++i ) {
+            _iovs[i].iov_base = (void *)_batch[i]->packet.c_str();
+            _iovs[i].iov_len = _batch[i]->packet.size();
+        }
+        for ( size_t i = 0; i < _count; ) {
+            size_t _n = 1;
+#if SL_UDP_GSO_SUPPORTED
+            // All segments must have the same size except the last one
+            if ( _gso_size > 0 && _batch[i]->packet.size() == _gso_size ) {
+                size_t _total = _gso_size;
+                while ( i + _n < _count && _n < SL_UDP_GSO_MAX_SEGMENTS ) {
+                    size_t _next_size = _batch[i + _n]->packet.size();
+                    if ( _next_size == 0 || _next_size > _gso_size ) break;
+                    if ( _total + _next_size > SL_UDP_GSO_MAX_SIZE ) break;
+                    if ( _addrs[i + _n].sin_addr.s_addr != _addrs[i].sin_addr.s_addr ) break;
+                    if ( _addrs[i + _n].sin_port != _addrs[i].sin_port ) break;
+                    _total += _next_size;
+                    _n += 1;
+                    if ( _next_size < _gso_size ) break;
+                }
+            }
+#endif
+            struct msghdr &_hdr = _msgs[_msg_count].msg_hdr;
+            _hdr.msg_name = &_addrs[i];
+            _hdr.msg_namelen = sizeof(struct sockaddr_in);
+            _hdr.msg_iov = &_iovs[i];
+            _hdr.msg_iovlen = _n;
+#if SL_UDP_GSO_SUPPORTED
+            if ( _n > 1 ) {
+                _hdr.msg_control = _controls[_msg_count];
+                _hdr.msg_controllen = sizeof(_controls[_msg_count]);
+                struct cmsghdr *_cm = CMSG_FIRSTHDR(&_hdr);
+                _cm->cmsg_level = SOL_UDP;
+                _cm->cmsg_type = UDP_SEGMENT;
+                _cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *(uint16_t *)CMSG_DATA(_cm) = (uint16_t)_gso_size;
+            }
+#endif
+            _msg_packets[_msg_count] = _n;
+            _msg_count += 1;
+            i += _n;
+        }
+        int _msg_sent = 0;
+        do {
+            _msg_sent = ::sendmmsg(e.so, _msgs, _msg_count, 0 | SL_NETWORK_NOSIGNAL);
+        } while ( _msg_sent < 0 && errno == EINTR );
+        if ( _msg_sent < 0 ) {
+            _retval = -1;
+            _failed_count = (int)_msg_packets[0];
+#if SL_UDP_GSO_SUPPORTED
+            // The device does not support the segmentation offload
+            if ( _failed_count > 1 && (EIO == errno || EINVAL == errno) ) {
+                lwarning 
+                    << "udp socket " << e.so << " failed to send with GSO, " 
+                    << ::strerror(errno) << ", disable it" << lend;
+                _gso_size = 0;
+                lock_guard<mutex> _(_g_so_write_mutex);
+                auto _wiit = _g_so_write_map.find(e.so);
+                if ( _wiit != _g_so_write_map.end() ) _wiit->second.gso_size = 0;
+                continue;
+            }
+#endif
+        } else {
+            for ( int m = 0; m < _msg_sent; ++m ) _retval += (int)_msg_packets[m];
+        }
+#else
+        for ( ; _retval < (int)_count; ++_retval ) {
+            int _ret = ::sendto(e.so, 
+                _batch[_retval]->packet.c_str(), _batch[_retval]->packet.size(), 
+                0 | SL_NETWORK_NOSIGNAL, 
+                (struct sockaddr *)&_addrs[_retval], sizeof(struct sockaddr_in));
+            if ( _ret < 0 && errno == EINTR ) { --_retval; continue; }
+            if ( _ret < 0 ) {
+                if ( _retval == 0 ) _retval = -1;
+                break;
+            }
+        }
+#endif
+        //ldebug << "sendmmsg return value: " << _retval << lend;
         if ( _retval < 0 ) {
             if ( ENOBUFS == errno || EAGAIN == errno || EWOULDBLOCK == errno ) {
-                // No buf
-                break;
+                // No buf, wait for next write event
+                _retval = 0;
             } else {
+                // sendmmsg only report the error of the first message,
+                // drop it and keep the rest of the queue, one bad peer
+                // should not break an unconnected socket.
                 lerror
                     << "failed to send data on udp socket: " << e.so 
                     << ", err(" << errno << "): " << ::strerror(errno) << lend;
-                // e.event = SL_EVENT_FAILED;
-                // if ( _sswpkt->callback ) _sswpkt->callback(e);
-                sl_events::server().add_udpevent(e.so, _sock_addr, SL_EVENT_FAILED);
-                _force_remove_top_packet = true;
-                return;
+                _failed = true;
+                _retval = _failed_count;
             }
-        } else if ( _retval == 0 ) {
-            // No buf? sent 0
+        }
+
+        do {
+            lock_guard<mutex> _(*_wi.locker);
+            for ( int i = 0; i < _retval && _wi.packet_queue->size() > 0; ++i ) {
+                _wi.packet_queue->pop_front();
+            }
+        } while ( false );
+
+        if ( _failed ) {
+            for ( size_t i = 0; i < _count; ++i ) _batch[i].reset();
             break;
-        } else {
-            _sswpkt->sent_size += _retval;
         }
+        for ( int i = 0; i < _retval; ++i ) {
+            _batch[i]->sent_size = _batch[i]->packet.size();
+            _sent_list.emplace_back(_batch[i]);
+        }
+        for ( size_t i = 0; i < _count; ++i ) _batch[i].reset();
+        // Not all datagrams have been sent, the socket buffer is full.
+        if ( (size_t)_retval < _count ) break;
     }
 
     // Check if has pending data
     do {
         lock_guard<mutex> _(*_wi.locker);
-        if ( _sswpkt->sent_size == _sswpkt->packet.size() || _force_remove_top_packet ) {
-            _wi.packet_queue->pop();
-        }
         if ( _wi.packet_queue->size() == 0 ) break;
 
         // Remonitor
         sl_events::server().monitor(e.so, SL_EVENT_WRITE, _raw_internal_udp_socket_write);
     } while ( false );
 
-    if ( _sswpkt->callback ) _sswpkt->callback(e);
+    for ( auto &_sswpkt : _sent_list ) {
+        if ( _sswpkt->callback ) _sswpkt->callback(e);
+    }
+
+    // Tell the failed handler after the queue has been taken care of
+    if ( _failed ) {
+        sl_events::server().add_udpevent(e.so, _addrs[0], SL_EVENT_FAILED);
+    }
+}
+
+/*
+    Enable UDP generic segmentation offload on the send side.
+
+    @Description
+    Continuous queued datagrams to the same peer, whose size equal to
+    <segment_size>(the last one can be smaller), will be sent in one
+    message with UDP_SEGMENT. Set <segment_size> to 0 to disable it.
+*/
+bool sl_udp_socket_set_gso(SOCKET_T uso, uint16_t segment_size)
+{
+    if ( SOCKET_NOT_VALIDATE(uso) ) return false;
+#if SL_UDP_GSO_SUPPORTED
+    lock_guard<mutex> _(_g_so_write_mutex);
+    auto _wiit = _g_so_write_map.find(uso);
+    if ( _wiit == _g_so_write_map.end() ) return false;
+    _wiit->second.gso_size = segment_size;
+    return true;
+#else
+    return segment_size == 0;
+#endif
+}
+
+/*
+    Enable UDP generic receive offload.
+
+    @Description
+    The kernel may merge the datagrams from the same flow into one 
+    buffer, the batch listener will split them back by the segment
+    size before passing to the handler.
+*/
+bool sl_udp_socket_set_gro(SOCKET_T uso, bool enable)
+{
+    if ( SOCKET_NOT_VALIDATE(uso) ) return false;
+#if SL_UDP_GSO_SUPPORTED
+    int _gro = (enable ? 1 : 0);
+    if ( -1 == setsockopt(uso, SOL_UDP, UDP_GRO, (const char *)&_gro, sizeof(_gro)) ) {
+        lerror 
+            << "failed to set the udp socket(" 
+            << uso << ") to be UDP_GRO: " 
+            << ::strerror( errno ) 
+        << lend;
+        return false;
+    }
+    return true;
+#else
+    return !enable;
+#endif
 }
 
 /*
@@ -981,7 +2151,7 @@ void sl_udp_socket_send(
     do {
         // Lock the write queue
         lock_guard<mutex> _(*_wi.locker);
-        _wi.packet_queue->emplace(_wpkt);
+        _wi.packet_queue->emplace_back(_wpkt);
 
         // Just push the packet to the end of the queue
         if ( _wi.packet_queue->size() > 1 ) return;
@@ -991,36 +2161,132 @@ void sl_udp_socket_send(
     } while ( false );
 }
 
+/*
+    Receive one datagram from the UDP socket.
+
+    @Description
+    Receive the datagram into a pooled 64K chunk with a single recvmsg,
+    the payload will be exactly the datagram and <addr> will be the
+    source address. An empty payload means there is no data in the buffer.
+*/
+bool sl_udp_socket_recv(
+    SOCKET_T uso,
+    struct sockaddr_in& addr,
+    sl_buffer_view& payload
+)
+{
+    payload.release();
+    if ( SOCKET_NOT_VALIDATE(uso) ) return false;
+
+    sl_buffer_chunk *_chunk = sl_buffer_pool::pool().alloc(SL_BUFFER_LARGE_CHUNK_SIZE);
+    struct iovec _iov = { _chunk->data(), _chunk->capacity() };
+    struct msghdr _msg;
+    memset(&_msg, 0, sizeof(_msg));
+    _msg.msg_iov = &_iov;
+    _msg.msg_iovlen = 1;
+
+#if SL_TARGET_LINUX
+    // With MSG_TRUNC, the return value is the real length of the datagram
+    int _flags = MSG_TRUNC;
+#else
+    int _flags = 0;
+#endif
+    ssize_t _retCode = 0;
+    do {
+        _msg.msg_name = &addr;
+        _msg.msg_namelen = sizeof(addr);
+        _retCode = ::recvmsg(uso, &_msg, _flags);
+    } while ( _retCode < 0 && errno == EINTR );
+
+    if ( _retCode < 0 ) {
+        _chunk->release();
+        // No more data on a non-blocking socket
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) return true;
+        lerror << "failed to receive data on udp socket: " << uso << "(" 
+            << sl_peerinfo(addr) << "), " << ::strerror( errno ) << lend;
+        return false;
+    }
+    size_t _size = (size_t)_retCode;
+    if ( (_msg.msg_flags & MSG_TRUNC) || _size > _chunk->capacity() ) {
+        lwarning << "the datagram(" << _size << ") from " << sl_peerinfo(addr) 
+            << " on udp socket: " << uso << " has been truncated" << lend;
+        if ( _size > _chunk->capacity() ) _size = _chunk->capacity();
+    }
+    payload = sl_buffer_view(_chunk, 0, _size);
+    // The view holds the chunk now
+    _chunk->release();
+    return true;
+}
+
 /*
     Block and read data from the UDP socket.
 
     @Description
-    Same as tcp socket read method.
+    Read one datagram by <sl_udp_socket_recv>.
 */
 bool sl_udp_socket_read(
     SOCKET_T uso, 
-    struct sockaddr_in addr, 
+    struct sockaddr_in& addr, 
     string& buffer, 
-    size_t min_buffer_size
+    size_t
 )
 {
-    if ( SOCKET_NOT_VALIDATE(uso) ) return false;
-
-    sl_peerinfo _pi(addr);
+    buffer.clear();
+    sl_buffer_view _payload;
+    if ( !sl_udp_socket_recv(uso, addr, _payload) ) return false;
+    buffer.assign(_payload.data(), _payload.size());
+    return true;
+}
+/*
+    Read data from the UDP socket until limit bytes.
 
-    // Socket must be nonblocking
+    If limit_bytes is 0, is the same as sl_udp_socket_read
+*/
+bool sl_udp_socket_read_limit(
+    SOCKET_T uso,
+    struct sockaddr_in& addr,
+    string& buffer,
+    size_t limit_bytes
+)
+{
+    if ( limit_bytes == 0 ) {
+        return sl_udp_socket_read(uso, addr, buffer);
+    }
     buffer.clear();
-    buffer.resize(min_buffer_size);
-    size_t _received = 0;
-    size_t _leftspace = min_buffer_size;
+    sl_buffer_view _payload;
+    if ( !sl_udp_socket_recv(uso, addr, _payload) ) return false;
+    // The datagram is shorter than the limit
+    if ( _payload.size() < limit_bytes ) {
+        lwarning << "the datagram(" << _payload.size() << ") from " << sl_peerinfo(addr)
+            << " is less than " << limit_bytes << " bytes" << lend;
+        return false;
+    }
+    buffer.assign(_payload.data(), limit_bytes);
+    return true;
+}
+
+/*
+    Read but not fetch the data from the socket buffer.
+
+    if up_to_bytes is 0, will return false.
+*/
+bool sl_udp_socket_check_packet(
+    SOCKET_T uso,
+    struct sockaddr_in addr,
+    char *pbuffer,
+    size_t up_to_bytes
+)
+{
+    if ( SOCKET_NOT_VALIDATE(uso) ) return false;
+    sl_peerinfo _pi(addr);
 
     do {
         unsigned _so_len = sizeof(addr);
         int _retCode = ::recvfrom( 
             uso, 
-            &buffer[0] + _received, 
-            _leftspace, 
-            0,
+            pbuffer,
+            up_to_bytes, 
+            MSG_PEEK,
             (struct sockaddr *)&addr, 
             &_so_len
         );
@@ -1028,184 +2294,1320 @@ bool sl_udp_socket_read(
             if ( errno == EINTR ) continue;    // signal 7, retry
             if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
                 // No more data on a non-blocking socket
-                buffer.resize(_received);
-                return true;
+                lwarning << "No data in the udp socket: " << uso << "(" << _pi << ") buffer." << lend;
+                return false;
             }
             // Other error
-            buffer.resize(0);
             lerror << "failed to receive data on udp socket: " << uso << "(" << _pi << "), " << ::strerror( errno ) << lend;
             return false;
         } else if ( _retCode == 0 ) {
             // Peer Close
-            buffer.resize(0);
             lerror << "the peer has close the socket, recv 0" << lend;
             return false;
         } else {
-            _received += _retCode;
-            _leftspace -= _retCode;
-            if ( _leftspace > 0 ) {
-                // Unfull
-                buffer.resize(_received);
-                return true;
-            } else {
-                // The buffer is full, try to double the buffer and try again
-                if ( min_buffer_size * 2 <= buffer.max_size() ) {
-                    min_buffer_size *= 2;
-                } else if ( min_buffer_size < buffer.max_size() ) {
-                    min_buffer_size = buffer.max_size();
-                } else {
-                    return true;    // direct return, wait for next read.
-                }
-                // Resize the buffer and try to read again
-                _leftspace = min_buffer_size - _received;
-                buffer.resize(min_buffer_size);
-            }
+            return (_retCode == up_to_bytes);
         }
     } while ( true );
-    return true;
+    return false;
 }
+
 /*
-    Read data from the UDP socket until limit bytes.
+    Listen on a UDP port and wait for any incoming data.
 
-    If limit_bytes is 0, is the same as sl_udp_socket_read
+    @Description
+    As a UDP socket is connectionless, the only different between
+    listen and monitor is 'listen' will auto re-monitor the socket
+    after a data incoming message has been processed.
 */
-bool sl_udp_socket_read_limit(
+void sl_udp_socket_listen(
+    SOCKET_T uso, 
+    sl_socket_event_handler accept_callback
+)
+{
+    if ( SOCKET_NOT_VALIDATE(uso) ) return;
+
+    auto _listen_callback = [=](sl_event e) {
+        lerror << "UDP socket " << e.so << " fetch unexcepted event: " << e << lend;
+        // Re-monitor
+        sl_udp_socket_listen(uso, accept_callback);
+    };
+    // Force to update the failed & timeout handler
+    sl_events::server().update_handler(uso, SL_EVENT_FAILED | SL_EVENT_TIMEOUT, _listen_callback);
+
+    // Monitor the read event
+    sl_socket_monitor(uso, 0, [=](sl_event e) {
+        if ( accept_callback ) accept_callback(e);
+        #if DEBUG
+        ldebug << "after udp socket " << uso << " accept callback, try to re-listen it" << lend;
+        #endif
+        sl_udp_socket_listen(uso, accept_callback);
+    });
+}
+
+// The batch receiving status of a udp listener, all buffers are reused.
+typedef struct sl_udp_batch_info {
+    size_t                                          batch_size;
+    vector< sl_buffer_chunk * >                     chunks;
+    vector< struct sockaddr_in >                    addrs;
+    vector< struct iovec >                          iovs;
+#if SL_TARGET_LINUX
+    vector< struct mmsghdr >                        msgs;
+#endif
+    // UDP GRO is enabled on the socket, use large chunks and
+    // fetch the segment size from the control message.
+    bool                                            gro;
+    vector< char >                                  controls;
+
+    sl_udp_batch_info(size_t batch) : batch_size(batch), gro(false) { }
+    ~sl_udp_batch_info() {
+        for ( auto _chunk : chunks ) _chunk->release();
+    }
+} sl_udp_batch_info;
+
+// Receive up to batch_size datagrams, return the count of fetched packets,
+// or -1 on error.
+int _raw_internal_udp_socket_recv_batch(
     SOCKET_T uso,
-    struct sockaddr_in addr,
-    string& buffer,
-    size_t limit_bytes
+    sl_udp_batch_info& info,
+    sl_udp_datagrams& datagrams
+)
+{
+    size_t _n = info.batch_size;
+    size_t _chunk_size = (info.gro ? SL_BUFFER_LARGE_CHUNK_SIZE : SL_BUFFER_CHUNK_SIZE);
+    while ( info.chunks.size() < _n ) {
+        info.chunks.push_back(sl_buffer_pool::pool().alloc(_chunk_size));
+    }
+    info.addrs.resize(_n);
+    info.iovs.resize(_n);
+    for ( size_t i = 0; i < _n; ++i ) {
+        info.iovs[i].iov_base = info.chunks[i]->data();
+        info.iovs[i].iov_len = info.chunks[i]->capacity();
+    }
+#if SL_UDP_GSO_SUPPORTED
+    const size_t _control_size = CMSG_SPACE(sizeof(int));
+    if ( info.gro ) info.controls.resize(_control_size * _n);
+#endif
+
+    int _count = 0;
+#if SL_TARGET_LINUX
+    info.msgs.resize(_n);
+    memset(&info.msgs[0], 0, sizeof(struct mmsghdr) * _n);
+    for ( size_t i = 0; i < _n; ++i ) {
+        info.msgs[i].msg_hdr.msg_name = &info.addrs[i];
+        info.msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        info.msgs[i].msg_hdr.msg_iov = &info.iovs[i];
+        info.msgs[i].msg_hdr.msg_iovlen = 1;
+#if SL_UDP_GSO_SUPPORTED
+        if ( info.gro ) {
+            info.msgs[i].msg_hdr.msg_control = &info.controls[_control_size * i];
+            info.msgs[i].msg_hdr.msg_controllen = _control_size;
+        }
+#endif
+    }
+    do {
+        _count = ::recvmmsg(uso, &info.msgs[0], _n, MSG_DONTWAIT, NULL);
+    } while ( _count < 0 && errno == EINTR );
+#else
+    for ( ; _count < (int)_n; ++_count ) {
+        socklen_t _l = sizeof(struct sockaddr_in);
+        int _ret = ::recvfrom(uso, info.iovs[_count].iov_base, info.iovs[_count].iov_len, 
+            0, (struct sockaddr *)&info.addrs[_count], &_l);
+        if ( _ret < 0 && errno == EINTR ) { --_count; continue; }
+        if ( _ret < 0 ) {
+            if ( _count == 0 ) _count = -1;
+            break;
+        }
+        info.iovs[_count].iov_len = _ret;
+    }
+#endif
+    if ( _count < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) return 0;
+        lerror << "failed to receive data on udp socket: " << uso << ", " << ::strerror( errno ) << lend;
+        return -1;
+    }
+
+    for ( int i = 0; i < _count; ++i ) {
+#if SL_TARGET_LINUX
+        if ( info.msgs[i].msg_hdr.msg_flags & MSG_TRUNC ) {
+            lwarning 
+                << "drop a truncated datagram from " << sl_peerinfo(info.addrs[i])
+                << " on udp socket " << uso << lend;
+        } else {
+            sl_udp_datagram _dg;
+            _dg.address = info.addrs[i];
+            _dg.payload = sl_buffer_view(info.chunks[i], 0, info.msgs[i].msg_len);
+            size_t _segment_size = 0;
+#if SL_UDP_GSO_SUPPORTED
+            struct msghdr *_hdr = &info.msgs[i].msg_hdr;
+            for ( struct cmsghdr *_cm = CMSG_FIRSTHDR(_hdr); info.gro && _cm != NULL; _cm = CMSG_NXTHDR(_hdr, _cm) ) {
+                if ( _cm->cmsg_level != SOL_UDP || _cm->cmsg_type != UDP_GRO ) continue;
+                _segment_size = (size_t)(*(int *)CMSG_DATA(_cm));
+            }
+#endif
+            if ( _segment_size == 0 || _segment_size >= _dg.payload.size() ) {
+                datagrams.emplace_back(move(_dg));
+            } else {
+                // Split the merged buffer back to datagrams
+                for ( size_t _offset = 0; _offset < _dg.payload.size(); _offset += _segment_size ) {
+                    sl_udp_datagram _seg;
+                    _seg.address = _dg.address;
+                    _seg.payload = _dg.payload.sub(_offset, _segment_size);
+                    datagrams.emplace_back(move(_seg));
+                }
+            }
+        }
+#else
+        sl_udp_datagram _dg;
+        _dg.address = info.addrs[i];
+        _dg.payload = sl_buffer_view(info.chunks[i], 0, info.iovs[i].iov_len);
+        datagrams.emplace_back(move(_dg));
+#endif
+        // The used chunk is hold by the views, get a new one
+        info.chunks[i]->release();
+        info.chunks[i] = sl_buffer_pool::pool().alloc(_chunk_size);
+    }
+    return _count;
+}
+
+void _raw_internal_udp_socket_listen_batch(
+    SOCKET_T uso,
+    shared_ptr<sl_udp_batch_info> info,
+    sl_udp_batch_handler handler
+)
+{
+    auto _listen_callback = [=](sl_event e) {
+        lerror << "UDP socket " << e.so << " fetch unexcepted event: " << e << lend;
+        // Re-monitor
+        _raw_internal_udp_socket_listen_batch(uso, info, handler);
+    };
+    // Force to update the failed & timeout handler
+    sl_events::server().update_handler(uso, SL_EVENT_FAILED | SL_EVENT_TIMEOUT, _listen_callback);
+
+    // Monitor the read event
+    sl_socket_monitor(uso, 0, [=](sl_event e) {
+        sl_udp_datagrams _datagrams;
+        _datagrams.reserve(info->batch_size);
+        while ( true ) {
+            _datagrams.clear();
+            int _count = _raw_internal_udp_socket_recv_batch(uso, *info, _datagrams);
+            if ( _count <= 0 ) break;
+            if ( handler && _datagrams.size() > 0 ) handler(uso, _datagrams);
+            // The socket buffer has been drained
+            if ( (size_t)_count < info->batch_size ) break;
+        }
+        _raw_internal_udp_socket_listen_batch(uso, info, handler);
+    });
+}
+
+/*
+    Listen on a UDP port and receive the incoming datagrams in batch.
+
+    @Description
+    Each time the socket is readable, will fetch up to <batch_size> 
+    datagrams with recvmmsg into pooled chunks and pass all of them
+    to the handler, then re-monitor the socket.
+*/
+void sl_udp_socket_listen_batch(
+    SOCKET_T uso,
+    sl_udp_batch_handler handler,
+    size_t batch_size
+)
+{
+    if ( SOCKET_NOT_VALIDATE(uso) ) return;
+    if ( batch_size == 0 ) batch_size = 1;
+    shared_ptr<sl_udp_batch_info> _info = make_shared<sl_udp_batch_info>(batch_size);
+#if SL_UDP_GSO_SUPPORTED
+    int _gro = 0;
+    socklen_t _len = sizeof(_gro);
+    if ( 0 == getsockopt(uso, SOL_UDP, UDP_GRO, (char *)&_gro, &_len) ) {
+        _info->gro = (_gro != 0);
+    }
+#endif
+    _raw_internal_udp_socket_listen_batch(uso, _info, handler);
+}
+
+// Global DNS Server List
+vector<sl_peerinfo> _resolv_list;
+
+// DNS Resolver
+// All udp queries are sent via a small pool of udp sockets, each query 
+// gets a random transaction id, and the response is matched by the socket,
+// the id, the source and the question. A socket is retired after some 
+// queries or seconds, and closed once its pending queries are done, so 
+// the source ports keep changing.
+typedef std::function<void(bool, const sl_dns_packet&)> sl_dns_reply_handler;
+
+typedef struct {
+    uint16_t                    origin_id;
+    string                      question;
+    sl_peerinfo                 nameserver;
+    uint64_t                    serial;
+    sl_dns_reply_handler        handler;
+} sl_dns_pending_query;
+
+typedef struct {
+    string                      key;
+    size_t                      queries;
+    size_t                      pending;
+    bool                        retired;
+    steady_clock::time_point    created;
+} sl_dns_resolver_socket_info;
+
+mutex _g_dns_resolver_mutex;
+// The resolver sockets, keyed by the connected nameserver, or an empty
+// key for the sockets shared by all nameservers.
+map<string, vector<SOCKET_T>> _g_dns_resolver_sockets;
+// All open resolver sockets, include the retired ones
+unordered_map<SOCKET_T, sl_dns_resolver_socket_info> _g_dns_resolver_socket_info;
+// Pending queries, keyed by (socket << 16 | transaction id)
+unordered_map<uint64_t, sl_dns_pending_query> _g_dns_pending_map;
+uint64_t _g_dns_query_serial = 0;
+size_t _g_dns_resolver_socket_count = SL_DNS_RESOLVER_UDP_SOCKETS;
+bool _g_dns_resolver_connect = false;
+size_t _g_dns_resolver_max_queries = SL_DNS_RESOLVER_MAX_QUERIES;
+uint32_t _g_dns_resolver_max_age = SL_DNS_RESOLVER_MAX_AGE;
+uint16_t _g_dns_edns_payload_size = SL_DNS_EDNS_PAYLOAD_SIZE;
+mt19937 _g_dns_random((random_device())());
+
+// Random transaction id of a new query
+uint16_t _raw_internal_dns_random_id()
+{
+    lock_guard<mutex> _(_g_dns_resolver_mutex);
+    return (uint16_t)(_g_dns_random() & 0xFFFF);
+}
+
+// Copy the question section of the packet in lower case, the name in a
+// question should not be compressed.
+bool _raw_internal_dns_question(const string& pkt, string& question)
+{
+    sl_dns_view _view(pkt);
+    auto _it = _view.records();
+    sl_dns_rr _rr;
+    if ( !_it.next(_rr) || _rr.section != sl_dns_section_question ) return false;
+    // The name, type and class, only the name is case insensitive
+    question.assign(pkt, _rr.name_offset, _rr.rdata_offset - _rr.name_offset);
+    sl_dns_name_tolower(question.begin(), question.end() - 4);
+    return true;
+}
+
+// Fail all pending queries on the broken resolver socket, and remove it
+void _raw_internal_dns_resolver_fail(SOCKET_T so)
+{
+    vector<sl_dns_reply_handler> _handlers;
+    do {
+        lock_guard<mutex> _(_g_dns_resolver_mutex);
+        auto _iit = _g_dns_resolver_socket_info.find(so);
+        if ( _iit != end(_g_dns_resolver_socket_info) ) {
+            auto &_sockets = _g_dns_resolver_sockets[_iit->second.key];
+            _sockets.erase(std::remove(begin(_sockets), end(_sockets), so), end(_sockets));
+            _g_dns_resolver_socket_info.erase(_iit);
+        }
+        for ( auto _pit = begin(_g_dns_pending_map); _pit != end(_g_dns_pending_map); ) {
+            if ( (SOCKET_T)(_pit->first >> 16) != so ) {
+                ++_pit;
+                continue;
+            }
+            _handlers.emplace_back(move(_pit->second.handler));
+            _pit = _g_dns_pending_map.erase(_pit);
+        }
+    } while ( false );
+    sl_socket_close(so);
+    sl_dns_packet _empty;
+    for ( auto &_h : _handlers ) {
+        if ( _h ) _h(false, _empty);
+    }
+}
+
+// Check if the resolver socket has sent enough queries or lived long enough
+bool _raw_internal_dns_resolver_worn(
+    const sl_dns_resolver_socket_info& info, 
+    steady_clock::time_point now
+)
+{
+    if ( _g_dns_resolver_max_queries > 0 && info.queries >= _g_dns_resolver_max_queries ) {
+        return true;
+    }
+    return (_g_dns_resolver_max_age > 0 &&
+        duration_cast<seconds>(now - info.created).count() >= _g_dns_resolver_max_age);
+}
+
+// A pending query on the resolver socket is done, return true if the 
+// socket is worn out and idle, and should be closed now. The socket is
+// usually closed here by the reading thread after its last response.
+// Must lock _g_dns_resolver_mutex before invoking this method.
+bool _raw_internal_dns_resolver_done(SOCKET_T so)
+{
+    auto _iit = _g_dns_resolver_socket_info.find(so);
+    if ( _iit == end(_g_dns_resolver_socket_info) ) return false;
+    auto &_info = _iit->second;
+    if ( _info.pending > 0 ) _info.pending -= 1;
+    if ( _info.pending > 0 ) return false;
+    if ( !_info.retired ) {
+        if ( !_raw_internal_dns_resolver_worn(_info, steady_clock::now()) ) return false;
+        auto &_sockets = _g_dns_resolver_sockets[_info.key];
+        _sockets.erase(std::remove(begin(_sockets), end(_sockets), so), end(_sockets));
+    }
+    _g_dns_resolver_socket_info.erase(_iit);
+    return true;
+}
+
+// Read all incoming responses on the resolver socket, return false if
+// the socket has been retired and closed.
+bool _raw_internal_dns_resolver_read(SOCKET_T so)
+{
+    while ( true ) {
+        struct sockaddr_in _addr;
+        sl_buffer_view _payload;
+        if ( !sl_udp_socket_recv(so, _addr, _payload) ) break;
+        if ( _payload.size() == 0 ) break;
+        string _pkt(_payload.data(), _payload.size());
+        _payload.release();
+        if ( _pkt.size() < sizeof(uint16_t) * 6 ) continue;
+
+        sl_dns_packet _resp(_pkt);
+        string _question;
+        if ( !_raw_internal_dns_question(_pkt, _question) ) continue;
+        uint64_t _key = ((uint64_t)so << 16) | _resp.get_transaction_id();
+        sl_dns_pending_query _query;
+        bool _close = false;
+        do {
+            lock_guard<mutex> _(_g_dns_resolver_mutex);
+            auto _pit = _g_dns_pending_map.find(_key);
+            if ( _pit == end(_g_dns_pending_map) ) break;
+            // Drop the spoofed or late response
+            if ( (uint32_t)_pit->second.nameserver.ipaddress != _addr.sin_addr.s_addr ||
+                _pit->second.nameserver.port_number != ntohs(_addr.sin_port) ||
+                _pit->second.question != _question ) break;
+            _query = move(_pit->second);
+            _g_dns_pending_map.erase(_pit);
+            _close = _raw_internal_dns_resolver_done(so);
+        } while ( false );
+        if ( _close ) sl_socket_close(so);
+        if ( _query.handler ) {
+            _resp.set_transaction_id(_query.origin_id);
+            _query.handler(true, _resp);
+        }
+        if ( _close ) return false;
+    }
+    return true;
+}
+
+// Keep reading on the resolver socket
+void _raw_internal_dns_resolver_listen(SOCKET_T so)
+{
+    sl_socket_monitor(so, 0, [](sl_event e) {
+        if ( !_raw_internal_dns_resolver_read(e.so) ) return;
+        _raw_internal_dns_resolver_listen(e.so);
+    });
+}
+
+// Get a resolver socket for the nameserver, create a new one if the pool
+// is not full. The worn out sockets are removed from the pool first, the
+// idle ones among them are put in <retired> for the caller to close.
+// Must lock _g_dns_resolver_mutex before invoking this method.
+SOCKET_T _raw_internal_dns_resolver_socket(
+    const sl_peerinfo& nameserver, 
+    vector<SOCKET_T>& retired
+)
+{
+    string _key = _g_dns_resolver_connect ? nameserver.operator const string() : string();
+    auto &_sockets = _g_dns_resolver_sockets[_key];
+    auto _now = steady_clock::now();
+    for ( auto _sit = begin(_sockets); _sit != end(_sockets); ) {
+        auto &_info = _g_dns_resolver_socket_info[*_sit];
+        if ( !_raw_internal_dns_resolver_worn(_info, _now) ) {
+            ++_sit;
+            continue;
+        }
+        _info.retired = true;
+        if ( _info.pending == 0 ) {
+            retired.push_back(*_sit);
+            _g_dns_resolver_socket_info.erase(*_sit);
+        }
+        _sit = _sockets.erase(_sit);
+    }
+    if ( _sockets.size() >= max(_g_dns_resolver_socket_count, (size_t)1) ) {
+        return _sockets[_g_dns_random() % _sockets.size()];
+    }
+
+    // Bind to port 0, the system will choose a random source port
+    SOCKET_T _so = sl_udp_socket_init();
+    if ( SOCKET_NOT_VALIDATE(_so) ) {
+        return _sockets.size() > 0 ? _sockets[_g_dns_random() % _sockets.size()] : _so;
+    }
+    if ( _g_dns_resolver_connect ) {
+        // Only the nameserver can send data to a connected socket, and
+        // the ICMP errors will be reported on it.
+        struct sockaddr_in _addr = {};
+        _addr.sin_family = AF_INET;
+        _addr.sin_addr.s_addr = nameserver.ipaddress;
+        _addr.sin_port = htons(nameserver.port_number);
+        if ( -1 == ::connect(_so, (struct sockaddr *)&_addr, sizeof(_addr)) ) {
+            lerror << "failed to connect the resolver socket to " << nameserver 
+                << ": " << ::strerror(errno) << lend;
+            sl_socket_close(_so);
+            return INVALIDATE_SOCKET;
+        }
+    }
+    sl_events::server().update_handler(_so, SL_EVENT_FAILED, [](sl_event e) {
+        // A stale event of a closed resolver socket may arrive after its fd 
+        // has been reused, only fail the socket with a pending error.
+        int _error = 0, _len = sizeof(int);
+        getsockopt(e.so, SOL_SOCKET, SO_ERROR, (char *)&_error, (socklen_t *)&_len);
+        if ( _error == 0 ) {
+            _raw_internal_dns_resolver_listen(e.so);
+            return;
+        }
+        _raw_internal_dns_resolver_fail(e.so);
+    });
+    _sockets.push_back(_so);
+    _g_dns_resolver_socket_info[_so] = { _key, 0, 0, false, _now };
+    _raw_internal_dns_resolver_listen(_so);
+    return _so;
+}
+
+// Send the query via the resolver, the handler will be invoked with the
+// response, or failed after <timedout> milliseconds.
+void _raw_internal_dns_udp_query(
+    const sl_dns_packet& query_pkt,
+    const sl_peerinfo& nameserver,
+    uint32_t timedout,
+    sl_dns_reply_handler handler
+)
+{
+    sl_dns_packet _empty;
+    string _question;
+    if ( !_raw_internal_dns_question(query_pkt.str(), _question) ) {
+        handler(false, _empty);
+        return;
+    }
+
+    sl_dns_packet _pkt(query_pkt);
+    SOCKET_T _so = INVALIDATE_SOCKET;
+    uint64_t _key = 0, _serial = 0;
+    bool _connected = false;
+    vector<SOCKET_T> _retired;
+    do {
+        lock_guard<mutex> _(_g_dns_resolver_mutex);
+        _connected = _g_dns_resolver_connect;
+        _so = _raw_internal_dns_resolver_socket(nameserver, _retired);
+        if ( SOCKET_NOT_VALIDATE(_so) ) break;
+        // Find an unused transaction id on the socket
+        uint16_t _id = 0;
+        for ( int i = 0; i < 16; ++i ) {
+            _id = (uint16_t)(_g_dns_random() & 0xFFFF);
+            _key = ((uint64_t)_so << 16) | _id;
+            if ( _g_dns_pending_map.find(_key) == end(_g_dns_pending_map) ) break;
+            _key = 0;
+        }
+        if ( _key == 0 ) {
+            _so = INVALIDATE_SOCKET;
+            break;
+        }
+        _serial = ++_g_dns_query_serial;
+        _g_dns_pending_map[_key] = { 
+            query_pkt.get_transaction_id(), _question, nameserver, _serial, handler 
+        };
+        auto &_info = _g_dns_resolver_socket_info[_so];
+        _info.queries += 1;
+        _info.pending += 1;
+        _pkt.set_transaction_id(_id);
+    } while ( false );
+    for ( auto _rso : _retired ) sl_socket_close(_rso);
+    if ( SOCKET_NOT_VALIDATE(_so) ) {
+        handler(false, _empty);
+        return;
+    }
+
+    // Remove the query and return its handler if it is still pending
+    auto _take = [_so, _key, _serial]() {
+        sl_dns_reply_handler _h;
+        bool _close = false;
+        do {
+            lock_guard<mutex> _(_g_dns_resolver_mutex);
+            auto _pit = _g_dns_pending_map.find(_key);
+            if ( _pit == end(_g_dns_pending_map) ) break;
+            if ( _pit->second.serial != _serial ) break;
+            _h = move(_pit->second.handler);
+            _g_dns_pending_map.erase(_pit);
+            _close = _raw_internal_dns_resolver_done(_so);
+        } while ( false );
+        if ( _close ) sl_socket_close(_so);
+        return _h;
+    };
+
+    struct sockaddr_in _addr = {};
+    _addr.sin_family = AF_INET;
+    _addr.sin_addr.s_addr = nameserver.ipaddress;
+    _addr.sin_port = htons(nameserver.port_number);
+    ssize_t _ret = 0;
+    if ( _connected ) {
+        _ret = ::send(_so, _pkt.str().c_str(), _pkt.size(), 0);
+    } else {
+        _ret = ::sendto(_so, _pkt.str().c_str(), _pkt.size(), 0, 
+            (struct sockaddr *)&_addr, sizeof(_addr));
+    }
+    if ( _ret < 0 ) {
+        lerror << "failed to send dns query to " << nameserver << ": " << ::strerror(errno) << lend;
+        auto _h = _take();
+        if ( _h ) _h(false, _empty);
+        return;
+    }
+
+    sl_events::server().add_timer(timedout, [_take]() {
+        auto _h = _take();
+        if ( _h ) _h(false, sl_dns_packet());
+    });
+}
+
+/*
+    Set up the dns resolver
+*/
+void sl_dns_resolver_setup(
+    size_t udp_sockets, 
+    bool connect_upstream, 
+    uint16_t edns_payload_size,
+    size_t max_queries,
+    uint32_t max_age
+)
+{
+    lock_guard<mutex> _(_g_dns_resolver_mutex);
+    _g_dns_resolver_socket_count = udp_sockets;
+    _g_dns_resolver_connect = connect_upstream;
+    _g_dns_edns_payload_size = edns_payload_size;
+    _g_dns_resolver_max_queries = max_queries;
+    _g_dns_resolver_max_age = max_age;
+}
+
+// Timeout of a udp query to one nameserver, in milliseconds
+#define SL_DNS_QUERY_TIMEOUT            1000
+// The delay before racing the next nameserver, in milliseconds. The delay
+// is twice the smoothed RTT of the current one, clamped in [min, timeout],
+// and the default delay is used for a nameserver without any RTT sample.
+#define SL_DNS_RACE_MIN_DELAY           20
+#define SL_DNS_RACE_DEFAULT_DELAY       200
+
+// RTT and failure rate of each nameserver
+mutex _g_dns_upstream_mutex;
+unordered_map<string, sl_dns_upstream_stat> _g_dns_upstream_map;
+
+// Update the statistic of the nameserver with the result of a query
+void _raw_internal_dns_upstream_update(const sl_peerinfo& nameserver, bool ok, uint32_t rtt)
+{
+    lock_guard<mutex> _(_g_dns_upstream_mutex);
+    auto &_stat = _g_dns_upstream_map[nameserver.operator const string()];
+    // EWMA with 1/8 gain, like the tcp srtt
+    if ( ok ) {
+        _stat.srtt = (_stat.samples == 0) ? rtt : (_stat.srtt * 7 + rtt) / 8;
+        _stat.samples += 1;
+    }
+    _stat.fail_rate = (_stat.fail_rate * 7 + (ok ? 0 : 1)) / 8;
+    _stat.queries += 1;
+}
+
+// Expected latency of the nameserver, a failed query costs a timeout
+double _raw_internal_dns_upstream_score(const sl_dns_upstream_stat& stat)
+{
+    return (1 - stat.fail_rate) * stat.srtt + stat.fail_rate * SL_DNS_QUERY_TIMEOUT;
+}
+
+/*
+    Get the statistic of a nameserver
+*/
+sl_dns_upstream_stat sl_dns_upstream_stats(const sl_peerinfo& nameserver)
+{
+    lock_guard<mutex> _(_g_dns_upstream_mutex);
+    auto _sit = _g_dns_upstream_map.find(nameserver.operator const string());
+    if ( _sit == end(_g_dns_upstream_map) ) return sl_dns_upstream_stat();
+    return _sit->second;
+}
+
+// Order the nameservers from <use_index> by their expected latency, the
+// nameservers without any statistic keep their order at the front, so 
+// they will be measured.
+vector<sl_peerinfo> _raw_internal_dns_upstream_order(
+    const vector<sl_peerinfo>& nameserver_list, 
+    size_t use_index
+)
+{
+    vector< pair<double, sl_peerinfo> > _scored;
+    do {
+        lock_guard<mutex> _(_g_dns_upstream_mutex);
+        for ( size_t i = use_index; i < nameserver_list.size(); ++i ) {
+            auto _sit = _g_dns_upstream_map.find(nameserver_list[i].operator const string());
+            double _score = (_sit == end(_g_dns_upstream_map) || _sit->second.queries == 0) ?
+                -1 : _raw_internal_dns_upstream_score(_sit->second);
+            _scored.emplace_back(_score, nameserver_list[i]);
+        }
+    } while ( false );
+    std::stable_sort(begin(_scored), end(_scored), 
+        [](const pair<double, sl_peerinfo>& l, const pair<double, sl_peerinfo>& r) {
+            return l.first < r.first;
+        });
+    vector<sl_peerinfo> _ordered;
+    for ( auto &_s : _scored ) _ordered.emplace_back(_s.second);
+    return _ordered;
+}
+
+// The delay before racing the next nameserver
+uint32_t _raw_internal_dns_race_delay(const sl_peerinfo& nameserver)
+{
+    lock_guard<mutex> _(_g_dns_upstream_mutex);
+    auto _sit = _g_dns_upstream_map.find(nameserver.operator const string());
+    if ( _sit == end(_g_dns_upstream_map) || _sit->second.samples == 0 ) {
+        return SL_DNS_RACE_DEFAULT_DELAY;
+    }
+    uint32_t _delay = (uint32_t)(_sit->second.srtt * 2);
+    return max((uint32_t)SL_DNS_RACE_MIN_DELAY, min((uint32_t)SL_DNS_QUERY_TIMEOUT, _delay));
+}
+
+// Check if the response can be accepted, or should try another nameserver
+typedef std::function<bool(const sl_dns_packet&)>  sl_dns_reply_checker;
+// Invoked with the first accepted response and the nameserver it comes
+// from, or failed with the last rejected response when all nameservers 
+// have failed, the response is an empty query packet if no one answered.
+typedef std::function<void(bool, const sl_dns_packet&, const sl_peerinfo&)> sl_dns_race_handler;
+
+typedef struct {
+    mutex                   locker;
+    sl_dns_packet           query_pkt;
+    vector<sl_peerinfo>     nameserver_list;
+    size_t                  next_index;
+    size_t                  pending;
+    bool                    done;
+    sl_dns_packet           last_reply;
+    sl_dns_reply_checker    checker;
+    sl_dns_race_handler     handler;
+} sl_dns_race_info;
+
+void _raw_internal_dns_race_launch(shared_ptr<sl_dns_race_info> race);
+
+// Process the result of a query to a nameserver in the race
+void _raw_internal_dns_race_result(
+    shared_ptr<sl_dns_race_info> race, 
+    const sl_peerinfo& nameserver,
+    bool ok, 
+    bool accepted,
+    const sl_dns_packet& resp
+)
+{
+    bool _launch_next = false, _all_failed = false;
+    sl_dns_packet _last_reply;
+    do {
+        lock_guard<mutex> _(race->locker);
+        race->pending -= 1;
+        if ( race->done ) return;
+        if ( accepted ) {
+            race->done = true;
+            break;
+        }
+        if ( ok ) race->last_reply = resp;
+        // Try the next nameserver at once
+        if ( race->next_index < race->nameserver_list.size() ) {
+            _launch_next = true;
+        } else if ( race->pending == 0 ) {
+            race->done = true;
+            _all_failed = true;
+            _last_reply = race->last_reply;
+        }
+    } while ( false );
+    if ( accepted ) {
+        race->handler(true, resp, nameserver);
+    } else if ( _launch_next ) {
+        _raw_internal_dns_race_launch(race);
+    } else if ( _all_failed ) {
+        race->handler(false, _last_reply, sl_peerinfo::nan());
+    }
+}
+
+// Send the query to the next nameserver, and race the one after it if
+// there is no answer after the delay.
+void _raw_internal_dns_race_launch(shared_ptr<sl_dns_race_info> race)
+{
+    sl_peerinfo _nameserver;
+    size_t _index = 0;
+    do {
+        lock_guard<mutex> _(race->locker);
+        if ( race->done ) return;
+        if ( race->next_index >= race->nameserver_list.size() ) return;
+        _nameserver = race->nameserver_list[race->next_index];
+        race->next_index += 1;
+        race->pending += 1;
+        _index = race->next_index;
+    } while ( false );
+
+    auto _start = steady_clock::now();
+    sl_events::server().add_timer(_raw_internal_dns_race_delay(_nameserver), [race, _index]() {
+        // Still no answer, and no other nameserver has been tried
+        bool _race_next = false;
+        do {
+            lock_guard<mutex> _(race->locker);
+            _race_next = (!race->done && race->next_index == _index);
+        } while ( false );
+        if ( _race_next ) _raw_internal_dns_race_launch(race);
+    });
+    _raw_internal_dns_udp_query(race->query_pkt, _nameserver, SL_DNS_QUERY_TIMEOUT,
+        [race, _nameserver, _start](bool ok, const sl_dns_packet& resp) {
+        uint32_t _rtt = (uint32_t)duration_cast<milliseconds>(steady_clock::now() - _start).count();
+        // A rejected response counts as a failure of the nameserver
+        bool _accepted = ok && (!race->checker || race->checker(resp));
+        _raw_internal_dns_upstream_update(_nameserver, _accepted, _rtt);
+        _raw_internal_dns_race_result(race, _nameserver, ok, _accepted, resp);
+    });
+}
+
+// Race the query on the nameservers from <use_index>, fastest first
+void _raw_internal_dns_race(
+    const sl_dns_packet& query_pkt,
+    const vector<sl_peerinfo>& nameserver_list,
+    size_t use_index,
+    sl_dns_reply_checker checker,
+    sl_dns_race_handler handler
 )
 {
-    if ( SOCKET_NOT_VALIDATE(uso) ) return false;
+    auto _race = make_shared<sl_dns_race_info>();
+    _race->query_pkt = query_pkt;
+    _race->nameserver_list = _raw_internal_dns_upstream_order(nameserver_list, use_index);
+    _race->next_index = 0;
+    _race->pending = 0;
+    _race->done = false;
+    _race->checker = checker;
+    _race->handler = handler;
+    if ( _race->nameserver_list.size() == 0 ) {
+        handler(false, sl_dns_packet(), sl_peerinfo::nan());
+        return;
+    }
+    _raw_internal_dns_race_launch(_race);
+}
+
+// Timeout to connect a pipelined tcp connection, in seconds
+#define SL_DNS_TCP_CONNECT_TIMEOUT      5
+
+// A query on a pipelined tcp connection
+typedef struct {
+    sl_dns_pending_query        query;
+    bool                        sent;
+} sl_dns_tcp_query;
+
+// A query waiting for a free slot of the connection
+typedef struct {
+    uint16_t                    id;
+    uint64_t                    serial;
+    string                      packet;
+} sl_dns_tcp_waiting;
+
+// Persistent tcp connection to a nameserver, directly or via a socks5 
+// proxy. Many queries are sent on it at once with random transaction ids,
+// and the responses are matched by the id and the question in any order.
+typedef struct {
+    string                                      key;
+    SOCKET_T                                    so;
+    bool                                        connected;
+    bool                                        closed;
+    shared_ptr<sl_frame_length_decoder>         decoder;
+    // All queries on the connection, keyed by the transaction id on wire
+    unordered_map<uint16_t, sl_dns_tcp_query>   queries;
+    list<sl_dns_tcp_waiting>                    waiting;
+    // Count of the sent queries without response
+    size_t                                      inflight;
+    // Last time of sending a query or reading a response
+    steady_clock::time_point                    last_active;
+} sl_dns_tcp_conn;
+
+mutex _g_dns_tcp_mutex;
+map<string, vector<shared_ptr<sl_dns_tcp_conn>>> _g_dns_tcp_conns;
+uint64_t _g_dns_tcp_serial = 0;
+size_t _g_dns_tcp_max_inflight = SL_DNS_TCP_MAX_INFLIGHT;
+uint32_t _g_dns_tcp_idle_timeout = SL_DNS_TCP_IDLE_TIMEOUT;
+size_t _g_dns_tcp_max_connections = SL_DNS_TCP_MAX_CONNECTIONS;
+
+/*
+    Set up the pipelined dns-over-tcp connections
+*/
+void sl_dns_tcp_setup(size_t max_inflight, uint32_t idle_timeout, size_t max_connections)
+{
+    lock_guard<mutex> _(_g_dns_tcp_mutex);
+    _g_dns_tcp_max_inflight = max(max_inflight, (size_t)1);
+    _g_dns_tcp_idle_timeout = idle_timeout;
+    _g_dns_tcp_max_connections = max(max_connections, (size_t)1);
+}
+
+// Remove the connection and fail all its queries. If <only_idle> is true,
+// the connection with any query will be kept, and return false.
+bool _raw_internal_dns_tcp_close(shared_ptr<sl_dns_tcp_conn> conn, bool only_idle = false)
+{
+    vector<sl_dns_reply_handler> _handlers;
+    SOCKET_T _so = INVALIDATE_SOCKET;
+    do {
+        lock_guard<mutex> _(_g_dns_tcp_mutex);
+        if ( conn->closed ) return true;
+        if ( only_idle && conn->queries.size() > 0 ) return false;
+        conn->closed = true;
+        _so = conn->so;
+        auto _cit = _g_dns_tcp_conns.find(conn->key);
+        if ( _cit != end(_g_dns_tcp_conns) ) {
+            auto &_conns = _cit->second;
+            _conns.erase(std::remove(begin(_conns), end(_conns), conn), end(_conns));
+            if ( _conns.size() == 0 ) _g_dns_tcp_conns.erase(_cit);
+        }
+        for ( auto &_q : conn->queries ) {
+            _handlers.emplace_back(move(_q.second.query.handler));
+        }
+        conn->queries.clear();
+        conn->waiting.clear();
+        conn->inflight = 0;
+    } while ( false );
+    if ( !SOCKET_NOT_VALIDATE(_so) ) sl_socket_close(_so);
+    for ( auto &_h : _handlers ) {
+        if ( _h ) _h(false, sl_dns_packet());
+    }
+    return true;
+}
+
+// Take the waiting queries into the free slots of the connection, the
+// lock must be held.
+vector<string> _raw_internal_dns_tcp_take_waiting(shared_ptr<sl_dns_tcp_conn> conn)
+{
+    vector<string> _packets;
+    if ( !conn->connected || conn->closed ) return _packets;
+    while ( conn->waiting.size() > 0 && conn->inflight < _g_dns_tcp_max_inflight ) {
+        sl_dns_tcp_waiting _w = move(conn->waiting.front());
+        conn->waiting.pop_front();
+        auto _qit = conn->queries.find(_w.id);
+        // The query has timedout
+        if ( _qit == end(conn->queries) || _qit->second.query.serial != _w.serial ) continue;
+        _qit->second.sent = true;
+        conn->inflight += 1;
+        _packets.emplace_back(move(_w.packet));
+    }
+    return _packets;
+}
+
+// Send the queries in one batch
+void _raw_internal_dns_tcp_send(SOCKET_T so, const vector<string>& packets)
+{
+    if ( packets.size() == 0 || SOCKET_NOT_VALIDATE(so) ) return;
+    sl_tcp_socket_begin_batch(so);
+    for ( auto &_pkt : packets ) {
+        sl_tcp_socket_send(so, _pkt);
+    }
+    sl_tcp_socket_end_batch(so);
+}
+
+void _raw_internal_dns_tcp_listen(shared_ptr<sl_dns_tcp_conn> conn);
+
+// Read the responses on the connection, and send the waiting queries
+void _raw_internal_dns_tcp_read(shared_ptr<sl_dns_tcp_conn> conn, SOCKET_T so)
+{
+    vector< pair<sl_dns_reply_handler, sl_dns_packet> > _replies;
+    bool _ok = sl_tcp_socket_read_frames(so, *conn->decoder, [&](const sl_buffer_view &frame) {
+        string _pkt(frame.data(), frame.size());
+        string _question;
+        if ( !_raw_internal_dns_question(_pkt, _question) ) return;
+        sl_dns_packet _resp(_pkt);
+        lock_guard<mutex> _(_g_dns_tcp_mutex);
+        auto _qit = conn->queries.find(_resp.get_transaction_id());
+        if ( _qit == end(conn->queries) ) return;
+        if ( _qit->second.query.question != _question ) return;
+        if ( _qit->second.sent ) conn->inflight -= 1;
+        conn->last_active = steady_clock::now();
+        _resp.set_transaction_id(_qit->second.query.origin_id);
+        _replies.emplace_back(move(_qit->second.query.handler), _resp);
+        conn->queries.erase(_qit);
+    });
+    for ( auto &_r : _replies ) {
+        if ( _r.first ) _r.first(true, _r.second);
+    }
+    if ( !_ok ) {
+        _raw_internal_dns_tcp_close(conn);
+        return;
+    }
+    vector<string> _packets;
+    do {
+        lock_guard<mutex> _(_g_dns_tcp_mutex);
+        _packets = _raw_internal_dns_tcp_take_waiting(conn);
+    } while ( false );
+    _raw_internal_dns_tcp_send(so, _packets);
+    _raw_internal_dns_tcp_listen(conn);
+}
+
+// Keep reading on the connection
+void _raw_internal_dns_tcp_listen(shared_ptr<sl_dns_tcp_conn> conn)
+{
+    SOCKET_T _so = INVALIDATE_SOCKET;
+    do {
+        lock_guard<mutex> _(_g_dns_tcp_mutex);
+        if ( conn->closed ) return;
+        _so = conn->so;
+    } while ( false );
+    sl_socket_monitor(_so, 0, [conn](sl_event e) {
+        _raw_internal_dns_tcp_read(conn, e.so);
+    });
+}
+
+// Close the connection after it has no query for <idle_timeout> seconds.
+// The timeout of the socket monitor is shared with the pending writing,
+// so use a timer instead.
+void _raw_internal_dns_tcp_idle_check(shared_ptr<sl_dns_tcp_conn> conn, uint32_t delay)
+{
+    sl_events::server().add_timer(delay, [conn]() {
+        uint32_t _delay = 0;
+        milliseconds _idle_timeout;
+        do {
+            lock_guard<mutex> _(_g_dns_tcp_mutex);
+            if ( conn->closed ) return;
+            _idle_timeout = milliseconds(_g_dns_tcp_idle_timeout * 1000);
+            if ( _idle_timeout.count() == 0 ) return;
+            auto _idle = duration_cast<milliseconds>(steady_clock::now() - conn->last_active);
+            if ( conn->queries.size() > 0 ) {
+                _delay = (uint32_t)_idle_timeout.count();
+            } else if ( _idle < _idle_timeout ) {
+                _delay = (uint32_t)(_idle_timeout - _idle).count();
+            }
+        } while ( false );
+        if ( _delay > 0 ) {
+            _raw_internal_dns_tcp_idle_check(conn, _delay);
+            return;
+        }
+        if ( _raw_internal_dns_tcp_close(conn, true) ) return;
+        // A new query came in just now
+        _raw_internal_dns_tcp_idle_check(conn, (uint32_t)_idle_timeout.count());
+    });
+}
+
+// Connect to the nameserver, and send the waiting queries
+void _raw_internal_dns_tcp_connect(
+    shared_ptr<sl_dns_tcp_conn> conn,
+    const sl_peerinfo& nameserver,
+    const sl_peerinfo& socks5
+)
+{
+    sl_tcp_socket_connect(socks5, nameserver.ipaddress, nameserver.port_number, 
+        SL_DNS_TCP_CONNECT_TIMEOUT, [conn](sl_event e) {
+        if ( e.event != SL_EVENT_CONNECT ) {
+            _raw_internal_dns_tcp_close(conn);
+            return;
+        }
+        vector<string> _packets;
+        uint32_t _idle_timeout = 0;
+        do {
+            lock_guard<mutex> _(_g_dns_tcp_mutex);
+            conn->so = e.so;
+            conn->connected = true;
+            conn->last_active = steady_clock::now();
+            _packets = _raw_internal_dns_tcp_take_waiting(conn);
+            _idle_timeout = _g_dns_tcp_idle_timeout;
+        } while ( false );
+        sl_events::server().update_handler(e.so, SL_EVENT_FAILED, [conn](sl_event e) {
+            _raw_internal_dns_tcp_close(conn);
+        });
+        _raw_internal_dns_tcp_send(e.so, _packets);
+        _raw_internal_dns_tcp_listen(conn);
+        if ( _idle_timeout > 0 ) {
+            _raw_internal_dns_tcp_idle_check(conn, _idle_timeout * 1000);
+        }
+    });
+}
+
+// Send the query via a pipelined tcp connection to the nameserver, the
+// handler will be invoked with false on failed or timedout(in milliseconds)
+void _raw_internal_dns_tcp_query(
+    const sl_dns_packet& query_pkt,
+    const sl_peerinfo& nameserver,
+    const sl_peerinfo& socks5,
+    uint32_t timedout,
+    sl_dns_reply_handler handler
+)
+{
+    string _question;
+    if ( !_raw_internal_dns_question(query_pkt.str(), _question) ) {
+        handler(false, sl_dns_packet());
+        return;
+    }
+    string _key = _raw_internal_tcp_pool_key(socks5, nameserver.ipaddress, nameserver.port_number);
+
+    shared_ptr<sl_dns_tcp_conn> _conn, _new_conn;
+    uint16_t _id = 0;
+    uint64_t _serial = 0;
+    vector<string> _packets;
+    SOCKET_T _so = INVALIDATE_SOCKET;
+    do {
+        lock_guard<mutex> _(_g_dns_tcp_mutex);
+        auto &_conns = _g_dns_tcp_conns[_key];
+        // Use the least loaded connection, or create a new one if all
+        // connections are full.
+        for ( auto &_c : _conns ) {
+            if ( !_conn || _c->queries.size() < _conn->queries.size() ) _conn = _c;
+        }
+        if ( !_conn || (_conn->queries.size() >= _g_dns_tcp_max_inflight && 
+            _conns.size() < _g_dns_tcp_max_connections) ) 
+        {
+            _conn = make_shared<sl_dns_tcp_conn>();
+            _conn->key = _key;
+            _conn->so = INVALIDATE_SOCKET;
+            _conn->connected = false;
+            _conn->closed = false;
+            _conn->decoder = make_shared<sl_frame_length_decoder>(2, true, 65535);
+            _conn->inflight = 0;
+            _conns.push_back(_conn);
+            _new_conn = _conn;
+        }
+        if ( _conn->queries.size() >= 0xFFFF ) break;
+        do {
+            _id = _raw_internal_dns_random_id();
+        } while ( _conn->queries.find(_id) != end(_conn->queries) );
+        _serial = ++_g_dns_tcp_serial;
+
+        sl_dns_tcp_query _query;
+        _query.query.origin_id = query_pkt.get_transaction_id();
+        _query.query.question = _question;
+        _query.query.nameserver = nameserver;
+        _query.query.serial = _serial;
+        _query.query.handler = handler;
+        _query.sent = false;
+        _conn->queries[_id] = move(_query);
+        _conn->last_active = steady_clock::now();
+
+        sl_dns_packet _wire_pkt(query_pkt);
+        _wire_pkt.set_transaction_id(_id);
+        _conn->waiting.push_back({_id, _serial, _wire_pkt.to_tcp_packet()});
+        _packets = _raw_internal_dns_tcp_take_waiting(_conn);
+        _so = _conn->so;
+    } while ( false );
+
+    if ( _serial == 0 ) {
+        handler(false, sl_dns_packet());
+        return;
+    }
+    if ( _new_conn ) {
+        _raw_internal_dns_tcp_connect(_new_conn, nameserver, socks5);
+    } else {
+        _raw_internal_dns_tcp_send(_so, _packets);
+    }
+
+    sl_events::server().add_timer(timedout, [_conn, _id, _serial]() {
+        sl_dns_reply_handler _handler;
+        vector<string> _packets;
+        SOCKET_T _so = INVALIDATE_SOCKET;
+        do {
+            lock_guard<mutex> _(_g_dns_tcp_mutex);
+            auto _qit = _conn->queries.find(_id);
+            if ( _qit == end(_conn->queries) || _qit->second.query.serial != _serial ) return;
+            // The late response will be dropped, and the slot is free now
+            if ( _qit->second.sent ) _conn->inflight -= 1;
+            _handler = move(_qit->second.query.handler);
+            _conn->queries.erase(_qit);
+            _packets = _raw_internal_dns_tcp_take_waiting(_conn);
+            _so = _conn->so;
+        } while ( false );
+        _raw_internal_dns_tcp_send(_so, _packets);
+        if ( _handler ) _handler(false, sl_dns_packet());
+    });
+}
+
+// In-flight queries, all handlers waiting for the same key will be 
+// invoked with the answer of one query.
+mutex _g_dns_flight_mutex;
+unordered_map<string, vector<async_dns_handler>> _g_dns_flight_map;
+
+// Wait for the in-flight query of the key, return true if there is no
+// such query and the caller should send a new one.
+bool _raw_internal_dns_flight_join(const string& key, async_dns_handler fp)
+{
+    lock_guard<mutex> _(_g_dns_flight_mutex);
+    auto _fit = _g_dns_flight_map.find(key);
+    if ( _fit != end(_g_dns_flight_map) ) {
+        _fit->second.emplace_back(fp);
+        return false;
+    }
+    _g_dns_flight_map[key].emplace_back(fp);
+    return true;
+}
 
-    if ( limit_bytes == 0 ) {
-        return sl_udp_socket_read(uso, addr, buffer);
+// Finish the in-flight query of the key and fan out the answer
+void _raw_internal_dns_flight_done(const string& key, const vector<sl_ip>& records)
+{
+    vector<async_dns_handler> _waiters;
+    do {
+        lock_guard<mutex> _(_g_dns_flight_mutex);
+        auto _fit = _g_dns_flight_map.find(key);
+        if ( _fit == end(_g_dns_flight_map) ) return;
+        _waiters.swap(_fit->second);
+        _g_dns_flight_map.erase(_fit);
+    } while ( false );
+    for ( auto& _fp : _waiters ) {
+        if ( _fp ) _fp(records);
     }
-    // Check if the socket has so many data in the buffer
-    if ( ! sl_udp_socket_check_packet(uso, addr, NULL, limit_bytes) ) return false;
-    sl_peerinfo _pi(addr);
+}
 
-    // Socket must be nonblocking
-    buffer.clear();
-    buffer.resize(limit_bytes);
-    size_t _received = 0;
-    size_t _leftspace = limit_bytes;
+// Names to refresh before their cached answers expire, the requests of a
+// name are recorded by the cache hits in sl_dns_cache, so this table is
+// only locked when an answer is cached and when its timer fires.
+typedef struct {
+    string                      host;
+    vector<sl_peerinfo>         nameserver_list;
+    sl_peerinfo                 socks5;
+    steady_clock::time_point    scheduled_at;
+    bool                        scheduled;
+} sl_dns_prefetch_item;
+
+mutex _g_dns_prefetch_mutex;
+unordered_map<string, sl_dns_prefetch_item> _g_dns_prefetch_map;
+double _g_dns_prefetch_ratio = SL_DNS_PREFETCH_RATIO;
+size_t _g_dns_prefetch_max_names = SL_DNS_PREFETCH_MAX_NAMES;
+uint64_t _g_dns_prefetch_count = 0;
+
+void _raw_internal_dns_lookup(
+    const string& key,
+    const string& host,
+    const vector<sl_peerinfo>& nameserver_list,
+    const sl_peerinfo& socks5,
+    async_dns_handler fp
+);
+
+// The name got no answer to cache, forget it unless its refresh timer is
+// still set.
+void _raw_internal_dns_prefetch_forget(const string& key)
+{
+    lock_guard<mutex> _(_g_dns_prefetch_mutex);
+    auto _pit = _g_dns_prefetch_map.find(key);
+    if ( _pit == end(_g_dns_prefetch_map) ) return;
+    if ( _pit->second.scheduled ) return;
+    _g_dns_prefetch_map.erase(_pit);
+}
 
+// The refresh timer of the name, re-resolve it if its cached answer has 
+// been hit after the timer was set, or forget it.
+void _raw_internal_dns_prefetch_fire(const string& key)
+{
+    steady_clock::time_point _hit;
+    bool _cached = sl_dns_cache::server().last_hit(key, _hit);
+    sl_dns_prefetch_item _item;
     do {
-        unsigned _so_len = sizeof(addr);
-        int _retCode = ::recvfrom( 
-            uso, 
-            &buffer[0] + _received, 
-            _leftspace, 
-            0,
-            (struct sockaddr *)&addr, 
-            &_so_len
-        );
-        if ( _retCode < 0 ) {
-            if ( errno == EINTR ) continue;    // signal 7, retry
-            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
-                // No more data on a non-blocking socket
-                buffer.resize(_received);
-                return true;
-            }
-            // Other error
-            buffer.resize(0);
-            lerror << "failed to receive data on udp socket: " << uso << "(" << _pi << "), " << ::strerror( errno ) << lend;
-            return false;
-        } else if ( _retCode == 0 ) {
-            // Peer Close
-            buffer.resize(0);
-            lerror << "the peer has close the socket, recv 0" << lend;
-            return false;
-        } else {
-            _received += _retCode;
-            _leftspace -= _retCode;
+        lock_guard<mutex> _(_g_dns_prefetch_mutex);
+        auto _pit = _g_dns_prefetch_map.find(key);
+        if ( _pit == end(_g_dns_prefetch_map) ) return;
+        _pit->second.scheduled = false;
+        if ( _g_dns_prefetch_ratio <= 0 || !_cached ||
+            _hit < _pit->second.scheduled_at ) {
+            _g_dns_prefetch_map.erase(_pit);
+            return;
         }
-    } while ( _leftspace > 0 );
-    return true;
+        _item = _pit->second;
+        _g_dns_prefetch_count += 1;
+    } while ( false );
+    _raw_internal_dns_lookup(key, _item.host, _item.nameserver_list, _item.socks5, NULL);
 }
 
-/*
-    Read but not fetch the data from the socket buffer.
-
-    if up_to_bytes is 0, will return false.
-*/
-bool sl_udp_socket_check_packet(
-    SOCKET_T uso,
-    struct sockaddr_in addr,
-    char *pbuffer,
-    size_t up_to_bytes
+// Track the name and schedule its refresh after the ratio of the TTL
+void _raw_internal_dns_prefetch_schedule(
+    const string& key, 
+    const string& host,
+    const vector<sl_peerinfo>& nameserver_list,
+    const sl_peerinfo& socks5,
+    uint32_t ttl
 )
 {
-    if ( SOCKET_NOT_VALIDATE(uso) ) return false;
-    sl_peerinfo _pi(addr);
-
+    uint32_t _delay = 0;
     do {
-        unsigned _so_len = sizeof(addr);
-        int _retCode = ::recvfrom( 
-            uso, 
-            pbuffer,
-            up_to_bytes, 
-            MSG_PEEK,
-            (struct sockaddr *)&addr, 
-            &_so_len
-        );
-        if ( _retCode < 0 ) {
-            if ( errno == EINTR ) continue;    // signal 7, retry
-            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
-                // No more data on a non-blocking socket
-                lwarning << "No data in the udp socket: " << uso << "(" << _pi << ") buffer." << lend;
-                return false;
-            }
-            // Other error
-            lerror << "failed to receive data on udp socket: " << uso << "(" << _pi << "), " << ::strerror( errno ) << lend;
-            return false;
-        } else if ( _retCode == 0 ) {
-            // Peer Close
-            lerror << "the peer has close the socket, recv 0" << lend;
-            return false;
-        } else {
-            return (_retCode == up_to_bytes);
+        lock_guard<mutex> _(_g_dns_prefetch_mutex);
+        if ( _g_dns_prefetch_ratio <= 0 ) return;
+        auto _pit = _g_dns_prefetch_map.find(key);
+        if ( _pit == end(_g_dns_prefetch_map) ) {
+            if ( _g_dns_prefetch_map.size() >= _g_dns_prefetch_max_names ) return;
+            sl_dns_prefetch_item _item;
+            _item.host = host;
+            _item.nameserver_list = nameserver_list;
+            _item.socks5 = socks5;
+            _item.scheduled = false;
+            _pit = _g_dns_prefetch_map.emplace(key, move(_item)).first;
         }
-    } while ( true );
-    return false;
+        if ( _pit->second.scheduled ) return;
+        _pit->second.scheduled = true;
+        _pit->second.scheduled_at = steady_clock::now();
+        _delay = (uint32_t)(ttl * 1000 * _g_dns_prefetch_ratio);
+    } while ( false );
+    sl_events::server().add_timer(_delay, [key]() {
+        _raw_internal_dns_prefetch_fire(key);
+    });
 }
 
 /*
-    Listen on a UDP port and wait for any incoming data.
-
-    @Description
-    As a UDP socket is connectionless, the only different between
-    listen and monitor is 'listen' will auto re-monitor the socket
-    after a data incoming message has been processed.
+    Set up the refresh-ahead of the hot names
 */
-void sl_udp_socket_listen(
-    SOCKET_T uso, 
-    sl_socket_event_handler accept_callback
-)
+void sl_dns_prefetch_setup(double ratio, size_t max_names)
 {
-    if ( SOCKET_NOT_VALIDATE(uso) ) return;
+    lock_guard<mutex> _(_g_dns_prefetch_mutex);
+    _g_dns_prefetch_ratio = min(ratio, 1.0);
+    _g_dns_prefetch_max_names = max_names;
+    if ( _g_dns_prefetch_ratio <= 0 ) _g_dns_prefetch_map.clear();
+}
 
-    auto _listen_callback = [=](sl_event e) {
-        lerror << "UDP socket " << e.so << " fetch unexcepted event: " << e << lend;
-        // Re-monitor
-        sl_udp_socket_listen(uso, accept_callback);
-    };
-    // Force to update the failed & timeout handler
-    sl_events::server().update_handler(uso, SL_EVENT_FAILED | SL_EVENT_TIMEOUT, _listen_callback);
+/*
+    Get the count of the refresh queries
+*/
+uint64_t sl_dns_prefetch_count()
+{
+    lock_guard<mutex> _(_g_dns_prefetch_mutex);
+    return _g_dns_prefetch_count;
+}
 
-    // Monitor the read event
-    sl_socket_monitor(uso, 0, [=](sl_event e) {
-        if ( accept_callback ) accept_callback(e);
-        #if DEBUG
-        ldebug << "after udp socket " << uso << " accept callback, try to re-listen it" << lend;
-        #endif
-        sl_udp_socket_listen(uso, accept_callback);
-    });
+// Get the A records in the response and save them to the cache
+vector<sl_ip> _raw_internal_dns_cache_answer(
+    const sl_dns_packet& query_pkt,
+    const vector<sl_peerinfo>& resolv_list,
+    const sl_peerinfo& socks5,
+    const sl_dns_packet& resp_pkt
+)
+{
+    string _key = sl_dns_cache::make_key(
+        query_pkt.get_query_domain(), sl_dns_qtype_host, resolv_list, socks5);
+    uint32_t _ttl = 0;
+    if ( resp_pkt.get_resp_code() == sl_dns_rcode_name_error ) {
+        // The name does not exist, cache the negative answer
+        vector<sl_ip> _records({sl_ip((uint32_t)-1)});
+        if ( resp_pkt.get_negative_ttl(_ttl) ) {
+            sl_dns_cache::server().set_negative(_key, _records, _ttl);
+        }
+        _raw_internal_dns_prefetch_forget(_key);
+        return _records;
+    }
+    vector<sl_ip> _records(move(resp_pkt.get_A_records(_ttl)));
+    uint32_t _cached_ttl = 0;
+    if ( _records.size() > 0 ) {
+        _cached_ttl = sl_dns_cache::server().set(_key, _records, _ttl);
+    } else if ( resp_pkt.get_negative_ttl(_ttl) ) {
+        // No A records of the name
+        sl_dns_cache::server().set_negative(_key, _records, _ttl);
+    }
+    if ( _cached_ttl > 0 ) {
+        _raw_internal_dns_prefetch_schedule(
+            _key, query_pkt.get_query_domain(), resolv_list, socks5, _cached_ttl);
+    } else {
+        _raw_internal_dns_prefetch_forget(_key);
+    }
+    return _records;
 }
 
-// Global DNS Server List
-vector<sl_peerinfo> _resolv_list;
+// All nameservers failed, answer with the expired records in the stale 
+// window, or 255.255.255.255.
+vector<sl_ip> _raw_internal_dns_fail_answer(
+    const sl_dns_packet& query_pkt,
+    const vector<sl_peerinfo>& resolv_list,
+    const sl_peerinfo& socks5
+)
+{
+    string _domain = query_pkt.get_query_domain();
+    string _key = sl_dns_cache::make_key(_domain, sl_dns_qtype_host, resolv_list, socks5);
+    _raw_internal_dns_prefetch_forget(_key);
+    vector<sl_ip> _records;
+    if ( sl_dns_cache::server().get_stale(_key, _records) ) {
+        lwarning << "no more nameserver validated, use the stale answer of " << _domain << lend;
+        return _records;
+    }
+    lwarning << "no more nameserver validated" << lend;
+    return {sl_ip((uint32_t)-1)};
+}
 
 void _raw_internal_async_gethostname_udp(
     const sl_dns_packet && query_pkt,
@@ -1230,65 +3632,39 @@ void _raw_internal_async_gethostname_udp(
 )
 {
     // No other validate resolve ip in the list, return the 255.255.255.255
-    if ( resolv_list.size() == use_index ) {
-        lwarning << "no more nameserver validated" << lend;
-        fp( {sl_ip((uint32_t)-1)} );
+    if ( resolv_list.size() <= use_index ) {
+        fp( _raw_internal_dns_fail_answer(query_pkt, resolv_list, sl_peerinfo::nan()) );
         return;
     }
 
-    // Create a new udp socket and send the query packet.
-    auto _errorfp = [=](sl_event e) {
-        // Assert the event status
-        assert(e.event == SL_EVENT_FAILED || e.event == SL_EVENT_TIMEOUT);
-        if ( e.event == SL_EVENT_TIMEOUT ) {
-            sl_socket_close(e.so);
-        }
-        // Go next server
-        _raw_internal_async_gethostname_udp(
-            move(query_pkt), 
-            move(resolv_list), 
-            use_index + 1,
-            fp
-        );
+    // Race the rest nameservers via the resolver sockets, a response with 
+    // any error other than truncation and NXDOMAIN will try another nameserver.
+    auto _checker = [](const sl_dns_packet& dnspkt) {
+        return dnspkt.get_is_truncation() || 
+            dnspkt.get_resp_code() == sl_dns_rcode_noerr ||
+            dnspkt.get_resp_code() == sl_dns_rcode_name_error;
     };
-
-    SOCKET_T _uso = sl_udp_socket_init(sl_peerinfo::nan(), _errorfp, _errorfp);
-
-    if ( SOCKET_NOT_VALIDATE(_uso) ) {
-        _errorfp(sl_event_make_failed());
-        return;
-    }
-
-    sl_udp_socket_send(_uso, resolv_list[use_index], query_pkt, [=](sl_event e) {
-        sl_socket_monitor(e.so, 1, [=](sl_event e){
-            // Read the incoming packet
-            string _incoming_pkt;
-            bool _ret = sl_udp_socket_read(e.so, e.address, _incoming_pkt);
-            // After reading, whether success or not, close the socket first.
-            sl_socket_close(e.so);
-            if ( !_ret ) {
-                // On Failed, go next
-                e.event = SL_EVENT_FAILED;
-                _errorfp(e);
-                return;
-            }
-
-            sl_dns_packet _dnspkt(move(_incoming_pkt));
-            if ( _dnspkt.get_resp_code() == sl_dns_rcode_noerr ){
-                vector<sl_ip> _retval(move(_dnspkt.get_A_records()));
-                fp( _retval );
-            } else if ( _dnspkt.get_is_truncation() ) {
-                // TRUNC flag get, try to use tcp
-                _raw_internal_async_gethostname_tcp(
-                    move(query_pkt), move(resolv_list), use_index, sl_peerinfo::nan(), fp
-                );
-            } else {
-                // Other error, try next
-                _raw_internal_async_gethostname_udp(
-                    move(query_pkt), move(resolv_list), use_index + 1, fp
-                );
+    _raw_internal_dns_race(query_pkt, resolv_list, use_index, _checker,
+        [=](bool ret, const sl_dns_packet& dnspkt, const sl_peerinfo& nameserver) {
+        if ( !ret ) {
+            fp( _raw_internal_dns_fail_answer(query_pkt, resolv_list, sl_peerinfo::nan()) );
+            return;
+        }
+        if ( dnspkt.get_is_truncation() ) {
+            // TRUNC flag get, try to use tcp on the same server
+            size_t _index = use_index;
+            while ( _index < resolv_list.size() && 
+                resolv_list[_index].operator const string() != nameserver.operator const string() ) {
+                ++_index;
             }
-        });
+            _raw_internal_async_gethostname_tcp(
+                move(query_pkt), move(resolv_list), _index, sl_peerinfo::nan(), fp
+            );
+            return;
+        }
+        vector<sl_ip> _retval(move(_raw_internal_dns_cache_answer(
+            query_pkt, resolv_list, sl_peerinfo::nan(), dnspkt)));
+        fp( _retval );
     });
 }
 
@@ -1301,17 +3677,13 @@ void _raw_internal_async_gethostname_tcp(
 )
 {
     // No other validate resolve ip in the list, return the 255.255.255.255
-    if ( resolv_list.size() == use_index ) {
-        lwarning << "no more nameserver validated" << lend;
-        fp( {sl_ip((uint32_t)-1)} );
+    if ( resolv_list.size() <= use_index ) {
+        fp( _raw_internal_dns_fail_answer(query_pkt, resolv_list, socks5) );
         return;
     }
 
-    // Create a new udp socket and send the query packet.
-    auto _errorfp = [=](sl_event e) {
-        // Assert the event status
-        assert(e.event == SL_EVENT_FAILED || e.event == SL_EVENT_TIMEOUT);
-        // Go next server
+    // Go next server on failed
+    auto _errorfp = [=]() {
         if ( socks5 ) {
             _raw_internal_async_gethostname_tcp(
                 move(query_pkt), move(resolv_list), use_index + 1, socks5, fp
@@ -1323,56 +3695,83 @@ void _raw_internal_async_gethostname_tcp(
         }
     };
 
-    sl_peerinfo _resolv_peer = move(resolv_list[use_index]);
-
-    sl_tcp_socket_connect(socks5, _resolv_peer.ipaddress, _resolv_peer.port_number, 3, [=](sl_event e) {
-        if ( e.event != SL_EVENT_CONNECT ) {
-            _errorfp(e);
+    // Send the query via the pipelined tcp connection
+    _raw_internal_dns_tcp_query(query_pkt, resolv_list[use_index], socks5, 3000, 
+        [=](bool ret, const sl_dns_packet& dnspkt) {
+        if ( !ret ) {
+            _errorfp();
             return;
         }
-
-        // Append error handler to the socket's handler set
-        sl_events::server().append_handler(e.so, SL_EVENT_FAILED, _errorfp);
-        sl_events::server().append_handler(e.so, SL_EVENT_TIMEOUT, [=](sl_event e){
-            sl_socket_close(e.so);
-            _errorfp(e);
-        });
-        sl_tcp_socket_send(e.so, query_pkt.to_tcp_packet(), [=](sl_event e){
-            sl_socket_monitor(e.so, 3, [=](sl_event e){
-                // Read incoming
-                string _tcp_incoming_pkt;
-                bool _ret = sl_tcp_socket_read(e.so, _tcp_incoming_pkt);
-                // After reading, whether success or not, close the socket first.
-                sl_socket_close(e.so);
-                if ( !_ret ) {
-                    // On Failed, go next
-                    e.event = SL_EVENT_FAILED;
-                    _errorfp(e);
-                    return;
-                }
-                sl_dns_packet _dnspkt(move(_tcp_incoming_pkt), true);
-                if ( _dnspkt.get_resp_code() == sl_dns_rcode_noerr ) {
-                    vector<sl_ip> _retval(move(_dnspkt.get_A_records()));
-                    fp( _retval );
-                } else {
-                    // Failed to get the dns result
-                    e.event = SL_EVENT_FAILED;
-                    _errorfp(e);
-                }
-            });
-        });
+        if ( dnspkt.get_resp_code() == sl_dns_rcode_noerr ||
+            dnspkt.get_resp_code() == sl_dns_rcode_name_error ) {
+            vector<sl_ip> _retval(move(_raw_internal_dns_cache_answer(
+                query_pkt, resolv_list, socks5, dnspkt)));
+            fp( _retval );
+        } else {
+            // Failed to get the dns result
+            _errorfp();
+        }
     });
 }
+// Get the answer from the cache, or look it up
+void _raw_internal_async_gethostname(
+    const string& host,
+    const vector<sl_peerinfo>& nameserver_list,
+    const sl_peerinfo& socks5,
+    async_dns_handler fp
+)
+{
+    string _key = sl_dns_cache::make_key(host, sl_dns_qtype_host, nameserver_list, socks5);
+    vector<sl_ip> _records;
+    if ( sl_dns_cache::server().get(_key, _records) ) {
+        if ( fp ) fp(_records);
+        return;
+    }
+    _raw_internal_dns_lookup(_key, host, nameserver_list, socks5, fp);
+}
+
+// Join the in-flight query of the key, or send a new one
+void _raw_internal_dns_lookup(
+    const string& key,
+    const string& host,
+    const vector<sl_peerinfo>& nameserver_list,
+    const sl_peerinfo& socks5,
+    async_dns_handler fp
+)
+{
+    if ( !_raw_internal_dns_flight_join(key, fp) ) return;
+    string _key(key);
+    auto _fanout = [_key](const vector<sl_ip>& records) {
+        _raw_internal_dns_flight_done(_key, records);
+    };
+
+    sl_dns_packet _pkt(_raw_internal_dns_random_id(), host);
+    uint16_t _payload_size = 0;
+    do {
+        lock_guard<mutex> _(_g_dns_resolver_mutex);
+        _payload_size = _g_dns_edns_payload_size;
+    } while ( false );
+    if ( _payload_size > 0 ) _pkt.set_edns(_payload_size);
+    if ( socks5 ) {
+        _raw_internal_async_gethostname_tcp(move(_pkt), move(nameserver_list), 0, socks5, _fanout);
+    } else {
+        _raw_internal_async_gethostname_udp(move(_pkt), move(nameserver_list), 0, _fanout);
+    }
+}
+
 /*!
     Try to get the dns result async
     @Description
     Use async udp/tcp socket to send a dns query request to the domain name server.
-    If has multiple nameserver set in the system, will try all the sever in order
-    till the first have a no-error response.
-    The method will use a UDP socket at first, if the answer is a TC package, then
-    force to send TCP request to the same server again.
-    If the server does not response after timeout(5s), will try to use the next
-    server in the list.
+    The nameservers are ordered by their measured latency and failure rate,
+    the query is sent via udp to the fastest one first, and if it has not
+    answered after twice its smoothed RTT(clamped in 20ms - 1s, 200ms for a
+    server without any sample), the next one is raced at the same time.
+    Each udp query times out after 1s. The first no-error or NXDOMAIN 
+    answer wins, a NXDOMAIN is final and will not be retried on other 
+    servers, any other error counts as a failure of the server.
+    If the answer is a TC package, then force to send TCP request to the
+    same server again.
     If all server failed to answer the query, then will return 255.255.255.255 
     as the IP address of the host to query in the result.
 
@@ -1391,13 +3790,7 @@ void sl_async_gethostname(const string& host, async_dns_handler fp)
             // ldebug << "resolv get dns: " << _pi << lend;
         }
     }
-    auto _now = system_clock::now();
-    auto _time_point = _now.time_since_epoch();
-    _time_point -= duration_cast<seconds>(_time_point); 
-    auto _ms = static_cast<unsigned>(_time_point / milliseconds(1));
-
-    sl_dns_packet _pkt((uint16_t)_ms, host);
-    _raw_internal_async_gethostname_udp(move(_pkt), move(_resolv_list), 0, fp);
+    _raw_internal_async_gethostname(host, _resolv_list, sl_peerinfo::nan(), fp);
 }
 /*
     Try to get the dns result async via specified name servers
@@ -1408,13 +3801,7 @@ void sl_async_gethostname(
     async_dns_handler fp
 )
 {
-    auto _now = system_clock::now();
-    auto _time_point = _now.time_since_epoch();
-    _time_point -= duration_cast<seconds>(_time_point); 
-    auto _ms = static_cast<unsigned>(_time_point / milliseconds(1));
-
-    sl_dns_packet _pkt((uint16_t)_ms, host);
-    _raw_internal_async_gethostname_udp(move(_pkt), move(nameserver_list), 0, fp);
+    _raw_internal_async_gethostname(host, nameserver_list, sl_peerinfo::nan(), fp);
 }
 
 /*
@@ -1428,17 +3815,58 @@ void sl_async_gethostname(
     async_dns_handler fp
 )
 {
-    auto _now = system_clock::now();
-    auto _time_point = _now.time_since_epoch();
-    _time_point -= duration_cast<seconds>(_time_point); 
-    auto _ms = static_cast<unsigned>(_time_point / milliseconds(1));
+    _raw_internal_async_gethostname(host, nameserver_list, socks5, fp);
+}
 
-    sl_dns_packet _pkt((uint16_t)_ms, host);
-    if ( socks5 ) {
-        _raw_internal_async_gethostname_tcp(move(_pkt), move(nameserver_list), 0, socks5, fp);
-    } else {
-        _raw_internal_async_gethostname_udp(move(_pkt), move(nameserver_list), 0, fp);
+// Redirect the dns query packet to the nameserver via tcp, the handler
+// will be invoked with false if failed to get any response.
+void _raw_internal_dns_redirect_tcp(
+    const sl_dns_packet & dpkt,
+    const sl_peerinfo &nameserver,
+    const sl_peerinfo &socks5,
+    sl_dns_reply_handler fp
+)
+{
+    auto _start = steady_clock::now();
+    _raw_internal_dns_tcp_query(dpkt, nameserver, socks5, 5000, 
+        [=](bool ret, const sl_dns_packet& rpkt) {
+        uint32_t _rtt = (uint32_t)duration_cast<milliseconds>(steady_clock::now() - _start).count();
+        _raw_internal_dns_upstream_update(nameserver, ret, _rtt);
+        fp(ret, rpkt);
+    });
+}
+
+// Check if the redirected response can be returned to the client
+bool _raw_internal_dns_redirect_accept(const sl_dns_packet& rpkt)
+{
+    return rpkt.get_resp_code() != sl_dns_rcode_server_failure &&
+        rpkt.get_resp_code() != sl_dns_rcode_refuse;
+}
+
+// Try the nameservers from <use_index> in order via tcp, till the first
+// accepted response.
+void _raw_internal_dns_redirect_tcp_next(
+    const sl_dns_packet & dpkt,
+    const vector<sl_peerinfo> &nameserver_list,
+    size_t use_index,
+    const sl_peerinfo &socks5,
+    const sl_dns_packet & last_reply,
+    sl_dns_reply_handler fp
+)
+{
+    if ( nameserver_list.size() <= use_index ) {
+        fp(false, last_reply);
+        return;
     }
+    _raw_internal_dns_redirect_tcp(dpkt, nameserver_list[use_index], socks5, 
+        [=](bool ret, const sl_dns_packet& rpkt) {
+        if ( ret && _raw_internal_dns_redirect_accept(rpkt) ) {
+            fp(true, rpkt);
+            return;
+        }
+        _raw_internal_dns_redirect_tcp_next(dpkt, nameserver_list, use_index + 1, 
+            socks5, (ret ? rpkt : last_reply), fp);
+    });
 }
 
 /*!
@@ -1454,54 +3882,58 @@ void sl_async_redirect_dns_query(
     async_dns_redirector fp
 )
 {
-    auto _errorfp = [=]() {
+    sl_async_redirect_dns_query(dpkt, vector<sl_peerinfo>{nameserver}, socks5, force_tcp, fp);
+}
+
+/*!
+    Redirect a dns query packet to a list of nameservers, and return the first
+    response which is neither SERVFAIL nor REFUSED.
+*/
+void sl_async_redirect_dns_query(
+    const sl_dns_packet & dpkt,
+    const vector<sl_peerinfo> &nameserver_list,
+    const sl_peerinfo &socks5,
+    bool force_tcp,
+    async_dns_redirector fp
+)
+{
+    // Answer with the cached response packet
+    string _key = sl_dns_cache::make_key(dpkt, nameserver_list, socks5);
+    sl_dns_packet _cached;
+    if ( sl_dns_cache::server().get(_key, dpkt, _cached) ) {
+        if ( fp ) fp(_cached);
+        return;
+    }
+
+    auto _resultfp = [=](bool ret, const sl_dns_packet& rpkt) {
+        if ( ret ) sl_dns_cache::server().set(_key, rpkt);
+        if ( !fp ) return;
+        // All nameservers failed, answer with the expired response
+        sl_dns_packet _stale;
+        if ( !ret && sl_dns_cache::server().get_stale(_key, dpkt, _stale) ) {
+            fp(_stale);
+            return;
+        }
+        // Return the last error response if any nameserver has answered
+        if ( ret || rpkt.get_is_query_request() == false ) {
+            fp(rpkt);
+            return;
+        }
         sl_dns_packet _dpkt(dpkt);
         // This is a response
         _dpkt.set_is_query_request(false);
         _dpkt.set_resp_code(sl_dns_rcode_server_failure);
-        if ( fp ) fp(_dpkt);
+        fp(_dpkt);
     };
     if ( socks5 || force_tcp ) {
-        sl_tcp_socket_connect(socks5, nameserver.ipaddress, nameserver.port_number, 5, [=](sl_event e) {
-            if ( e.event != SL_EVENT_CONNECT ) {
-                // Failed
-                _errorfp();
-                return;
-            }
-            sl_events::server().append_handler(e.so, SL_EVENT_FAILED | SL_EVENT_TIMEOUT, [=](sl_event e) {
-                _errorfp();
-            });
-            sl_tcp_socket_send(e.so, dpkt.to_tcp_packet(), [=](sl_event e) {
-                sl_socket_monitor(e.so, 5, [=](sl_event e) {
-                    string _rpkt;
-                    if ( !sl_tcp_socket_read(e.so, _rpkt) ) {
-                        sl_socket_close(e.so);
-                        _errorfp();
-                        return;
-                    }
-                    sl_socket_close(e.so);
-                    sl_dns_packet _dpkt(_rpkt, true);
-                    if ( fp ) fp(_dpkt);
-                });
-            });
-        });
+        _raw_internal_dns_redirect_tcp_next(dpkt, 
+            _raw_internal_dns_upstream_order(nameserver_list, 0), 0, 
+            socks5, sl_dns_packet(), _resultfp);
     } else {
-        SOCKET_T _uso = sl_udp_socket_init();
-        sl_events::server().append_handler(_uso, SL_EVENT_FAILED | SL_EVENT_TIMEOUT, [=](sl_event e) {
-            _errorfp();
-        });
-        sl_udp_socket_send(_uso, nameserver, dpkt, [=](sl_event e) {
-            sl_socket_monitor(_uso, 3, [=](sl_event e) {
-                string _rpkt;
-                if ( !sl_udp_socket_read(e.so, e.address, _rpkt) ) {
-                    sl_socket_close(e.so);
-                    _errorfp();
-                    return;
-                }
-                sl_socket_close(e.so);
-                sl_dns_packet _dpkt(_rpkt);
-                if ( fp ) fp(_dpkt);
-            });
+        // The resolver restores the transaction id of the response
+        _raw_internal_dns_race(dpkt, nameserver_list, 0, _raw_internal_dns_redirect_accept,
+            [=](bool ret, const sl_dns_packet& rpkt, const sl_peerinfo&) {
+            _resultfp(ret, rpkt);
         });
     }
 }
@@ -387,12 +387,15 @@ sl_iprange::operator const string() const {
     string _highstr = sl_ip(high_);
     return _lowstr + " - " + _highstr;
 }
-bool sl_iprange::is_ip_in_range(const sl_ip& ip) {
-    uint32_t _ip = ntohl(ip);
+bool sl_iprange::is_ip_in_range(const sl_ip& ip) const {
+    return this->is_ip_in_range((uint32_t)ip);
+    //return ip >= sl_ip(low_) && ip <= sl_ip(high_);
+}
+bool sl_iprange::is_ip_in_range(uint32_t inaddr) const {
+    uint32_t _ip = ntohl(inaddr);
     uint32_t _low = ntohl(low_);
     uint32_t _high = ntohl(high_);
     return _ip >= _low && _ip <= _high;
-    //return ip >= sl_ip(low_) && ip <= sl_ip(high_);
 }
 sl_iprange::operator bool() const {
     return low_ != (uint32_t)-1 && high_ != (uint32_t)-1;
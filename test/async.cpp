@@ -30,6 +30,16 @@ void dump_iplist(const string& domain, const vector<sl_ip> & iplist) {
 
 string _socks5 = "127.0.0.1:1080";
 
+// Ask for the hot name every 10 seconds, it is refreshed before its answer
+// expires, so all queries after the first one hit the cache.
+void query_hot_name() {
+    sl_async_gethostname("www.taobao.com", [](const vector<sl_ip> & iplist) {
+        dump_iplist("www.taobao.com", iplist);
+        linfo << "dns prefetch count: " << sl_dns_prefetch_count() << lend;
+        sl_events::server().add_timer(10000, query_hot_name);
+    });
+}
+
 int main( int argc, char * argv[] )
 {
     if ( argc == 2 ) {
@@ -50,6 +60,32 @@ int main( int argc, char * argv[] )
     sl_async_gethostname("www.dianping.com", bind(dump_iplist, "www.dianping.com", placeholders::_1));
     sl_async_gethostname("www.google.com", {sl_peerinfo("8.8.8.8:53")}, _socks5, bind(dump_iplist, "www.google.com", placeholders::_1));
 
+    // The same name in any case is answered from the cache after the first query
+    sl_dns_cache::server().setup();
+    sl_async_gethostname("www.qq.com", [](const vector<sl_ip> & iplist) {
+        sl_async_gethostname("WWW.QQ.Com", [](const vector<sl_ip> & iplist) {
+            dump_iplist("WWW.QQ.Com", iplist);
+            linfo << "dns cache hit: " << sl_dns_cache::server().hit_count() 
+                << ", miss: " << sl_dns_cache::server().miss_count() 
+                << ", size: " << sl_dns_cache::server().size() << lend;
+        });
+    });
+
+    sl_dns_prefetch_setup();
+    query_hot_name();
+
+    // The tcp queries via the socks5 proxy share one pipelined connection
+    sl_dns_tcp_setup();
+    for ( auto _host : {"www.github.com", "www.youtube.com", "www.twitter.com", "www.facebook.com"} ) {
+        string _domain(_host);
+        sl_async_gethostname(_domain, {sl_peerinfo("8.8.8.8:53")}, _socks5, bind(dump_iplist, _domain, placeholders::_1));
+    }
+    sl_async_redirect_dns_query(sl_dns_packet(0x5a5a, "www.wikipedia.org"), sl_peerinfo("8.8.8.8:53"), 
+        sl_peerinfo::nan(), true, [](const sl_dns_packet& rpkt) {
+        linfo << "tcp redirect id: " << rpkt.get_transaction_id() << lend;
+        dump_iplist("www.wikipedia.org", rpkt.get_A_records());
+    });
+
     sl_tcp_socket_connect(sl_peerinfo::nan(), "www.baidu.com", 80, 3, [](sl_event e) {
         if ( e.event != SL_EVENT_CONNECT ) {
             lerror << "failed to connect to www.baidu.com, " << e << lend;
@@ -72,6 +108,33 @@ int main( int argc, char * argv[] )
         });
     });
 
+    // Fetch twice via the connection pool, the second one reuses the socket
+    sl_tcp_socket_pool_setup(10, 8);
+    sl_tcp_socket_pool_connect(sl_peerinfo::nan(), "www.baidu.com", 80, 3, [](sl_event e) {
+        if ( e.event != SL_EVENT_CONNECT ) {
+            lerror << "failed to connect to www.baidu.com via the pool, " << e << lend;
+            return;
+        }
+        string _http_pkt = "HEAD / HTTP/1.1\r\nHost: www.baidu.com\r\n\r\n";
+        sl_tcp_socket_send(e.so, _http_pkt, [](sl_event e) {
+            sl_socket_monitor(e.so, 3, [](sl_event e) {
+                string _http_resp;
+                sl_tcp_socket_read(e.so, _http_resp);
+                ldebug << "pooled response size: " << _http_resp.size() << lend;
+                SOCKET_T _so = e.so;
+                sl_tcp_socket_pool_release(e.so);
+                sl_tcp_socket_pool_connect(sl_peerinfo::nan(), "www.baidu.com", 80, 3, [_so](sl_event e) {
+                    if ( e.event != SL_EVENT_CONNECT ) {
+                        lerror << "failed to get a pooled connection, " << e << lend;
+                        return;
+                    }
+                    linfo << "pooled connection " << e.so << " reused: " << (e.so == _so) << lend;
+                    sl_tcp_socket_pool_release(e.so);
+                });
+            });
+        });
+    });
+
     SOCKET_T _ulso = sl_udp_socket_init(sl_peerinfo(INADDR_ANY, 2000));
     sl_udp_socket_listen(_ulso, [](sl_event e) {
         string _dnspkt;
@@ -143,6 +206,14 @@ int main( int argc, char * argv[] )
     sl_tcp_socket_listen(sl_peerinfo(INADDR_ANY, 58423), [](sl_event e){
         sl_tcp_socket_redirect(e.so, sl_peerinfo("10.15.11.1:38422"), sl_peerinfo::nan());
     });
+
+    // Accept on one socket per CPU core, each in its own thread
+    vector<SOCKET_T> _rplsos = sl_tcp_socket_listen_reuseport(sl_peerinfo(INADDR_ANY, 58424), 0, [](sl_event e) {
+        linfo << "accept " << e.so << " on the reuseport socket " << e.source 
+            << ", total: " << sl_tcp_socket_accept_count(e.source) << lend;
+        sl_socket_close(e.so);
+    });
+    linfo << "listen on port 58424 with " << _rplsos.size() << " reuseport sockets" << lend;
     return 0;
 }
 